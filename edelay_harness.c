@@ -0,0 +1,1146 @@
+//
+// Runs the relay on loopback between a paced RTMP-like traffic generator and a stand-in for the upstream server,
+// and reports the achieved delay, the release jitter, the throughput and the relay's CPU time
+//
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <libgen.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "edelay_time.h"
+#include "c23_compat.h"
+
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+#define MAX(x, y) (((x) > (y)) ? (x) : (y))
+#define COUNT_OF(a) (sizeof(a) / sizeof((a)[0]))
+
+/**
+ * The port the relay listens on
+ */
+#define HARNESS_RELAY_PORT 1935
+#define HARNESS_MAX_STREAMS 256
+#define HARNESS_MAX_PACKET_SIZES 32
+#define HARNESS_DEFAULT_BITRATE_KBPS 6000
+#define HARNESS_DEFAULT_DURATION_S 20
+#define HARNESS_DEFAULT_DELAY_MS "1000"
+#define HARNESS_DEFAULT_FPS 30
+#define HARNESS_DEFAULT_PACKET_SIZE 1400
+/**
+ * How long the relay gets to forward the end of the streams after the generators are done, on top of the delay
+ */
+#define HARNESS_DRAIN_NS (3 * EDELAY_NS_PER_S)
+#define HARNESS_STARTUP_TIMEOUT_MS 5000
+/**
+ * A write that starts later than this after it was due counts as late, the generator couldn't keep up
+ */
+#define HARNESS_LATE_WRITE_NS (1 * EDELAY_NS_PER_MS)
+
+#define HARNESS_RTMP_HANDSHAKE_SIZE 1536
+/**
+ * The server's side of the handshake, S0, S1 and S2, that the sink sends back through the relay
+ */
+#define HARNESS_RTMP_REPLY_SIZE (1 + 2 * HARNESS_RTMP_HANDSHAKE_SIZE)
+#define HARNESS_RTMP_CHUNK_SIZE 4096
+#define HARNESS_RTMP_CSID_CONTROL 2
+#define HARNESS_RTMP_CSID_AUDIO 4
+#define HARNESS_RTMP_CSID_VIDEO 6
+#define HARNESS_RTMP_SET_CHUNK_SIZE 1
+#define HARNESS_RTMP_AUDIO 8
+#define HARNESS_RTMP_VIDEO 9
+/**
+ * The audio part of the synthetic stream, and how often a key frame comes
+ */
+#define HARNESS_AUDIO_BITRATE_KBPS 128
+#define HARNESS_AUDIO_MESSAGES_PER_S 50
+#define HARNESS_KEYFRAME_INTERVAL_S 2
+/**
+ * How much larger a key frame is than the other frames
+ */
+#define HARNESS_KEYFRAME_WEIGHT 4
+
+typedef enum {
+    /**
+     * Each frame is written at once when it is due, in packets back to back, the way an encoder does it
+     */
+    HARNESS_PROFILE_FRAMES = 0,
+    /**
+     * The packets are spread evenly at the bitrate
+     */
+    HARNESS_PROFILE_SMOOTH = 1
+} harness_profile_t;
+
+typedef struct {
+    const char *relay_path;
+    /**
+     * The arguments passed to the relay on top of -d and -u
+     */
+    char **relay_args;
+    int relay_arg_count;
+    const char *delay_ms;
+    int64_t delay_ns;
+    int64_t bitrate_bps;
+    int64_t duration_ns;
+    int fps;
+    int streams;
+    harness_profile_t profile;
+    size_t packet_sizes[HARNESS_MAX_PACKET_SIZES];
+    size_t packet_size_count;
+    /**
+     * The recorded stream to replay instead of the synthetic one, nullptr for none
+     */
+    uint8_t *replay;
+    size_t replay_size;
+    bool json;
+} harness_config_t;
+
+/**
+ * How many bytes of a stream had been written or received by the time
+ */
+typedef struct {
+    uint64_t offset;
+    int64_t time;
+} harness_event_t;
+
+typedef struct {
+    harness_event_t *events;
+    size_t count;
+    size_t capacity;
+} harness_events_t;
+
+typedef struct {
+    int index;
+    const harness_config_t *config;
+    pthread_t thread;
+
+    /**
+     * The generator's side, only touched by its thread
+     */
+    harness_events_t writes;
+    uint64_t late_writes;
+    uint8_t *buffer;
+    size_t buffer_size;
+    size_t buffer_capacity;
+    int64_t next_audio;
+    uint64_t frame;
+    /**
+     * How much of the sink's reply has come back through the relay
+     */
+    size_t replied;
+    bool failed;
+
+    /**
+     * The sink's side, only touched by the sink thread
+     */
+    harness_events_t arrivals;
+    bool finished;
+} harness_stream_t;
+
+/**
+ * A connection from the relay to the sink, not yet known to belong to a stream until the first bytes are in
+ */
+typedef struct {
+    int fd;
+    harness_stream_t *stream;
+    uint8_t id[5];
+    size_t id_size;
+} harness_connection_t;
+
+typedef struct {
+    int listen_fd;
+    harness_stream_t *streams;
+    int stream_count;
+    /**
+     * When the sink stops waiting for the streams to end, 0 while the generators are still running
+     */
+    _Atomic int64_t deadline;
+    pthread_t thread;
+} harness_sink_t;
+
+/**
+ * The bounds of the jitter histogram's buckets in nanoseconds, the last bucket is open
+ */
+static const int64_t histogram_bounds[] = {
+    10 * EDELAY_NS_PER_US, 20 * EDELAY_NS_PER_US, 50 * EDELAY_NS_PER_US, 100 * EDELAY_NS_PER_US,
+    200 * EDELAY_NS_PER_US, 500 * EDELAY_NS_PER_US, 1 * EDELAY_NS_PER_MS, 2 * EDELAY_NS_PER_MS,
+    5 * EDELAY_NS_PER_MS, 10 * EDELAY_NS_PER_MS, 20 * EDELAY_NS_PER_MS, 50 * EDELAY_NS_PER_MS,
+    100 * EDELAY_NS_PER_MS
+};
+
+typedef struct {
+    /**
+     * Values below 0 go to the first bucket, then one bucket per bound and one past the last bound
+     */
+    uint64_t buckets[COUNT_OF(histogram_bounds) + 2];
+    uint64_t count;
+} harness_histogram_t;
+
+static bool events_add(harness_events_t *events, const uint64_t offset, const int64_t time) {
+    if (events->count == events->capacity) {
+        const size_t capacity = MAX(events->capacity * 2, 1024);
+        harness_event_t *grown = realloc(events->events, capacity * sizeof(*grown));
+        if (grown == nullptr)
+            return false;
+        events->events = grown;
+        events->capacity = capacity;
+    }
+
+    events->events[events->count++] = (harness_event_t) {offset, time};
+    return true;
+}
+
+static void histogram_add(harness_histogram_t *histogram, const int64_t value) {
+    size_t bucket = 0;
+    if (value >= 0) {
+        bucket = 1;
+        while (bucket - 1 < COUNT_OF(histogram_bounds) && value >= histogram_bounds[bucket - 1])
+            bucket++;
+    }
+    histogram->buckets[bucket]++;
+    histogram->count++;
+}
+
+static int compare_int64(const void *a, const void *b) {
+    const int64_t x = *(const int64_t *) a;
+    const int64_t y = *(const int64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Make room for more bytes at the end of the stream's pending buffer.
+ *
+ * @param [in] stream the stream
+ * @param [in] size how many bytes are going to be appended
+ * @returns A pointer to the room, or nullptr if failed
+ */
+static uint8_t *stream_append(harness_stream_t *stream, const size_t size) {
+    if (stream->buffer_size + size > stream->buffer_capacity) {
+        const size_t capacity = MAX(stream->buffer_capacity * 2, stream->buffer_size + size);
+        uint8_t *grown = realloc(stream->buffer, capacity);
+        if (grown == nullptr)
+            return nullptr;
+        stream->buffer = grown;
+        stream->buffer_capacity = capacity;
+    }
+
+    uint8_t *room = stream->buffer + stream->buffer_size;
+    stream->buffer_size += size;
+    return room;
+}
+
+/**
+ * Append an RTMP message, split into chunks.
+ *
+ * @param [in] stream the stream
+ * @param [in] csid the chunk stream id
+ * @param [in] type the message type
+ * @param [in] timestamp the message timestamp in milliseconds
+ * @param [in] payload the first bytes of the payload
+ * @param [in] payload_prefix how many bytes of the payload are given, the rest is filler
+ * @param [in] size the size of the payload
+ * @returns true if succeeded, false if failed
+ */
+static bool stream_put_message(harness_stream_t *stream, const uint8_t csid, const uint8_t type,
+                               const uint32_t timestamp, const uint8_t *payload, const size_t payload_prefix,
+                               const size_t size) {
+    const size_t chunks = size == 0 ? 1 : (size + HARNESS_RTMP_CHUNK_SIZE - 1) / HARNESS_RTMP_CHUNK_SIZE;
+    uint8_t *out = stream_append(stream, 12 + size + (chunks - 1));
+    if (out == nullptr)
+        return false;
+
+    // A type 0 header: the timestamp, the length, the type and the message stream id, little endian for once
+    const uint32_t message_stream = csid == HARNESS_RTMP_CSID_CONTROL ? 0 : 1;
+    *out++ = csid;
+    *out++ = timestamp >> 16 & 0xff;
+    *out++ = timestamp >> 8 & 0xff;
+    *out++ = timestamp & 0xff;
+    *out++ = size >> 16 & 0xff;
+    *out++ = size >> 8 & 0xff;
+    *out++ = size & 0xff;
+    *out++ = type;
+    *out++ = message_stream & 0xff;
+    *out++ = message_stream >> 8 & 0xff;
+    *out++ = message_stream >> 16 & 0xff;
+    *out++ = message_stream >> 24 & 0xff;
+
+    for (size_t i = 0; i < size; i++) {
+        if (i > 0 && i % HARNESS_RTMP_CHUNK_SIZE == 0)
+            // A type 3 header continues the message
+            *out++ = 3 << 6 | csid;
+        *out++ = i < payload_prefix ? payload[i] : (uint8_t) i;
+    }
+    return true;
+}
+
+/**
+ * Append the client's side of the handshake and the chunk size. The stream's number goes into the time field
+ * of C1, that's how the sink tells the streams apart.
+ *
+ * @param [in] stream the stream
+ * @returns true if succeeded, false if failed
+ */
+static bool stream_put_preamble(harness_stream_t *stream) {
+    uint8_t *out = stream_append(stream, 1 + 2 * HARNESS_RTMP_HANDSHAKE_SIZE);
+    if (out == nullptr)
+        return false;
+
+    out[0] = 3;
+    for (size_t i = 1; i <= 2 * HARNESS_RTMP_HANDSHAKE_SIZE; i++)
+        out[i] = (uint8_t) (i * 31);
+    out[1] = stream->index >> 24 & 0xff;
+    out[2] = stream->index >> 16 & 0xff;
+    out[3] = stream->index >> 8 & 0xff;
+    out[4] = stream->index & 0xff;
+
+    const uint8_t chunk_size[4] = {
+        HARNESS_RTMP_CHUNK_SIZE >> 24 & 0xff, HARNESS_RTMP_CHUNK_SIZE >> 16 & 0xff,
+        HARNESS_RTMP_CHUNK_SIZE >> 8 & 0xff, HARNESS_RTMP_CHUNK_SIZE & 0xff
+    };
+    return stream_put_message(stream, HARNESS_RTMP_CSID_CONTROL, HARNESS_RTMP_SET_CHUNK_SIZE, 0, chunk_size,
+                              sizeof(chunk_size), sizeof(chunk_size));
+}
+
+/**
+ * Append the next video frame of the synthetic stream, with the audio that is due by then.
+ *
+ * @param [in] stream the stream
+ * @param [in] frame_time the frame's time since the start of the stream in nanoseconds
+ * @returns true if succeeded, false if failed
+ */
+static bool stream_put_frame(harness_stream_t *stream, const int64_t frame_time) {
+    const harness_config_t *config = stream->config;
+    int64_t audio_bps = HARNESS_AUDIO_BITRATE_KBPS * 1000;
+    if (audio_bps > config->bitrate_bps / 4)
+        audio_bps = 0;
+
+    for (; audio_bps > 0 && stream->next_audio <= frame_time;
+           stream->next_audio += EDELAY_NS_PER_S / HARNESS_AUDIO_MESSAGES_PER_S) {
+        // AAC, raw frame
+        const uint8_t header[2] = {0xaf, 0x01};
+        if (!stream_put_message(stream, HARNESS_RTMP_CSID_AUDIO, HARNESS_RTMP_AUDIO,
+                                (uint32_t) (stream->next_audio / EDELAY_NS_PER_MS), header, sizeof(header),
+                                (size_t) (audio_bps / 8 / HARNESS_AUDIO_MESSAGES_PER_S)))
+            return false;
+    }
+
+    // The key frames are heavier, the other frames make up for it so that the bitrate stays the same
+    const int64_t gop = (int64_t) config->fps * HARNESS_KEYFRAME_INTERVAL_S;
+    const int64_t average = (config->bitrate_bps - audio_bps) / 8 / config->fps;
+    const int64_t inter = average * gop / (gop + HARNESS_KEYFRAME_WEIGHT - 1);
+    const bool keyframe = stream->frame % gop == 0;
+
+    // AVC, a key or an inter frame, a NALU
+    const uint8_t header[5] = {keyframe ? 0x17 : 0x27, 0x01, 0x00, 0x00, 0x00};
+    const size_t size = (size_t) MAX(keyframe ? inter * HARNESS_KEYFRAME_WEIGHT : inter, (int64_t) sizeof(header));
+    stream->frame++;
+    return stream_put_message(stream, HARNESS_RTMP_CSID_VIDEO, HARNESS_RTMP_VIDEO,
+                              (uint32_t) (frame_time / EDELAY_NS_PER_MS), header, sizeof(header), size);
+}
+
+/**
+ * A byte of the reply the sink sends for a stream, the stream's number goes into the time field of S1.
+ *
+ * @param [in] index the stream's number
+ * @param [in] offset the byte's offset in the reply
+ * @returns The byte
+ */
+static uint8_t harness_reply_byte(const int index, const size_t offset) {
+    if (offset == 0)
+        return 3;
+    if (offset <= 4)
+        return (uint32_t) index >> (4 - offset) * 8 & 0xff;
+    return (uint8_t) (offset * 29);
+}
+
+static int harness_connect_relay(void) {
+    const int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return -1;
+
+    const struct sockaddr_in address = {
+        .sin_family = AF_INET,
+        .sin_port = htons(HARNESS_RELAY_PORT),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+    };
+    if (connect(fd, (const struct sockaddr *) &address, sizeof(address)) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    const int yes = 1;
+    (void) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    return fd;
+}
+
+static bool harness_send_all(const int fd, const uint8_t *data, size_t size) {
+    while (size > 0) {
+        const ssize_t sent = send(fd, data, size, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        data += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+/**
+ * Take in what has come back from the relay, it has to be the sink's reply.
+ *
+ * @param [in] stream the stream
+ * @param [in] fd the connection to the relay
+ * @param [in] until when to stop waiting for the rest of the reply, 0 to take only what has arrived already
+ * @returns true if succeeded, false if what came back isn't the reply or the relay has closed the connection
+ */
+static bool harness_read_reply(harness_stream_t *stream, const int fd, const int64_t until) {
+    while (stream->replied < HARNESS_RTMP_REPLY_SIZE) {
+        const int64_t left = until - edelay_now();
+        struct pollfd poll_fd = {.fd = fd, .events = POLLIN};
+        const int ready = poll(&poll_fd, 1, left > 0 ? (int) (left / EDELAY_NS_PER_MS) + 1 : 0);
+        if (ready == -1 && errno == EINTR)
+            continue;
+        if (ready <= 0)
+            return ready == 0;
+
+        uint8_t reply[HARNESS_RTMP_REPLY_SIZE];
+        const ssize_t received = recv(fd, reply, sizeof(reply), MSG_DONTWAIT);
+        if (received == -1 && (errno == EAGAIN || errno == EINTR))
+            continue;
+        if (received <= 0)
+            return false;
+        for (ssize_t i = 0; i < received; i++) {
+            if (stream->replied == HARNESS_RTMP_REPLY_SIZE
+                || reply[i] != harness_reply_byte(stream->index, stream->replied)) {
+                fprintf(stderr, "Stream %d got back what the sink didn't send\n", stream->index);
+                return false;
+            }
+            stream->replied++;
+        }
+    }
+    return true;
+}
+
+/**
+ * Write a stream into the relay: the synthetic one frame by frame, or the recorded one, in packets of the
+ * configured sizes and paced according to the profile.
+ */
+static void *harness_generator_thread(void *arg) {
+    harness_stream_t *stream = arg;
+    const harness_config_t *config = stream->config;
+
+    const int fd = harness_connect_relay();
+    if (fd == -1) {
+        perror("generator connect");
+        stream->failed = true;
+        return nullptr;
+    }
+
+    if (config->replay != nullptr) {
+        uint8_t *copy = stream_append(stream, config->replay_size);
+        if (copy == nullptr)
+            goto fail;
+        memcpy(copy, config->replay, config->replay_size);
+        // The sink tells the streams apart by the bytes where the synthetic stream has its number
+        if (config->streams > 1 && config->replay_size > 4) {
+            copy[1] = stream->index >> 24 & 0xff;
+            copy[2] = stream->index >> 16 & 0xff;
+            copy[3] = stream->index >> 8 & 0xff;
+            copy[4] = stream->index & 0xff;
+        }
+    } else if (!stream_put_preamble(stream)) {
+        goto fail;
+    }
+
+    const bool smooth = config->profile == HARNESS_PROFILE_SMOOTH || config->replay != nullptr;
+    const int64_t start = edelay_now();
+    const int64_t end = start + config->duration_ns;
+    uint64_t sent = 0;
+    size_t position = 0;
+    size_t packet = 0;
+    int64_t tick = start;
+
+    while (true) {
+        if (position == stream->buffer_size) {
+            // The replayed stream is over, or the next frame of the synthetic one is due
+            if (config->replay != nullptr)
+                break;
+            stream->buffer_size = position = 0;
+            tick = start + (int64_t) stream->frame * EDELAY_NS_PER_S / config->fps;
+            if (tick >= end)
+                break;
+            if (!stream_put_frame(stream, tick - start))
+                goto fail;
+        }
+
+        const size_t packet_size = config->packet_sizes[packet++ % config->packet_size_count];
+        const size_t size = MIN(packet_size, stream->buffer_size - position);
+        const int64_t due = smooth ? start + (int64_t) ((double) sent * 8 * EDELAY_NS_PER_S / config->bitrate_bps)
+                                   : tick;
+        if (smooth && due >= end)
+            break;
+
+        const struct timespec due_ts = edelay_ns_to_timespec(due);
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due_ts, nullptr) == EINTR) {
+        }
+
+        const int64_t now = edelay_now();
+        if (now - due > HARNESS_LATE_WRITE_NS)
+            stream->late_writes++;
+        if (!harness_send_all(fd, stream->buffer + position, size)) {
+            perror("generator send");
+            goto fail;
+        }
+        position += size;
+        sent += size;
+        if (!events_add(&stream->writes, sent, now))
+            goto fail;
+        if (!harness_read_reply(stream, fd, 0))
+            goto fail;
+    }
+
+    // The reply comes back once the start of the stream has made it through the delay
+    if (!harness_read_reply(stream, fd, edelay_now() + config->delay_ns + HARNESS_DRAIN_NS))
+        goto fail;
+
+    // The relay forwards the rest and then closes the upstream, that's how the sink knows the stream is over
+    close(fd);
+    return nullptr;
+
+fail:
+    stream->failed = true;
+    close(fd);
+    return nullptr;
+}
+
+/**
+ * Account for the bytes that came from the relay on a connection, finding out the stream on the first ones.
+ *
+ * @param [in] sink the sink
+ * @param [in] connection the connection
+ * @param [in] data the received bytes
+ * @param [in] size the amount of received bytes
+ * @param [in] now when they were received
+ * @returns true if succeeded, false if failed
+ */
+static bool harness_sink_receive(harness_sink_t *sink, harness_connection_t *connection, const uint8_t *data,
+                                 const size_t size, const int64_t now) {
+    if (connection->stream == nullptr) {
+        const size_t part = MIN(size, sizeof(connection->id) - connection->id_size);
+        memcpy(connection->id + connection->id_size, data, part);
+        connection->id_size += part;
+        if (connection->id_size < sizeof(connection->id))
+            return true;
+
+        uint32_t index = 0;
+        if (sink->stream_count > 1)
+            index = (uint32_t) connection->id[1] << 24 | (uint32_t) connection->id[2] << 16
+                    | (uint32_t) connection->id[3] << 8 | connection->id[4];
+        if (index >= (uint32_t) sink->stream_count || sink->streams[index].arrivals.count > 0) {
+            fprintf(stderr, "The sink got a stream it can't tell apart\n");
+            return false;
+        }
+        connection->stream = &sink->streams[index];
+
+        // Answer the way a server answers the handshake, the relay has to pass it back to the generator
+        uint8_t reply[HARNESS_RTMP_REPLY_SIZE];
+        for (size_t i = 0; i < sizeof(reply); i++)
+            reply[i] = harness_reply_byte((int) index, i);
+        if (!harness_send_all(connection->fd, reply, sizeof(reply))) {
+            perror("sink send");
+            return false;
+        }
+        return events_add(&connection->stream->arrivals, connection->id_size - part + size, now);
+    }
+
+    harness_events_t *arrivals = &connection->stream->arrivals;
+    return events_add(arrivals, arrivals->events[arrivals->count - 1].offset + size, now);
+}
+
+/**
+ * Stand in for the upstream server: accept the relay's connections and note when every byte arrives.
+ */
+static void *harness_sink_thread(void *arg) {
+    harness_sink_t *sink = arg;
+    harness_connection_t connections[HARNESS_MAX_STREAMS];
+    int connection_count = 0;
+    int finished = 0;
+    static uint8_t buffer[256 * 1024];
+
+    const int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1) {
+        perror("sink epoll_create1");
+        return nullptr;
+    }
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = nullptr};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sink->listen_fd, &event) == -1) {
+        perror("sink epoll_ctl");
+        goto done;
+    }
+
+    while (finished < sink->stream_count) {
+        const int64_t deadline = atomic_load(&sink->deadline);
+        if (deadline != 0 && edelay_now() >= deadline)
+            break;
+
+        struct epoll_event events[16];
+        const int count = epoll_wait(epoll_fd, events, COUNT_OF(events), 100);
+        for (int i = 0; i < count; i++) {
+            harness_connection_t *connection = events[i].data.ptr;
+            if (connection == nullptr) {
+                const int fd = accept4(sink->listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+                if (fd == -1)
+                    continue;
+                if (connection_count == HARNESS_MAX_STREAMS) {
+                    close(fd);
+                    continue;
+                }
+                connection = &connections[connection_count++];
+                *connection = (harness_connection_t) {.fd = fd};
+                event = (struct epoll_event) {.events = EPOLLIN, .data.ptr = connection};
+                if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1)
+                    perror("sink epoll_ctl");
+                continue;
+            }
+
+            const ssize_t received = recv(connection->fd, buffer, sizeof(buffer), 0);
+            const int64_t now = edelay_now();
+            if (received > 0) {
+                if (harness_sink_receive(sink, connection, buffer, received, now))
+                    continue;
+            } else if (received == -1 && errno == EINTR) {
+                continue;
+            }
+
+            // The stream is over, or the relay gave up on it
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, connection->fd, nullptr);
+            close(connection->fd);
+            connection->fd = -1;
+            if (connection->stream != nullptr && !connection->stream->finished) {
+                connection->stream->finished = true;
+                finished++;
+            }
+        }
+    }
+
+done:
+    for (int i = 0; i < connection_count; i++)
+        if (connections[i].fd != -1)
+            close(connections[i].fd);
+    close(epoll_fd);
+    return nullptr;
+}
+
+static int harness_listen_sink(uint16_t *port) {
+    const int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return -1;
+
+    struct sockaddr_in address = {
+        .sin_family = AF_INET,
+        .sin_port = 0,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+    };
+    socklen_t length = sizeof(address);
+    if (bind(fd, (const struct sockaddr *) &address, sizeof(address)) == -1 || listen(fd, SOMAXCONN) == -1
+        || getsockname(fd, (struct sockaddr *) &address, &length) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    *port = ntohs(address.sin_port);
+    return fd;
+}
+
+/**
+ * Start the relay forwarding to the sink, and wait for it to listen.
+ *
+ * @param [in] config the configuration
+ * @param [in] sink_port the sink's port
+ * @param [out] output_fd the read end of the relay's stdout, kept open so that the relay can keep writing to it
+ * @returns The relay's pid, or -1 if failed
+ */
+static pid_t harness_start_relay(const harness_config_t *config, const uint16_t sink_port, int *output_fd) {
+    char upstream[32];
+    snprintf(upstream, sizeof(upstream), "127.0.0.1:%u", sink_port);
+
+    char *argv[config->relay_arg_count + 6];
+    int argc = 0;
+    argv[argc++] = (char *) config->relay_path;
+    argv[argc++] = "-d";
+    argv[argc++] = (char *) config->delay_ms;
+    argv[argc++] = "-u";
+    argv[argc++] = upstream;
+    for (int i = 0; i < config->relay_arg_count; i++)
+        argv[argc++] = config->relay_args[i];
+    argv[argc] = nullptr;
+
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == -1)
+        return -1;
+
+    const pid_t pid = fork();
+    if (pid == -1) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        execv(config->relay_path, argv);
+        perror("execv");
+        _exit(127);
+    }
+    close(fds[1]);
+    *output_fd = fds[0];
+
+    // The relay says so once it's listening
+    char line[256];
+    size_t size = 0;
+    const int64_t deadline = edelay_now() + HARNESS_STARTUP_TIMEOUT_MS * EDELAY_NS_PER_MS;
+    while (size < sizeof(line) - 1) {
+        struct pollfd pollfd = {.fd = fds[0], .events = POLLIN};
+        const int timeout = (int) ((deadline - edelay_now()) / EDELAY_NS_PER_MS);
+        if (timeout <= 0 || poll(&pollfd, 1, timeout) <= 0)
+            break;
+        const ssize_t got = read(fds[0], line + size, sizeof(line) - 1 - size);
+        if (got <= 0)
+            break;
+        size += got;
+        line[size] = '\0';
+        if (strstr(line, "listening") != nullptr)
+            return pid;
+    }
+
+    fprintf(stderr, "The relay didn't start listening\n");
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+    close(fds[0]);
+    return -1;
+}
+
+typedef struct {
+    int64_t *delays;
+    size_t delay_count;
+    harness_histogram_t error;
+    harness_histogram_t jitter;
+    uint64_t sent_bytes;
+    uint64_t received_bytes;
+    uint64_t late_writes;
+    int64_t first_write;
+    int64_t last_write;
+    int64_t first_arrival;
+    int64_t last_arrival;
+    int complete_streams;
+    int replied_streams;
+} harness_result_t;
+
+/**
+ * Match every write of the streams with the arrival of its last byte at the sink.
+ *
+ * @param [in] config the configuration
+ * @param [in] streams the streams
+ * @param [out] result the delays and the totals
+ * @returns true if succeeded, false if failed
+ */
+static bool harness_analyze(const harness_config_t *config, const harness_stream_t *streams,
+                            harness_result_t *result) {
+    bzero(result, sizeof(*result));
+    result->first_write = result->first_arrival = INT64_MAX;
+    result->last_write = result->last_arrival = INT64_MIN;
+
+    size_t writes = 0;
+    for (int s = 0; s < config->streams; s++)
+        writes += streams[s].writes.count;
+    result->delays = malloc(MAX(writes, 1) * sizeof(*result->delays));
+    if (result->delays == nullptr)
+        return false;
+
+    for (int s = 0; s < config->streams; s++) {
+        const harness_events_t *sent = &streams[s].writes;
+        const harness_events_t *arrived = &streams[s].arrivals;
+        result->late_writes += streams[s].late_writes;
+        if (streams[s].replied == HARNESS_RTMP_REPLY_SIZE)
+            result->replied_streams++;
+        if (sent->count == 0)
+            continue;
+
+        result->sent_bytes += sent->events[sent->count - 1].offset;
+        result->first_write = MIN(result->first_write, sent->events[0].time);
+        result->last_write = MAX(result->last_write, sent->events[sent->count - 1].time);
+        if (arrived->count > 0) {
+            result->received_bytes += arrived->events[arrived->count - 1].offset;
+            result->first_arrival = MIN(result->first_arrival, arrived->events[0].time);
+            result->last_arrival = MAX(result->last_arrival, arrived->events[arrived->count - 1].time);
+            if (arrived->events[arrived->count - 1].offset == sent->events[sent->count - 1].offset)
+                result->complete_streams++;
+        }
+
+        size_t a = 0;
+        int64_t previous_write = -1;
+        int64_t previous_arrival = -1;
+        for (size_t w = 0; w < sent->count; w++) {
+            while (a < arrived->count && arrived->events[a].offset < sent->events[w].offset)
+                a++;
+            if (a == arrived->count)
+                break;
+
+            const int64_t delay = arrived->events[a].time - sent->events[w].time;
+            result->delays[result->delay_count++] = delay;
+            histogram_add(&result->error, delay - config->delay_ns);
+            // How much the spacing of the releases differs from the spacing of the writes
+            if (previous_write != -1)
+                histogram_add(&result->jitter, llabs((arrived->events[a].time - previous_arrival)
+                                                     - (sent->events[w].time - previous_write)));
+            previous_write = sent->events[w].time;
+            previous_arrival = arrived->events[a].time;
+        }
+    }
+
+    qsort(result->delays, result->delay_count, sizeof(*result->delays), compare_int64);
+    return true;
+}
+
+static int64_t result_percentile(const harness_result_t *result, const double quantile) {
+    if (result->delay_count == 0)
+        return 0;
+    return result->delays[(size_t) (quantile * (double) (result->delay_count - 1))];
+}
+
+static double result_rate_kbps(const uint64_t bytes, const int64_t first, const int64_t last) {
+    return last > first ? (double) bytes * 8 * EDELAY_NS_PER_S / (double) (last - first) / 1000 : 0;
+}
+
+static void print_histogram_text(const char *title, const harness_histogram_t *histogram, const bool signed_values) {
+    printf("%s:\n", title);
+    for (size_t i = 0; i < COUNT_OF(histogram->buckets); i++) {
+        if (i == 0 && !signed_values)
+            continue;
+
+        char label[32];
+        if (i == 0)
+            snprintf(label, sizeof(label), "< 0");
+        else if (i == COUNT_OF(histogram->buckets) - 1)
+            snprintf(label, sizeof(label), ">= %" PRId64 " us", (int64_t) (histogram_bounds[i - 2] / EDELAY_NS_PER_US));
+        else
+            snprintf(label, sizeof(label), "< %" PRId64 " us", (int64_t) (histogram_bounds[i - 1] / EDELAY_NS_PER_US));
+        printf("  %-12s %10" PRIu64 " %6.2f%%\n", label, histogram->buckets[i],
+               histogram->count == 0 ? 0.0 : 100.0 * (double) histogram->buckets[i] / (double) histogram->count);
+    }
+}
+
+static void print_histogram_json(const char *name, const harness_histogram_t *histogram) {
+    printf(",\"%s\":{\"bounds_us\":[", name);
+    for (size_t i = 0; i < COUNT_OF(histogram_bounds); i++)
+        printf("%s%" PRId64, i == 0 ? "" : ",", (int64_t) (histogram_bounds[i] / EDELAY_NS_PER_US));
+    printf("],\"counts\":[");
+    for (size_t i = 0; i < COUNT_OF(histogram->buckets); i++)
+        printf("%s%" PRIu64, i == 0 ? "" : ",", histogram->buckets[i]);
+    printf("]}");
+}
+
+static void harness_report(const harness_config_t *config, const harness_result_t *result,
+                           const struct rusage *usage) {
+    const double cpu_s = (double) (usage->ru_utime.tv_sec + usage->ru_stime.tv_sec)
+                         + (double) (usage->ru_utime.tv_usec + usage->ru_stime.tv_usec) / 1e6;
+    const double mbits = (double) result->received_bytes * 8 / 1e6;
+    const double cpu_ms_per_mbit = mbits > 0 ? cpu_s * 1000 / mbits : 0;
+    const double offered = result_rate_kbps(result->sent_bytes, result->first_write, result->last_write);
+    const double achieved = result_rate_kbps(result->received_bytes, result->first_arrival, result->last_arrival);
+    static const struct {
+        const char *name;
+        double quantile;
+    } percentiles[] = {{"min", 0}, {"p50", 0.5}, {"p90", 0.9}, {"p99", 0.99}, {"p999", 0.999}, {"max", 1}};
+
+    if (config->json) {
+        printf("{\"streams\":%d,\"complete_streams\":%d,\"replied_streams\":%d,\"profile\":\"%s\",\"bitrate_kbps\":%" PRId64
+               ",\"configured_delay_ms\":%.3f,\"writes\":%zu,\"late_writes\":%" PRIu64 ",\"sent_bytes\":%" PRIu64
+               ",\"received_bytes\":%" PRIu64 ",\"offered_kbps\":%.1f,\"throughput_kbps\":%.1f"
+               ",\"relay_cpu_s\":%.3f,\"relay_cpu_ms_per_mbit\":%.4f,\"delay_ms\":{",
+               config->streams, result->complete_streams, result->replied_streams,
+               config->replay != nullptr ? "replay" : config->profile == HARNESS_PROFILE_SMOOTH ? "smooth" : "frames",
+               config->bitrate_bps / 1000, (double) config->delay_ns / EDELAY_NS_PER_MS, result->delay_count,
+               result->late_writes, result->sent_bytes, result->received_bytes, offered, achieved, cpu_s,
+               cpu_ms_per_mbit);
+        for (size_t i = 0; i < COUNT_OF(percentiles); i++)
+            printf("%s\"%s\":%.3f", i == 0 ? "" : ",", percentiles[i].name,
+                   (double) result_percentile(result, percentiles[i].quantile) / EDELAY_NS_PER_MS);
+        printf("}");
+        print_histogram_json("release_error", &result->error);
+        print_histogram_json("release_jitter", &result->jitter);
+        printf("}\n");
+        return;
+    }
+
+    printf("streams: %d, %d complete, %d got the server's reply back\n", config->streams, result->complete_streams,
+           result->replied_streams);
+    printf("writes: %zu matched, %" PRIu64 " late by over %lld us\n", result->delay_count, result->late_writes,
+           HARNESS_LATE_WRITE_NS / EDELAY_NS_PER_US);
+    printf("bytes: %" PRIu64 " sent, %" PRIu64 " received\n", result->sent_bytes, result->received_bytes);
+    printf("throughput: %.1f kbit/s offered, %.1f kbit/s out of the relay\n", offered, achieved);
+    printf("relay cpu: %.3f s, %.4f ms per Mbit\n", cpu_s, cpu_ms_per_mbit);
+    printf("delay: configured %.3f ms, achieved", (double) config->delay_ns / EDELAY_NS_PER_MS);
+    for (size_t i = 0; i < COUNT_OF(percentiles); i++)
+        printf(" %s %.3f", percentiles[i].name,
+               (double) result_percentile(result, percentiles[i].quantile) / EDELAY_NS_PER_MS);
+    printf(" ms\n");
+    print_histogram_text("release error (achieved minus configured delay)", &result->error, true);
+    print_histogram_text("release jitter (release spacing against write spacing)", &result->jitter, false);
+}
+
+static bool harness_read_replay(harness_config_t *config, const char *path) {
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size == 0 || (config->replay = malloc(st.st_size)) == nullptr) {
+        close(fd);
+        return false;
+    }
+
+    size_t size = 0;
+    while (size < (size_t) st.st_size) {
+        const ssize_t got = read(fd, config->replay + size, st.st_size - size);
+        if (got <= 0)
+            break;
+        size += got;
+    }
+    close(fd);
+    config->replay_size = size;
+    return size > 0;
+}
+
+static bool harness_parse_sizes(harness_config_t *config, char *list) {
+    config->packet_size_count = 0;
+    for (char *token = strtok(list, ","); token != nullptr; token = strtok(nullptr, ",")) {
+        const long long size = strtoll(token, nullptr, 10);
+        if (size <= 0 || config->packet_size_count == HARNESS_MAX_PACKET_SIZES)
+            return false;
+        config->packet_sizes[config->packet_size_count++] = size;
+    }
+    return config->packet_size_count > 0;
+}
+
+static void print_usage(const char *name) {
+    fprintf(stderr, "Usage: %s [options] [-- relay options]\n"
+            "\t-x, --relay\t\tThe relay binary (default: emergency_delay next to this one)\n"
+            "\t-d, --delay\t\tThe relay's delay in milliseconds, fractions allowed (default: %s)\n"
+            "\t-b, --bitrate\t\tThe stream's bitrate in kbit/s (default: %d)\n"
+            "\t-t, --time\t\tHow long to stream in seconds (default: %d)\n"
+            "\t-c, --streams\t\tHow many streams at once (default: 1)\n"
+            "\t-P, --profile\t\tframes to write each frame at once, smooth to spread the packets (default: frames)\n"
+            "\t-m, --packets\t\tThe packet sizes to cycle through, comma separated (default: %d)\n"
+            "\t-f, --fps\t\tThe synthetic stream's frame rate (default: %d)\n"
+            "\t-r, --replay\t\tReplay a recorded stream at the bitrate rather than a synthetic one\n"
+            "\t-j, --json\t\tReport as a single JSON object\n"
+            "\t-h, --help\t\tShow this help message\n"
+            "The relay listens on port %d, which has to be free.\n",
+            name, HARNESS_DEFAULT_DELAY_MS, HARNESS_DEFAULT_BITRATE_KBPS, HARNESS_DEFAULT_DURATION_S,
+            HARNESS_DEFAULT_PACKET_SIZE, HARNESS_DEFAULT_FPS, HARNESS_RELAY_PORT);
+}
+
+int main(const int argc, char **argv) {
+    static const struct option long_options[] = {
+        {"relay", required_argument, nullptr, 'x'},
+        {"delay", required_argument, nullptr, 'd'},
+        {"bitrate", required_argument, nullptr, 'b'},
+        {"time", required_argument, nullptr, 't'},
+        {"streams", required_argument, nullptr, 'c'},
+        {"profile", required_argument, nullptr, 'P'},
+        {"packets", required_argument, nullptr, 'm'},
+        {"fps", required_argument, nullptr, 'f'},
+        {"replay", required_argument, nullptr, 'r'},
+        {"json", no_argument, nullptr, 'j'},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0}
+    };
+
+    harness_config_t config = {
+        .delay_ms = HARNESS_DEFAULT_DELAY_MS,
+        .bitrate_bps = HARNESS_DEFAULT_BITRATE_KBPS * 1000LL,
+        .duration_ns = HARNESS_DEFAULT_DURATION_S * EDELAY_NS_PER_S,
+        .fps = HARNESS_DEFAULT_FPS,
+        .streams = 1,
+        .profile = HARNESS_PROFILE_FRAMES,
+        .packet_sizes = {HARNESS_DEFAULT_PACKET_SIZE},
+        .packet_size_count = 1
+    };
+
+    // The relay is built next to the harness
+    char relay_path[PATH_MAX];
+    const ssize_t self_size = readlink("/proc/self/exe", relay_path, sizeof(relay_path) - 1);
+    if (self_size > 0) {
+        relay_path[self_size] = '\0';
+        char *directory = dirname(relay_path);
+        memmove(relay_path, directory, strlen(directory) + 1);
+        strncat(relay_path, "/emergency_delay", sizeof(relay_path) - strlen(relay_path) - 1);
+        config.relay_path = relay_path;
+    }
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "x:d:b:t:c:P:m:f:r:jh", long_options, nullptr)) != -1) {
+        bool valid = true;
+        switch (opt) {
+            case 'x':
+                config.relay_path = optarg;
+                break;
+            case 'd': {
+                char *end;
+                const double delay_ms = strtod(optarg, &end);
+                valid = *end == '\0' && delay_ms >= 0;
+                config.delay_ms = optarg;
+                break;
+            }
+            case 'b':
+                config.bitrate_bps = strtoll(optarg, nullptr, 10) * 1000;
+                valid = config.bitrate_bps > 0;
+                break;
+            case 't':
+                config.duration_ns = (int64_t) (strtod(optarg, nullptr) * EDELAY_NS_PER_S);
+                valid = config.duration_ns > 0;
+                break;
+            case 'c':
+                config.streams = (int) strtol(optarg, nullptr, 10);
+                valid = config.streams > 0 && config.streams <= HARNESS_MAX_STREAMS;
+                break;
+            case 'P':
+                valid = strcmp(optarg, "frames") == 0 || strcmp(optarg, "smooth") == 0;
+                config.profile = strcmp(optarg, "smooth") == 0 ? HARNESS_PROFILE_SMOOTH : HARNESS_PROFILE_FRAMES;
+                break;
+            case 'm':
+                valid = harness_parse_sizes(&config, optarg);
+                break;
+            case 'f':
+                config.fps = (int) strtol(optarg, nullptr, 10);
+                valid = config.fps > 0;
+                break;
+            case 'r':
+                if (!harness_read_replay(&config, optarg)) {
+                    perror(optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'j':
+                config.json = true;
+                break;
+            case 'h':
+                print_usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        if (!valid) {
+            fprintf(stderr, "Invalid value for -%c: %s\n", opt, optarg);
+            return EXIT_FAILURE;
+        }
+    }
+    config.relay_args = argv + optind;
+    config.relay_arg_count = argc - optind;
+    config.delay_ns = (int64_t) (strtod(config.delay_ms, nullptr) * EDELAY_NS_PER_MS);
+    if (config.relay_path == nullptr) {
+        fprintf(stderr, "Can't tell where the relay is, pass it with -x\n");
+        return EXIT_FAILURE;
+    }
+
+    harness_stream_t *streams = calloc(config.streams, sizeof(*streams));
+    if (streams == nullptr) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < config.streams; i++) {
+        streams[i].index = i;
+        streams[i].config = &config;
+    }
+
+    uint16_t sink_port = 0;
+    harness_sink_t sink = {
+        .streams = streams,
+        .stream_count = config.streams,
+        .listen_fd = harness_listen_sink(&sink_port)
+    };
+    atomic_init(&sink.deadline, 0);
+    if (sink.listen_fd == -1) {
+        perror("sink listen");
+        return EXIT_FAILURE;
+    }
+
+    int relay_output_fd;
+    const pid_t relay = harness_start_relay(&config, sink_port, &relay_output_fd);
+    if (relay == -1)
+        return EXIT_FAILURE;
+
+    int status = EXIT_SUCCESS;
+    if ((errno = pthread_create(&sink.thread, nullptr, harness_sink_thread, &sink)) != 0) {
+        perror("pthread_create");
+        kill(relay, SIGKILL);
+        return EXIT_FAILURE;
+    }
+    int started = 0;
+    for (; started < config.streams; started++) {
+        if ((errno = pthread_create(&streams[started].thread, nullptr, harness_generator_thread,
+                                    &streams[started])) != 0) {
+            perror("pthread_create");
+            status = EXIT_FAILURE;
+            break;
+        }
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(streams[i].thread, nullptr);
+        if (streams[i].failed)
+            status = EXIT_FAILURE;
+    }
+
+    // The relay still holds the last delay's worth of every stream
+    atomic_store(&sink.deadline, edelay_now() + config.delay_ns + HARNESS_DRAIN_NS);
+    pthread_join(sink.thread, nullptr);
+
+    struct rusage usage;
+    bzero(&usage, sizeof(usage));
+    kill(relay, SIGTERM);
+    while (wait4(relay, nullptr, 0, &usage) == -1 && errno == EINTR) {
+    }
+    close(relay_output_fd);
+    close(sink.listen_fd);
+
+    harness_result_t result;
+    if (!harness_analyze(&config, streams, &result)) {
+        perror("analyze");
+        return EXIT_FAILURE;
+    }
+    harness_report(&config, &result, &usage);
+    if (result.complete_streams != config.streams || result.replied_streams != config.streams)
+        status = EXIT_FAILURE;
+
+    free(result.delays);
+    for (int i = 0; i < config.streams; i++) {
+        free(streams[i].writes.events);
+        free(streams[i].arrivals.events);
+        free(streams[i].buffer);
+    }
+    free(streams);
+    free(config.replay);
+    return status;
+}
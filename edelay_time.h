@@ -0,0 +1,126 @@
+//
+// Monotonic nanosecond timestamps used for the delayed release
+//
+
+#ifndef EMERGENCY_DELAY_EDELAY_TIME_H
+#define EMERGENCY_DELAY_EDELAY_TIME_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "c23_compat.h"
+
+#define EDELAY_NS_PER_US (1000LL)
+#define EDELAY_NS_PER_MS (1000LL * EDELAY_NS_PER_US)
+#define EDELAY_NS_PER_S (1000LL * EDELAY_NS_PER_MS)
+
+static inline int64_t edelay_timespec_to_ns(const struct timespec *ts) {
+    return (int64_t) ts->tv_sec * EDELAY_NS_PER_S + ts->tv_nsec;
+}
+
+static inline struct timespec edelay_ns_to_timespec(const int64_t ns) {
+    const struct timespec ts = {
+        .tv_sec = ns / EDELAY_NS_PER_S,
+        .tv_nsec = ns % EDELAY_NS_PER_S
+    };
+    return ts;
+}
+
+/**
+ * Get the current time.
+ *
+ * @returns The current time in nanoseconds of CLOCK_MONOTONIC
+ */
+static inline int64_t edelay_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return edelay_timespec_to_ns(&ts);
+}
+
+/**
+ * Convert a CLOCK_REALTIME timestamp, such as the ones from SO_TIMESTAMPNS, to CLOCK_MONOTONIC.
+ *
+ * @param [in] ts the CLOCK_REALTIME timestamp
+ * @returns The timestamp in nanoseconds of CLOCK_MONOTONIC
+ */
+static inline int64_t edelay_realtime_to_monotonic(const struct timespec *ts) {
+    struct timespec realtime, monotonic;
+    clock_gettime(CLOCK_MONOTONIC, &monotonic);
+    clock_gettime(CLOCK_REALTIME, &realtime);
+    return edelay_timespec_to_ns(ts) - (edelay_timespec_to_ns(&realtime) - edelay_timespec_to_ns(&monotonic));
+}
+
+/**
+ * Move a deadline up to the next point of a grid, so that the deadlines close to each other fall together.
+ *
+ * @param [in] deadline the absolute deadline in nanoseconds of CLOCK_MONOTONIC
+ * @param [in] quantum the spacing of the grid in nanoseconds, 0 to leave the deadline as it is
+ * @returns The deadline on the grid, never earlier than the given one
+ */
+static inline int64_t edelay_round_up(const int64_t deadline, const int64_t quantum) {
+    if (quantum <= 0 || deadline <= 0)
+        return deadline;
+    return (deadline + quantum - 1) / quantum * quantum;
+}
+
+/**
+ * Move a time back to the latest point of a grid, the one the deadlines rounded up to it have fallen due by.
+ *
+ * @param [in] time the absolute time in nanoseconds of CLOCK_MONOTONIC
+ * @param [in] quantum the spacing of the grid in nanoseconds, 0 to leave the time as it is
+ * @returns The time on the grid, never later than the given one
+ */
+static inline int64_t edelay_round_down(const int64_t time, const int64_t quantum) {
+    if (quantum <= 0 || time <= 0)
+        return time;
+    return time - time % quantum;
+}
+
+/**
+ * Sleep until the deadline, regardless of the signals coming in meanwhile.
+ *
+ * @param [in] deadline the absolute deadline in nanoseconds of CLOCK_MONOTONIC
+ */
+static inline void edelay_sleep_until(const int64_t deadline) {
+    const struct timespec ts = edelay_ns_to_timespec(deadline);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR);
+}
+
+/**
+ * How close to a deadline the spin reads the clock after every pause
+ */
+#define EDELAY_SPIN_NEAR_NS (2 * EDELAY_NS_PER_US)
+
+/**
+ * Ease off the core for a moment while spinning, without giving it up.
+ */
+static inline void edelay_cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ volatile("yield");
+#else
+    __asm__ volatile("" ::: "memory");
+#endif
+}
+
+/**
+ * Spin until the deadline without giving up the CPU. Far from the deadline the clock is read less and less often,
+ * close to it after every pause.
+ *
+ * @param [in] deadline the absolute deadline in nanoseconds of CLOCK_MONOTONIC
+ */
+static inline void edelay_spin_until(const int64_t deadline) {
+    for (int pauses = 1;; pauses = pauses < 64 ? pauses * 2 : pauses) {
+        const int64_t remaining = deadline - edelay_now();
+        if (remaining <= 0)
+            return;
+
+        const int count = remaining < EDELAY_SPIN_NEAR_NS ? 1 : pauses;
+        for (int i = 0; i < count; i++)
+            edelay_cpu_relax();
+    }
+}
+
+#endif //EMERGENCY_DELAY_EDELAY_TIME_H
@@ -1,161 +1,590 @@
 #include <netdb.h>
 #include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
-#include <stdatomic.h>
+#include <dirent.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdalign.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <netinet/in.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <assert.h>
+#include <getopt.h>
 
+#include "metrics.h"
 #include "queue.h"
+#include "session.h"
+#ifdef EDELAY_IO_URING
+#include "uring.h"
+#endif
+#include "edelay_time.h"
 #include "c23_compat.h"
 
 #define PORT "1935"
-#define DELAY_US (1000000)
-#define DELAY_MS (DELAY_US / 1000)
-#define DELAY_S (DELAY_MS / 1000)
+#define DEFAULT_DELAY_MS (1000)
 
 #define MIN(x, y) (((x) < (y)) ? (x) : (y))
 
-#define MAX_QUEUED_PACKET_SIZE 2048
+#define MAX_EPOLL_EVENTS 64
+#define MAX_SHARDS 256
+/**
+ * How much of its stream a session keeps in RAM before spilling the older part of it
+ */
+#define SPILL_THRESHOLD (16 * 1024 * 1024)
+/**
+ * The SCHED_FIFO priority of the shards in the real-time mode, above the threaded interrupt handlers' 50
+ */
+#define RT_PRIORITY 60
+/**
+ * How long the real-time shards poll the device queues for new packets before sleeping, in microseconds
+ */
+#define BUSY_POLL_US 50
+/**
+ * How many packets a busy poll takes from the device at once
+ */
+#define BUSY_POLL_BUDGET 64
+/**
+ * The longest the real-time release may spin before a deadline, in microseconds, the spin holds up its whole shard
+ */
+#define MAX_SPIN_US 1000
 
+#ifndef EPIOCSPARAMS
+// Linux 6.9 UAPI, for older headers
+struct epoll_params {
+    uint32_t busy_poll_usecs;
+    uint16_t busy_poll_budget;
+    uint8_t prefer_busy_poll;
+    uint8_t __pad;
+};
+
+#define EPIOCSPARAMS _IOW(0x8A, 0x01, struct epoll_params)
+#endif
+
+/**
+ * A worker thread with its own listener, sessions, queues and timers, sharing nothing on the data path
+ */
 typedef struct {
-    time_t timestamp;
-    char buffer[];
-} queued_packet_t;
+    alignas(QUEUE_CACHE_LINE_SIZE) session_stats_t stats;
+    int index;
+    /**
+     * The CPU the thread is pinned to, or -1 if it isn't pinned
+     */
+    int cpu;
+    int socket_fd;
+    pthread_t thread;
+    session_config_t session_config;
+    /**
+     * The files of the delay windows an earlier relay has left, resumed by the shard before it takes new sessions
+     */
+    char **resume_paths;
+    int resume_count;
+} edelay_shard_t;
 
-queue_t packet_queue;
-atomic_bool client_connected = false;
-atomic_bool cancel_request = false;
+/**
+ * How long the packets are held back, in nanoseconds
+ */
+int64_t delay_ns = DEFAULT_DELAY_MS * EDELAY_NS_PER_MS;
+/**
+ * The destination servers every stream fans out to, it goes to stdout if there are none
+ */
+const char *upstream_hosts[SESSION_MAX_UPSTREAMS];
+const char *upstream_ports[SESSION_MAX_UPSTREAMS];
+int upstream_count = 0;
+/**
+ * How far in bytes an upstream may fall behind the fastest one of its session, 0 for no limit
+ */
+ssize_t max_upstream_lag = 0;
+/**
+ * How many worker threads serve the sessions, 0 for one per available CPU, -1 for a single unpinned one
+ */
+int shard_count = -1;
+/**
+ * Whether the sessions are served with io_uring rather than epoll
+ */
+bool use_uring = false;
+/**
+ * Whether the sessions keep the stream in kernel pipes rather than in queues
+ */
+bool use_splice = false;
+/**
+ * Where the sessions spill the older part of a long delay window to, nullptr to keep all of it in RAM
+ */
+const char *spill_directory = nullptr;
+/**
+ * Where the sessions keep their queues in files that a restarted relay resumes, nullptr to keep them in memory only
+ */
+const char *state_directory = nullptr;
+/**
+ * Whether the shards run pinned under SCHED_FIFO with busy polling, trading cores for an exact release
+ */
+bool real_time = false;
+/**
+ * How long the real-time release spins before every deadline instead of sleeping, in nanoseconds
+ */
+int64_t spin_ns = 0;
+/**
+ * The grid the release deadlines are moved up to, in nanoseconds, 0 to release every packet at its own deadline
+ */
+int64_t release_quantum_ns = 0;
+/**
+ * The capacity every session's queue starts with, and shrinks back to after a burst
+ */
+ssize_t queue_capacity = 4 * SESSION_MAX_PACKET_SIZE;
+/**
+ * How the sessions' queue memory is allocated, QUEUE_MEMORY_* flags
+ */
+uint32_t queue_memory_flags = 0;
+/**
+ * Where the metrics are served as Prometheus text, nullptr for no stats socket
+ */
+const char *stats_socket_path = nullptr;
+/**
+ * Bumped on SIGUSR2, every session dumps its queued stream up to the latest key frame
+ */
+_Atomic uint64_t dump_requests = 0;
 
 const char messij[] = "Hellorld";
 const char messij2[] = "Test1";
 const char messij3[] = "Test2";
 
-void edelay_queue_print_free() {
-    printf("free %zu/%zu\n", queue_free_space(&packet_queue), queue_size(&packet_queue));
-}
-
-void edelay_push_message(const char *message, const ssize_t size) {
-    const bool success = queue_push(&packet_queue, size, message);
+void edelay_push_message(queue_t *queue, const char *message, const ssize_t size) {
+    const bool success = queue_push(queue, size, message, edelay_now());
     if (!success) {
         perror("Epic push fail");
         exit(EXIT_FAILURE);
     }
-
-    edelay_queue_print_free();
 }
 
-bool edelay_pop_verify(const char *message, const ssize_t size) {
+bool edelay_pop_verify(queue_t *queue, const char *message, const ssize_t size) {
     bool success = true;
 
-    char buffer[QUEUE_ITEM_BUFFER_SIZE];
+    char buffer[SESSION_MAX_PACKET_SIZE];
     ssize_t read;
-    const bool result = queue_pop(&packet_queue, sizeof(buffer) / sizeof(char), buffer, &read);
-    printf("Have read %zd bytes\n", read);
+    const bool result = queue_pop(queue, sizeof(buffer) / sizeof(char), buffer, &read);
     if (!result || read < size) {
         perror("Epic pop fail");
         exit(EXIT_FAILURE);
     }
 
-    if (strncmp(buffer, message, MIN(size, read)) != 0) {
-        printf("Not equal to %s\n", message);
+    // The stream may be written to stdout, nothing else goes there
+    if (strncmp(buffer, message, MIN(size, read)) != 0)
         success = false;
+
+    return success;
+}
+
+/**
+ * How many records the concurrency check pushes into a full queue
+ */
+#define CHECK_PUSHES 4000
+
+typedef struct {
+    queue_t *queue;
+    atomic_bool done;
+} edelay_check_pusher_t;
+
+/**
+ * The size of a record of the concurrency check, it starts with the record's sequence number
+ */
+ssize_t edelay_check_record_size(const uint64_t sequence) {
+    return (ssize_t) (sizeof(sequence) + sequence * 61 % (SESSION_MAX_PACKET_SIZE - sizeof(sequence)));
+}
+
+/**
+ * Fill a record of the concurrency check: the sequence number, then bytes that follow from it.
+ *
+ * @param [out] record room for SESSION_MAX_PACKET_SIZE bytes
+ * @param [in] sequence the record's sequence number
+ */
+void edelay_check_fill_record(char *record, const uint64_t sequence) {
+    memcpy(record, &sequence, sizeof(sequence));
+    for (ssize_t i = sizeof(sequence); i < edelay_check_record_size(sequence); i++)
+        record[i] = (char) (sequence + i);
+}
+
+void *edelay_check_pusher(void *arg) {
+    edelay_check_pusher_t *pusher = arg;
+
+    // The queue is full most of the time, so every push grows it or drops the oldest items. Once it can't grow
+    // anymore, the push is tried again after the other thread has made room.
+    char record[SESSION_MAX_PACKET_SIZE];
+    for (uint64_t i = 0; i < CHECK_PUSHES; i++) {
+        edelay_check_fill_record(record, i);
+        while (!queue_push(pusher->queue, edelay_check_record_size(i), record, (int64_t) i))
+            sched_yield();
+    }
+
+    atomic_store_explicit(&pusher->done, true, memory_order_release);
+    return nullptr;
+}
+
+/**
+ * Pop a record of the concurrency check and make sure it's whole and comes after the one popped before it.
+ *
+ * @param [in] queue the queue
+ * @param [in,out] next the lowest sequence number the record may have, moved past it
+ * @param [in,out] popped how many records have been popped, counted up
+ * @returns true if the record is intact or the queue is empty, false if not
+ */
+bool edelay_check_pop_record(queue_t *queue, uint64_t *next, uint64_t *popped) {
+    char buffer[SESSION_MAX_PACKET_SIZE];
+    char expected[SESSION_MAX_PACKET_SIZE];
+    ssize_t written;
+    if (!queue_pop(queue, sizeof(buffer), buffer, &written))
+        return true;
+
+    uint64_t sequence;
+    memcpy(&sequence, buffer, sizeof(sequence));
+    // The records in between may have been dropped or cleared, but never reordered
+    if (sequence < *next || sequence >= CHECK_PUSHES || written != edelay_check_record_size(sequence))
+        return false;
+    edelay_check_fill_record(expected, sequence);
+    if (memcmp(buffer, expected, written) != 0)
+        return false;
+
+    *next = sequence + 1;
+    (*popped)++;
+    return true;
+}
+
+/**
+ * Resize and clear a locked queue from this thread while another one keeps pushing into it while it's full,
+ * so that their relayouts contend for the queue's locks. The pushing thread grows or evicts, and shrinks the queue
+ * back once it's been emptied.
+ *
+ * @param [in] overflow_behavior how the pushing thread makes room
+ * @returns true if every record came out whole and in order or is accounted for, false if not
+ */
+bool edelay_check_locked_relayout(const queue_overflow_behavior_t overflow_behavior) {
+    const queue_config_t config = {
+        .initial_capacity = 4 * SESSION_MAX_PACKET_SIZE,
+        .max_capacity = 16 * SESSION_MAX_PACKET_SIZE,
+        .overflow_behavior = overflow_behavior,
+        .concurrency = QUEUE_CONCURRENCY_LOCKED,
+        .backing = QUEUE_BACKING_HEAP,
+        // Shrunk back by the producer as well, whenever the other thread has just emptied it
+        .shrink_target = 4 * SESSION_MAX_PACKET_SIZE,
+        .shrink_low_water_percent = 25,
+        .shrink_period_ms = 0
+    };
+    queue_t queue;
+    if (!queue_init_config(&queue, &config))
+        return false;
+
+    edelay_check_pusher_t pusher = {.queue = &queue};
+    pthread_t thread;
+    if (pthread_create(&thread, nullptr, edelay_check_pusher, &pusher) != 0) {
+        queue_destroy(&queue);
+        return false;
+    }
+
+    bool success = true;
+    uint64_t next = 0;
+    uint64_t popped = 0;
+    uint64_t cleared = 0;
+    for (int i = 0; !atomic_load_explicit(&pusher.done, memory_order_acquire); i++) {
+        (void) queue_resize(&queue, (i % 4 + 1) * 4 * SESSION_MAX_PACKET_SIZE);
+        success = edelay_check_pop_record(&queue, &next, &popped) && success;
+        if (i % 16 == 0)
+            cleared += queue_clear(&queue);
     }
+    pthread_join(thread, nullptr);
 
-    edelay_queue_print_free();
+    // Every push is either popped, dropped, cleared or still queued
+    queue_stats_t stats;
+    queue_get_stats(&queue, &stats);
+    success = success && stats.dropped_items + popped + cleared + stats.queued_items == CHECK_PUSHES;
+    while (success && !queue_is_empty(&queue))
+        success = edelay_check_pop_record(&queue, &next, &popped);
 
+    queue_destroy(&queue);
     return success;
 }
 
-void *edelay_resend_thread(void *arg) {
-    // TODO: connect to the destination server
+/**
+ * How large the hand-built stream of the RTMP parser check is at most, and how many boundaries it has
+ */
+#define CHECK_RTMP_SIZE 4096
+#define CHECK_RTMP_BOUNDARIES 3
 
-    usleep(DELAY_US);
+typedef struct {
+    uint8_t data[CHECK_RTMP_SIZE];
+    size_t size;
+    /**
+     * Where the messages the stream can be cut in front of start
+     */
+    uint64_t boundaries[CHECK_RTMP_BOUNDARIES];
+    size_t boundary_count;
+} edelay_check_stream_t;
 
-    union {
-        queued_packet_t qp;
-        char buffer[MAX_QUEUED_PACKET_SIZE];
-    } qp_u;
-    qp_u.qp.timestamp = 0;
+void edelay_check_put(edelay_check_stream_t *stream, const uint8_t *bytes, const size_t size) {
+    memcpy(stream->data + stream->size, bytes, size);
+    stream->size += size;
+}
 
-    ssize_t written;
-    while (client_connected) {
-        while (queue_is_empty(&packet_queue)) {
-            sleep(0);
-        }
+/**
+ * Append a chunk's payload, the first byte of it given and the rest zeros.
+ */
+void edelay_check_put_payload(edelay_check_stream_t *stream, const uint8_t first, const size_t size) {
+    stream->data[stream->size] = first;
+    bzero(stream->data + stream->size + 1, size - 1);
+    stream->size += size;
+}
 
-        if (!queue_pop(&packet_queue, sizeof(qp_u.buffer) / sizeof(qp_u.buffer[0]), qp_u.buffer, &written)) {
-            fprintf(stderr, "queue pop fail\n");
-            exit(EXIT_FAILURE);
+/**
+ * Build a stream that goes through every kind of chunk header: a Set Chunk Size, a key frame with an extended
+ * timestamp in two chunks with an audio message in between, audio with type 1 and type 2 headers, an inter frame,
+ * key frames with type 1 and type 3 headers and another key frame. Only the type 0 headers are boundaries.
+ *
+ * @param [out] stream the stream
+ */
+void edelay_check_build_rtmp(edelay_check_stream_t *stream) {
+    bzero(stream, sizeof(*stream));
+
+    // C0, then C1 and C2
+    edelay_check_put_payload(stream, 3, 1 + 2 * RTMP_HANDSHAKE_SIZE);
+
+    // The chunks after this one are up to 256 bytes long rather than 128
+    stream->boundaries[stream->boundary_count++] = stream->size;
+    const uint8_t set_chunk_size[] = {0x02, 0, 0, 0, 0, 0, 4, RTMP_MESSAGE_SET_CHUNK_SIZE, 0, 0, 0, 0};
+    edelay_check_put(stream, set_chunk_size, sizeof(set_chunk_size));
+    const uint8_t chunk_size[] = {0, 0, 1, 0};
+    edelay_check_put(stream, chunk_size, sizeof(chunk_size));
+
+    // A 300 byte key frame, its timestamp doesn't fit the header
+    stream->boundaries[stream->boundary_count++] = stream->size;
+    const uint8_t keyframe[] = {
+        0x06, 0xff, 0xff, 0xff, 0, 0x01, 0x2c, RTMP_MESSAGE_VIDEO, 1, 0, 0, 0, 0x01, 0, 0, 0
+    };
+    edelay_check_put(stream, keyframe, sizeof(keyframe));
+    edelay_check_put_payload(stream, 0x17, 256);
+
+    // Started while the key frame is in the middle of being sent, the stream can't be cut in front of it
+    const uint8_t audio[] = {0x04, 0, 0, 0, 0, 0, 10, RTMP_MESSAGE_AUDIO, 1, 0, 0, 0};
+    edelay_check_put(stream, audio, sizeof(audio));
+    edelay_check_put_payload(stream, 0xaf, 10);
+
+    // The rest of the key frame, a type 3 header repeats the extended timestamp
+    const uint8_t continuation[] = {0xc6, 0x01, 0, 0, 0};
+    edelay_check_put(stream, continuation, sizeof(continuation));
+    edelay_check_put_payload(stream, 0, 44);
+
+    // Audio with a type 1 header, then with a type 2 one that goes on with the same length and type
+    const uint8_t audio_delta[] = {0x44, 0, 0, 20, 0, 0, 20, RTMP_MESSAGE_AUDIO};
+    edelay_check_put(stream, audio_delta, sizeof(audio_delta));
+    edelay_check_put_payload(stream, 0xaf, 20);
+    const uint8_t audio_same[] = {0x84, 0, 0, 20};
+    edelay_check_put(stream, audio_same, sizeof(audio_same));
+    edelay_check_put_payload(stream, 0xaf, 20);
+
+    // An inter frame, then key frames with a type 1 header and a type 3 one that repeats it, which a cut
+    // can't go on from: their timestamp deltas and the latter's length are those of the messages before them
+    const uint8_t inter_frame[] = {0x46, 0, 0, 33, 0, 0, 50, RTMP_MESSAGE_VIDEO};
+    edelay_check_put(stream, inter_frame, sizeof(inter_frame));
+    edelay_check_put_payload(stream, 0x27, 50);
+    const uint8_t delta_keyframe[] = {0x46, 0, 0, 33, 0, 0, 40, RTMP_MESSAGE_VIDEO};
+    edelay_check_put(stream, delta_keyframe, sizeof(delta_keyframe));
+    edelay_check_put_payload(stream, 0x17, 40);
+    const uint8_t repeated_keyframe[] = {0xc6};
+    edelay_check_put(stream, repeated_keyframe, sizeof(repeated_keyframe));
+    edelay_check_put_payload(stream, 0x17, 40);
+
+    // A key frame with a full header
+    stream->boundaries[stream->boundary_count++] = stream->size;
+    const uint8_t next_keyframe[] = {0x06, 0, 0, 0x64, 0, 0, 10, RTMP_MESSAGE_VIDEO, 1, 0, 0, 0};
+    edelay_check_put(stream, next_keyframe, sizeof(next_keyframe));
+    edelay_check_put_payload(stream, 0x17, 10);
+}
+
+/**
+ * Feed the hand-built stream to the RTMP parser in pieces of 1 to max_piece bytes, so that the handshake and
+ * the chunk headers are split all over, and check the boundaries and key frames it indexes.
+ *
+ * @param [in] max_piece the largest piece in bytes
+ * @returns true if the parser indexed the stream right, false if not
+ */
+bool edelay_check_rtmp_parser(const size_t max_piece) {
+    edelay_check_stream_t stream;
+    edelay_check_build_rtmp(&stream);
+
+    rtmp_parser_t parser;
+    if (!rtmp_parser_init(&parser))
+        return false;
+
+    size_t piece = 0;
+    for (size_t offset = 0; offset < stream.size; piece++) {
+        const size_t piece_size = MIN(piece % max_piece + 1, stream.size - offset);
+        // The pieces stand in for records that follow one another in a queue
+        const queue_mark_t mark = {.position = (ssize_t) offset, .sequence = piece};
+        rtmp_parser_feed(&parser, stream.data + offset, piece_size, &mark);
+        offset += piece_size;
+    }
+
+    bool success = parser.state != RTMP_STATE_INVALID && parser.boundary_count == stream.boundary_count;
+    for (size_t i = 0; success && i < stream.boundary_count; i++) {
+        const rtmp_boundary_t *boundary = rtmp_parser_boundary(&parser, (int64_t) i);
+        // Only Set Chunk Size isn't audio or video, the boundaries after it settle at the first one after it
+        success = boundary != nullptr && boundary->stream_offset == stream.boundaries[i]
+                  && (uint64_t) (boundary->mark.position + boundary->offset) == stream.boundaries[i]
+                  && boundary->keyframe == (i == 1 || i == 2)
+                  && boundary->control_count == (i == 0 ? 0 : 1)
+                  && boundary->settled_sequence == (i == 0 ? 0 : 1);
+    }
+
+    const rtmp_boundary_t *keyframe = rtmp_parser_last_keyframe(&parser);
+    success = success && keyframe != nullptr && keyframe->stream_offset == stream.boundaries[2];
+
+    // Once the stream has gone out past the first key frame, it's forgotten, and the cut waits for the last one
+    rtmp_parser_prune(&parser, stream.boundaries[1] + 1);
+    const rtmp_boundary_t *next = rtmp_parser_next_boundary(&parser, 0);
+    success = success && parser.head_sequence == 2 && next == keyframe
+              && rtmp_parser_next_boundary(&parser, stream.boundaries[1] + 1) == keyframe
+              && rtmp_parser_next_boundary(&parser, stream.boundaries[2] + 1) == nullptr;
+
+    rtmp_parser_destroy(&parser);
+    return success;
+}
+
+/**
+ * Accept every pending connection and start a session for each of them.
+ *
+ * @param [in] epoll_fd the epoll instance that drives the sessions
+ * @param [in] socket_fd the non-blocking listening socket
+ * @param [in] config the sessions' configuration
+ */
+void edelay_accept(const int epoll_fd, const int socket_fd, const session_config_t *config) {
+    while (true) {
+        struct sockaddr_storage their_addr;
+        socklen_t sin_size = sizeof their_addr;
+        const int client_fd = accept4(socket_fd, (struct sockaddr *) &their_addr, &sin_size,
+                                      SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept");
+            return;
         }
-        if (written >= 0 && written <= sizeof(qp_u.qp.timestamp))
-            // Empty write
+
+        session_t *session = aligned_alloc(alignof(session_t), sizeof(session_t));
+        if (session == nullptr) {
+            perror("session alloc");
+            close(client_fd);
             continue;
+        }
 
-        // TODO: the resolution is low AF, should switch at least to milliseconds
-        const time_t difference = qp_u.qp.timestamp + DELAY_S - time(nullptr);
-        if (difference > 0)
-            sleep(difference);
+        if (!session_init(session, epoll_fd, client_fd, config))
+            free(session);
+    }
+}
 
-        if (cancel_request) {
-            cancel_request = false;
+/**
+ * Resume the delay windows an earlier relay has left, each in a session of its own.
+ *
+ * @param [in] epoll_fd the epoll instance that drives the sessions
+ * @param [in] paths the files of the windows
+ * @param [in] count the amount of files
+ * @param [in] config the sessions' configuration
+ */
+void edelay_resume(const int epoll_fd, char *const *paths, const int count, const session_config_t *config) {
+    for (int i = 0; i < count; i++) {
+        session_t *session = aligned_alloc(alignof(session_t), sizeof(session_t));
+        if (session == nullptr) {
+            perror("session alloc");
             continue;
         }
 
-        fwrite(qp_u.qp.buffer, sizeof(char), written > 0
-                                                     ? written - sizeof(qp_u.qp.timestamp)
-                                                     : sizeof(qp_u.buffer) / sizeof(char) - sizeof(qp_u.qp.timestamp),
-                   stdout);
-        fflush(stdout);
-
-        // Repeat until we pop out the whole entry
-        // do {
-        //     if (written > sizeof(qp_u.qp.timestamp) || written < 0)
-        //         printf("%lu ", qp_u.qp.timestamp);
-        //     fwrite(qp_u.qp.buffer, sizeof(char), written > 0
-        //                                              ? written - sizeof(qp_u.qp.timestamp)
-        //                                              : sizeof(qp_u.buffer) / sizeof(char) - sizeof(qp_u.qp.timestamp),
-        //            stdout);
-        //
-        //     if (!queue_pop(&packet_queue, sizeof(qp_u.buffer) / sizeof(qp_u.buffer[0]), qp_u.buffer, &written)) {
-        //         fprintf(stderr, "queue pop fail\n");
-        //         exit(EXIT_FAILURE);
-        //     }
-        // } while (written < 0);
+        if (!session_resume(session, epoll_fd, paths[i], config)) {
+            fprintf(stderr, "can't resume %s\n", paths[i]);
+            free(session);
+        }
     }
-
-    return nullptr;
 }
 
-pthread_t edelay_spawn_thread() {
-    pthread_t thread_id;
-    pthread_create(&thread_id, NULL, edelay_resend_thread, nullptr);
-    pthread_detach(thread_id);
+/**
+ * Serve the sessions until something goes terribly wrong.
+ *
+ * @param [in] socket_fd the non-blocking listening socket
+ * @param [in] config the sessions' configuration
+ * @param [in] resume_paths the files of the delay windows to resume first
+ * @param [in] resume_count the amount of files
+ */
+void edelay_serve(const int socket_fd, const session_config_t *config, char *const *resume_paths,
+                  const int resume_count) {
+    const int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1) {
+        perror("epoll_create1");
+        exit(EXIT_FAILURE);
+    }
 
-    return thread_id;
-}
+    // Poll the device queues of the sessions' sockets in epoll_wait before sleeping
+    if (real_time) {
+        const struct epoll_params params = {
+            .busy_poll_usecs = BUSY_POLL_US,
+            .busy_poll_budget = BUSY_POLL_BUDGET,
+            .prefer_busy_poll = 1
+        };
+        if (ioctl(epoll_fd, EPIOCSPARAMS, &params) == -1)
+            perror("epoll busy poll, needs Linux 6.9, only net.core.busy_poll applies");
+    }
 
-int main(void) {
-    if (!queue_init(&packet_queue, 4 * QUEUE_ITEM_SIZE, QUEUE_OVERFLOW_RESIZE)) {
-        perror("queue init failed");
+    // The listening socket is the only one without a source
+    struct epoll_event listener = {
+        .events = EPOLLIN,
+        .data.ptr = nullptr
+    };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, socket_fd, &listener) == -1) {
+        perror("epoll_ctl listener");
         exit(EXIT_FAILURE);
-    } {
-        edelay_queue_print_free();
-        edelay_push_message(messij, sizeof(messij));
-        edelay_push_message(messij2, sizeof(messij2));
-        edelay_push_message(messij3, sizeof(messij3));
+    }
 
-        assert(edelay_pop_verify(messij, sizeof(messij)) == true);
-        assert(edelay_pop_verify(messij3, sizeof(messij3)) == false);
-        assert(edelay_pop_verify(messij3, sizeof(messij3)) == true);
+    edelay_resume(epoll_fd, resume_paths, resume_count, config);
 
-        edelay_push_message(messij, sizeof(messij));
-        assert(edelay_pop_verify(messij, sizeof(messij)) == true);
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    while (true) {
+        const int count = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, -1);
+        if (count == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            exit(EXIT_FAILURE);
+        }
+
+        // Sessions that are over are freed after the batch, their other events in it may still be pending
+        session_t *closed[MAX_EPOLL_EVENTS];
+        int closed_count = 0;
+        for (int i = 0; i < count; i++) {
+            const session_source_t *source = events[i].data.ptr;
+            if (source == nullptr) {
+                edelay_accept(epoll_fd, socket_fd, config);
+                continue;
+            }
+
+            if (!source->session->closed && !session_handle(source, events[i].events)) {
+                session_destroy(source->session);
+                closed[closed_count++] = source->session;
+            }
+        }
+
+        for (int i = 0; i < closed_count; i++)
+            free(closed[i]);
     }
+}
 
+/**
+ * Create the listening socket.
+ *
+ * @param [in] reuse_port whether other sockets may listen on the same port, each taking a share of the connections
+ * @returns The non-blocking listening socket
+ */
+int edelay_listen(const bool reuse_port) {
     // TODO: the rest of the fucking owl
     // Inspired by the Fastest Website Ever:
     // https://github.com/diracdeltas/FastestWebsiteEver/blob/master/server/c/main.c
@@ -177,7 +606,7 @@ int main(void) {
         struct addrinfo *p;
         int yes = 1;
         for (p = server_info; p != NULL; p = p->ai_next) {
-            if ((socket_fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1) {
+            if ((socket_fd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK, p->ai_protocol)) == -1) {
                 perror("server: socket");
                 continue;
             }
@@ -187,11 +616,17 @@ int main(void) {
                 exit(EXIT_FAILURE);
             }
 
-            if (setsockopt(socket_fd, SOL_SOCKET, SO_BUSY_POLL, &yes, sizeof(yes)) == -1) {
-                perror("setsockopt busypoll");
-                // exit(EXIT_FAILURE);
+            if (reuse_port && setsockopt(socket_fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) == -1) {
+                perror("setsockopt reuseport");
+                exit(EXIT_FAILURE);
             }
 
+            // Inherited by the accepted sockets, and raising it takes CAP_NET_ADMIN
+            const int busy_poll_us = BUSY_POLL_US;
+            if (real_time && (setsockopt(socket_fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll_us, sizeof(busy_poll_us)) == -1
+                              || setsockopt(socket_fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &yes, sizeof(yes)) == -1))
+                perror("setsockopt busy poll, needs CAP_NET_ADMIN, only net.core.busy_poll applies");
+
             if (setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)) == -1) {
                 perror("setsockopt tcp nodelay");
                 exit(EXIT_FAILURE);
@@ -213,55 +648,744 @@ int main(void) {
             exit(EXIT_FAILURE);
         }
 
-        if (listen(socket_fd, 0) == -1) {
+        if (listen(socket_fd, SOMAXCONN) == -1) {
             perror("listen");
             exit(EXIT_FAILURE);
         }
     }
 
-    printf("Server listening on port %s\n", PORT);
+    return socket_fd;
+}
 
-    while (true) {
-        struct sockaddr_storage their_addr;
-        socklen_t sin_size = sizeof their_addr;
-        const int client_fd = accept(socket_fd, (struct sockaddr *) &their_addr, &sin_size);
-        if (client_fd == -1) {
-            perror("accept");
+void *edelay_shard_thread(void *arg) {
+    edelay_shard_t *shard = arg;
+
+    if (shard->cpu != -1) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(shard->cpu, &cpus);
+        const int result = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (result != 0)
+            fprintf(stderr, "shard %d: can't pin to cpu %d: %s\n", shard->index, shard->cpu, strerror(result));
+    }
+
+    // Nothing but the interrupts and the other real-time threads get in front of the release
+    if (real_time) {
+        const struct sched_param param = {.sched_priority = RT_PRIORITY};
+        const int result = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (result != 0) {
+            fprintf(stderr, "shard %d: can't run SCHED_FIFO: %s\n", shard->index, strerror(result));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Everything the sessions allocate from now on is local to the shard's CPU
+#ifdef EDELAY_IO_URING
+    if (use_uring) {
+        uring_serve(shard->socket_fd, &shard->session_config);
+        return nullptr;
+    }
+#endif
+    edelay_serve(shard->socket_fd, &shard->session_config, shard->resume_paths, shard->resume_count);
+
+    return nullptr;
+}
+
+/**
+ * Print the counters of a shard.
+ *
+ * @param [in] label what the counters belong to
+ * @param [in] stats the counters
+ * @param [in] lateness the release lateness of the same sessions
+ */
+void edelay_print_counters(const char *label, const session_stats_t *stats,
+                           const metrics_histogram_snapshot_t *lateness) {
+    fprintf(stderr, "%s: sessions %" PRIu64 " active / %" PRIu64 " started, "
+                    "received %" PRIu64 " bytes in %" PRIu64 " packets, "
+                    "released %" PRIu64 " bytes in %" PRIu64 " writes\n",
+            label,
+            atomic_load_explicit(&stats->sessions_active, memory_order_relaxed),
+            atomic_load_explicit(&stats->sessions_started, memory_order_relaxed),
+            atomic_load_explicit(&stats->received_bytes, memory_order_relaxed),
+            atomic_load_explicit(&stats->received_packets, memory_order_relaxed),
+            atomic_load_explicit(&stats->released_bytes, memory_order_relaxed),
+            atomic_load_explicit(&stats->released_writes, memory_order_relaxed));
+    fprintf(stderr, "%s: queued %" PRIu64 " items in %" PRIu64 " / %" PRIu64 " bytes, %" PRIu64 " resizes, "
+                    "dropped %" PRIu64 " items of %" PRIu64 " bytes, %" PRIu64 " upstreams lapsed, "
+                    "late p50 %.3f p99 %.3f p99.9 %.3f max %.3f ms\n",
+            label,
+            atomic_load_explicit(&stats->queued_items, memory_order_relaxed),
+            atomic_load_explicit(&stats->queued_bytes, memory_order_relaxed),
+            atomic_load_explicit(&stats->queue_capacity, memory_order_relaxed),
+            atomic_load_explicit(&stats->queue_resizes, memory_order_relaxed),
+            atomic_load_explicit(&stats->dropped_items, memory_order_relaxed),
+            atomic_load_explicit(&stats->dropped_bytes, memory_order_relaxed),
+            atomic_load_explicit(&stats->upstreams_lapsed, memory_order_relaxed),
+            (double) metrics_histogram_quantile(lateness, 0.5) / EDELAY_NS_PER_MS,
+            (double) metrics_histogram_quantile(lateness, 0.99) / EDELAY_NS_PER_MS,
+            (double) metrics_histogram_quantile(lateness, 0.999) / EDELAY_NS_PER_MS,
+            (double) lateness->max / EDELAY_NS_PER_MS);
+}
+
+/**
+ * Print the counters of every shard and their totals.
+ *
+ * @param [in] shards the shards
+ * @param [in] count the amount of shards
+ */
+void edelay_print_stats(const edelay_shard_t *shards, const int count) {
+    static session_stats_t total;
+    static metrics_histogram_snapshot_t total_lateness;
+    bzero(&total, sizeof(total));
+    bzero(&total_lateness, sizeof(total_lateness));
+
+    for (int i = 0; i < count; i++) {
+        const session_stats_t *stats = &shards[i].stats;
+        char label[64];
+        snprintf(label, sizeof(label), "shard %d (cpu %d)", i, shards[i].cpu);
+
+        metrics_histogram_snapshot_t lateness;
+        bzero(&lateness, sizeof(lateness));
+        metrics_histogram_add_to(&lateness, &stats->release_lateness);
+        metrics_histogram_add_to(&total_lateness, &stats->release_lateness);
+        edelay_print_counters(label, stats, &lateness);
+
+        total.sessions_active += atomic_load_explicit(&stats->sessions_active, memory_order_relaxed);
+        total.sessions_started += atomic_load_explicit(&stats->sessions_started, memory_order_relaxed);
+        total.received_bytes += atomic_load_explicit(&stats->received_bytes, memory_order_relaxed);
+        total.received_packets += atomic_load_explicit(&stats->received_packets, memory_order_relaxed);
+        total.released_bytes += atomic_load_explicit(&stats->released_bytes, memory_order_relaxed);
+        total.released_writes += atomic_load_explicit(&stats->released_writes, memory_order_relaxed);
+        total.queued_items += atomic_load_explicit(&stats->queued_items, memory_order_relaxed);
+        total.queued_bytes += atomic_load_explicit(&stats->queued_bytes, memory_order_relaxed);
+        total.queue_capacity += atomic_load_explicit(&stats->queue_capacity, memory_order_relaxed);
+        total.queue_resizes += atomic_load_explicit(&stats->queue_resizes, memory_order_relaxed);
+        total.dropped_items += atomic_load_explicit(&stats->dropped_items, memory_order_relaxed);
+        total.dropped_bytes += atomic_load_explicit(&stats->dropped_bytes, memory_order_relaxed);
+        total.upstreams_lapsed += atomic_load_explicit(&stats->upstreams_lapsed, memory_order_relaxed);
+    }
+
+    edelay_print_counters("total", &total, &total_lateness);
+}
+
+/**
+ * What the stats socket serves
+ */
+typedef struct {
+    const edelay_shard_t *shards;
+    int count;
+    int socket_fd;
+} edelay_metrics_t;
+
+/**
+ * A counter or gauge of session_stats_t
+ */
+typedef struct {
+    const char *name;
+    const char *type;
+    const char *help;
+    size_t offset;
+} edelay_metric_t;
+
+static const edelay_metric_t edelay_metrics[] = {
+    {"edelay_sessions_started_total", "counter", "Sessions accepted", offsetof(session_stats_t, sessions_started)},
+    {"edelay_sessions_active", "gauge", "Sessions being served", offsetof(session_stats_t, sessions_active)},
+    {"edelay_received_packets_total", "counter", "Receives from the broadcasters",
+     offsetof(session_stats_t, received_packets)},
+    {"edelay_received_bytes_total", "counter", "Bytes received from the broadcasters",
+     offsetof(session_stats_t, received_bytes)},
+    {"edelay_released_writes_total", "counter", "Writes to the upstreams", offsetof(session_stats_t, released_writes)},
+    {"edelay_released_bytes_total", "counter", "Bytes written to the upstreams",
+     offsetof(session_stats_t, released_bytes)},
+    {"edelay_queued_items", "gauge", "Packets held back", offsetof(session_stats_t, queued_items)},
+    {"edelay_queued_bytes", "gauge", "Bytes held back, with the records' headers",
+     offsetof(session_stats_t, queued_bytes)},
+    {"edelay_queue_capacity_bytes", "gauge", "Bytes the queues can hold without growing",
+     offsetof(session_stats_t, queue_capacity)},
+    {"edelay_queue_resizes_total", "counter", "Times a queue has grown or shrunk",
+     offsetof(session_stats_t, queue_resizes)},
+    {"edelay_dropped_items_total", "counter", "Packets dropped by a full queue", offsetof(session_stats_t, dropped_items)},
+    {"edelay_dropped_bytes_total", "counter", "Bytes dropped by a full queue", offsetof(session_stats_t, dropped_bytes)},
+    {"edelay_upstreams_lapsed_total", "counter", "Upstreams cut off for falling too far behind the others",
+     offsetof(session_stats_t, upstreams_lapsed)},
+};
+
+/**
+ * The upper bounds of the release lateness buckets, in nanoseconds
+ */
+static const uint64_t edelay_lateness_bounds[] = {
+    // Down to the jitter of the real-time mode
+    5 * EDELAY_NS_PER_US, 10 * EDELAY_NS_PER_US, 25 * EDELAY_NS_PER_US, 50 * EDELAY_NS_PER_US,
+    100 * EDELAY_NS_PER_US, 250 * EDELAY_NS_PER_US, 500 * EDELAY_NS_PER_US,
+    1 * EDELAY_NS_PER_MS, 2500 * EDELAY_NS_PER_US, 5 * EDELAY_NS_PER_MS,
+    10 * EDELAY_NS_PER_MS, 25 * EDELAY_NS_PER_MS, 50 * EDELAY_NS_PER_MS,
+    100 * EDELAY_NS_PER_MS, 250 * EDELAY_NS_PER_MS, 500 * EDELAY_NS_PER_MS,
+    1 * EDELAY_NS_PER_S
+};
+
+/**
+ * The upper bounds of the receive and write size buckets, in bytes
+ */
+static const uint64_t edelay_size_bounds[] = {
+    64, 256, 1024, 2048, 4096, 16384, 65536, 262144
+};
+
+/**
+ * Write a histogram of every shard in the Prometheus text format.
+ *
+ * @param [in] out the client's stream
+ * @param [in] metrics the shards
+ * @param [in] name the name of the histogram
+ * @param [in] help what the histogram is
+ * @param [in] offset where the histogram is in session_stats_t
+ * @param [in] bounds the upper bounds of the buckets
+ * @param [in] bound_count the amount of bounds
+ * @param [in] scale what a recorded value is in the histogram's unit
+ */
+void edelay_write_histogram(FILE *out, const edelay_metrics_t *metrics, const char *name, const char *help,
+                            const size_t offset, const uint64_t *bounds, const size_t bound_count,
+                            const double scale) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+
+    static metrics_histogram_snapshot_t snapshot;
+    for (int i = 0; i < metrics->count; i++) {
+        const metrics_histogram_t *histogram =
+                (const metrics_histogram_t *) ((const char *) &metrics->shards[i].stats + offset);
+        bzero(&snapshot, sizeof(snapshot));
+        metrics_histogram_add_to(&snapshot, histogram);
+
+        for (size_t j = 0; j < bound_count; j++)
+            fprintf(out, "%s_bucket{shard=\"%d\",le=\"%g\"} %" PRIu64 "\n",
+                    name, i, (double) bounds[j] * scale, metrics_histogram_count_to(&snapshot, bounds[j]));
+        fprintf(out, "%s_bucket{shard=\"%d\",le=\"+Inf\"} %" PRIu64 "\n", name, i, snapshot.count);
+        fprintf(out, "%s_sum{shard=\"%d\"} %.15g\n", name, i, (double) snapshot.sum * scale);
+        fprintf(out, "%s_count{shard=\"%d\"} %" PRIu64 "\n", name, i, snapshot.count);
+    }
+}
+
+/**
+ * Write the metrics of every shard in the Prometheus text format.
+ *
+ * @param [in] out the client's stream
+ * @param [in] context the edelay_metrics_t
+ */
+void edelay_write_metrics(FILE *out, void *context) {
+    const edelay_metrics_t *metrics = context;
+
+    for (size_t m = 0; m < sizeof(edelay_metrics) / sizeof(edelay_metrics[0]); m++) {
+        const edelay_metric_t *metric = &edelay_metrics[m];
+        fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", metric->name, metric->help, metric->name, metric->type);
+        for (int i = 0; i < metrics->count; i++) {
+            const _Atomic uint64_t *value =
+                    (const _Atomic uint64_t *) ((const char *) &metrics->shards[i].stats + metric->offset);
+            fprintf(out, "%s{shard=\"%d\"} %" PRIu64 "\n",
+                    metric->name, i, atomic_load_explicit(value, memory_order_relaxed));
+        }
+    }
+
+    edelay_write_histogram(out, metrics, "edelay_release_lateness_seconds",
+                           "How late the writes went out past their first packet's arrival and the delay",
+                           offsetof(session_stats_t, release_lateness), edelay_lateness_bounds,
+                           sizeof(edelay_lateness_bounds) / sizeof(edelay_lateness_bounds[0]), 1.0 / EDELAY_NS_PER_S);
+    edelay_write_histogram(out, metrics, "edelay_receive_size_bytes", "The sizes of the receives",
+                           offsetof(session_stats_t, receive_sizes), edelay_size_bounds,
+                           sizeof(edelay_size_bounds) / sizeof(edelay_size_bounds[0]), 1);
+    edelay_write_histogram(out, metrics, "edelay_release_size_bytes", "The sizes of the writes",
+                           offsetof(session_stats_t, release_sizes), edelay_size_bounds,
+                           sizeof(edelay_size_bounds) / sizeof(edelay_size_bounds[0]), 1);
+}
+
+void *edelay_metrics_thread(void *arg) {
+    edelay_metrics_t *metrics = arg;
+    metrics_serve(metrics->socket_fd, edelay_write_metrics, metrics);
+    return nullptr;
+}
+
+/**
+ * Get the CPUs the process may run on.
+ *
+ * @param [out] cpus the CPU numbers
+ * @param [in] max_cpus the maximum amount of CPU numbers
+ * @returns The amount of CPUs
+ */
+int edelay_available_cpus(int *cpus, const int max_cpus) {
+    cpu_set_t available;
+    if (sched_getaffinity(0, sizeof(available), &available) == -1) {
+        perror("sched_getaffinity");
+        exit(EXIT_FAILURE);
+    }
+
+    int count = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE && count < max_cpus; cpu++) {
+        if (CPU_ISSET(cpu, &available))
+            cpus[count++] = cpu;
+    }
+
+    return count;
+}
+
+/**
+ * Get the CPUs the kernel keeps the other tasks off, isolcpus= on its command line.
+ *
+ * @param [out] cpus the CPU numbers
+ * @param [in] max_cpus the maximum amount of CPU numbers
+ * @returns The amount of CPUs, 0 if none are isolated
+ */
+int edelay_isolated_cpus(int *cpus, const int max_cpus) {
+    FILE *file = fopen("/sys/devices/system/cpu/isolated", "r");
+    if (file == nullptr)
+        return 0;
+
+    // A list of ranges, such as 2-3,6
+    int count = 0;
+    int first, last;
+    while (count < max_cpus && fscanf(file, "%d", &first) == 1) {
+        last = first;
+        if (fscanf(file, "-%d", &last) == 1 && last < first)
+            last = first;
+        for (int cpu = first; cpu <= last && count < max_cpus; cpu++)
+            cpus[count++] = cpu;
+        if (fgetc(file) != ',')
+            break;
+    }
+
+    fclose(file);
+    return count;
+}
+
+/**
+ * Parse a comma-separated list of queue memory options.
+ *
+ * @param [in] list the list, e.g. "huge,prefault"
+ * @param [out] flags the QUEUE_MEMORY_* flags
+ * @returns true if succeeded, false if an option is unknown
+ */
+bool edelay_parse_memory_flags(const char *list, uint32_t *flags) {
+    static const struct {
+        const char *name;
+        uint32_t flag;
+    } options[] = {
+        {"huge", QUEUE_MEMORY_HUGE_PAGES},
+        {"prefault", QUEUE_MEMORY_PREFAULT},
+        {"lock", QUEUE_MEMORY_LOCK},
+        {"local", QUEUE_MEMORY_LOCAL}
+    };
+
+    *flags = 0;
+    while (*list != '\0') {
+        const char *comma = strchr(list, ',');
+        const size_t length = comma != nullptr ? (size_t) (comma - list) : strlen(list);
+
+        size_t i = 0;
+        while (i < sizeof(options) / sizeof(options[0])
+               && (strlen(options[i].name) != length || strncmp(options[i].name, list, length) != 0))
+            i++;
+        if (i == sizeof(options) / sizeof(options[0]))
+            return false;
+        *flags |= options[i].flag;
+
+        list += comma != nullptr ? length + 1 : length;
+    }
+    return true;
+}
+
+/**
+ * Check whether a file name has the prefix and the suffix.
+ *
+ * @param [in] name the file name
+ * @param [in] prefix the prefix
+ * @param [in] suffix the suffix
+ * @returns true if it has both, false otherwise
+ */
+bool edelay_name_matches(const char *name, const char *prefix, const char *suffix) {
+    const size_t length = strlen(name);
+    return strncmp(name, prefix, strlen(prefix)) == 0 && length >= strlen(prefix) + strlen(suffix)
+           && strcmp(name + length - strlen(suffix), suffix) == 0;
+}
+
+/**
+ * Find the delay windows an earlier relay has left in the state directory and spread them over the shards.
+ * The files of interrupted queue resizes are removed, the queues' own files are still whole.
+ *
+ * @param [in] directory the state directory
+ * @param [in,out] shards the shards
+ * @param [in] count the amount of shards
+ * @returns The amount of windows found
+ */
+int edelay_scan_state(const char *directory, edelay_shard_t *shards, const int count) {
+    DIR *dir = opendir(directory);
+    if (dir == nullptr) {
+        perror("state directory");
+        exit(EXIT_FAILURE);
+    }
+
+    int found = 0;
+    const struct dirent *entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        const bool leftover = edelay_name_matches(entry->d_name, "edelay-", ".queue.new");
+        if (!leftover && !edelay_name_matches(entry->d_name, "edelay-", ".queue"))
+            continue;
+
+        char *path;
+        if (asprintf(&path, "%s/%s", directory, entry->d_name) == -1) {
+            perror("state path");
+            exit(EXIT_FAILURE);
+        }
+        if (leftover) {
+            unlink(path);
+            free(path);
             continue;
         }
 
-        client_connected = true;
-        const pthread_t send_thread = edelay_spawn_thread();
-
-        union {
-            queued_packet_t qp;
-            char buffer[MAX_QUEUED_PACKET_SIZE];
-        } qp_u;
-        ssize_t received;
-        while (client_connected
-               && (received = recv(client_fd, qp_u.qp.buffer,
-                                   sizeof(qp_u.buffer) / sizeof(qp_u.buffer[0]) - sizeof(qp_u.qp.timestamp),
-                                   0)) != -1) {
-            qp_u.qp.timestamp = time(nullptr);
-            if (!queue_push(&packet_queue, received + sizeof(qp_u.qp.timestamp), qp_u.buffer)) {
-                fprintf(stderr, "queue push fail");
+        edelay_shard_t *shard = &shards[found % count];
+        char **paths = realloc(shard->resume_paths, (shard->resume_count + 1) * sizeof(char *));
+        if (paths == nullptr) {
+            perror("state paths alloc");
+            exit(EXIT_FAILURE);
+        }
+        paths[shard->resume_count++] = path;
+        shard->resume_paths = paths;
+        found++;
+    }
+
+    closedir(dir);
+    return found;
+}
+
+void edelay_usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-d delay_ms] [-u host:port]... [-L lag_kb] [-s shards] [-p] [-S spill_dir] "
+                    "[-m stats_socket] [-Q queue_kb] [-M memory] [-R spin_us] [-T quantum_us] [-W raw_state_dir]\n", name);
+    fprintf(stderr, "  -d delay_ms   how long to hold the stream back, fractions allowed (default %d)\n",
+            DEFAULT_DELAY_MS);
+    fprintf(stderr, "  -u host:port  the server to forward the stream to (default stdout), repeat it to fan the stream\n"
+                    "                out to up to %d servers from a single queue\n", SESSION_MAX_UPSTREAMS);
+    fprintf(stderr, "  -L lag_kb     cut off a server that falls this far behind the fastest one, so that it can't\n"
+                    "                hold the queue for the others (default no limit)\n");
+    fprintf(stderr, "  -s shards     serve from this many threads pinned to separate CPUs, each with its own\n"
+                    "                listener, 0 for one per available CPU (default one unpinned thread)\n");
+    fprintf(stderr, "  -p            keep the stream in kernel pipes and move it with splice(), for pass-through\n"
+                    "                streams; arrival times are taken when the data is moved, not by the kernel\n");
+    fprintf(stderr, "  -S spill_dir  keep only the ends of a session's delay window in RAM and leave the rest\n"
+                    "                to a file in this directory, read back ahead of the release\n");
+    fprintf(stderr, "  -m stats_socket  serve the counters, queue occupancy and lateness histograms as Prometheus\n"
+                    "                text to every client of this Unix domain socket\n");
+    fprintf(stderr, "  -Q queue_kb   the capacity each session's queue starts with and shrinks back to (default %d)\n",
+            4 * SESSION_MAX_PACKET_SIZE / 1024);
+    fprintf(stderr, "  -M memory     how the queue memory is allocated, a comma-separated list of: huge for 2 MB pages,\n"
+                    "                prefault to fault it in up front, lock to keep it in RAM (raise RLIMIT_MEMLOCK,\n"
+                    "                ulimit -l, to cover every session), local for the NUMA node of the session's shard\n");
+    fprintf(stderr, "  -R spin_us    real-time mode: pin the shards to the isolated CPUs if there are any, run them\n"
+                    "                SCHED_FIFO, busy-poll the sockets, and wake the release this early to spin until\n"
+                    "                the exact deadline, at most %d us; takes a core per shard (default one shard)\n",
+            MAX_SPIN_US);
+    fprintf(stderr, "  -T quantum_us  release on a grid of this spacing: the sessions of a shard wake up together once\n"
+                    "                per quantum and write whatever has fallen due, each packet at most a quantum\n"
+                    "                late, for far fewer wakeups on a loaded host (default every packet on time)\n");
+    fprintf(stderr, "  -W raw_state_dir  raw streams only: keep each session's queue in a file in this directory, so\n"
+                    "                that a relay restarted after a crash releases the rest of the delay windows of\n"
+                    "                the raw streams on time to fresh upstream connections, within the same boot.\n"
+                    "                The windows of RTMP streams are deleted on startup, not resumed: an RTMP server\n"
+                    "                won't take the middle of a stream without its handshake, connect and publish\n");
+#ifdef EDELAY_IO_URING
+    fprintf(stderr, "  -i            serve with io_uring, receiving into and sending from the registered queue buffers\n");
+#endif
+    fprintf(stderr, "Send SIGUSR1 to print the per-shard counters and lateness, SIGUSR2 to dump the queued RTMP streams\n"
+                    "up to their latest key frames (not with -p or -i)\n");
+}
+
+int main(const int argc, char *argv[]) {
+    int option;
+    while ((option = getopt(argc, argv, "d:u:L:s:pS:m:Q:M:R:T:W:ih")) != -1) {
+        switch (option) {
+            case 'd': {
+                char *end;
+                const double delay_ms = strtod(optarg, &end);
+                if (*end != '\0' || delay_ms < 0) {
+                    fprintf(stderr, "Invalid delay: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                delay_ns = (int64_t) (delay_ms * EDELAY_NS_PER_MS);
                 break;
             }
+            case 'u': {
+                char *colon = strrchr(optarg, ':');
+                if (colon == nullptr || colon == optarg || colon[1] == '\0') {
+                    fprintf(stderr, "Invalid upstream: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                if (upstream_count == SESSION_MAX_UPSTREAMS) {
+                    fprintf(stderr, "At most %d upstreams\n", SESSION_MAX_UPSTREAMS);
+                    exit(EXIT_FAILURE);
+                }
+                *colon = '\0';
+                const char *host = optarg;
+
+                // [::1]:1935
+                if (host[0] == '[' && colon[-1] == ']') {
+                    colon[-1] = '\0';
+                    host++;
+                }
+                upstream_hosts[upstream_count] = host;
+                upstream_ports[upstream_count] = colon + 1;
+                upstream_count++;
+                break;
+            }
+            case 'L': {
+                char *end;
+                const long long lag_kb = strtoll(optarg, &end, 10);
+                if (*end != '\0' || lag_kb < 0 || lag_kb > SSIZE_MAX / 1024) {
+                    fprintf(stderr, "Invalid lag: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                max_upstream_lag = (ssize_t) lag_kb * 1024;
+                break;
+            }
+            case 's': {
+                char *end;
+                const long shards = strtol(optarg, &end, 10);
+                if (*end != '\0' || shards < 0 || shards > MAX_SHARDS) {
+                    fprintf(stderr, "Invalid shard count: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                shard_count = (int) shards;
+                break;
+            }
+            case 'p':
+                use_splice = true;
+                break;
+            case 'S':
+                spill_directory = optarg;
+                break;
+            case 'W':
+                state_directory = optarg;
+                break;
+            case 'm':
+                stats_socket_path = optarg;
+                break;
+            case 'Q': {
+                char *end;
+                const long long queue_kb = strtoll(optarg, &end, 10);
+                if (*end != '\0' || queue_kb <= 0 || queue_kb > SSIZE_MAX / 1024) {
+                    fprintf(stderr, "Invalid queue capacity: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                queue_capacity = (ssize_t) queue_kb * 1024;
+                break;
+            }
+            case 'R': {
+                char *end;
+                const double spin_us = strtod(optarg, &end);
+                if (*end != '\0' || spin_us < 0 || spin_us > MAX_SPIN_US) {
+                    fprintf(stderr, "Invalid spin: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                real_time = true;
+                spin_ns = (int64_t) (spin_us * EDELAY_NS_PER_US);
+                break;
+            }
+            case 'T': {
+                char *end;
+                const double quantum_us = strtod(optarg, &end);
+                if (*end != '\0' || quantum_us < 0 || quantum_us > 1e6) {
+                    fprintf(stderr, "Invalid release quantum: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                release_quantum_ns = (int64_t) (quantum_us * EDELAY_NS_PER_US);
+                break;
+            }
+            case 'M':
+                if (!edelay_parse_memory_flags(optarg, &queue_memory_flags)) {
+                    fprintf(stderr, "Invalid memory options: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+#ifdef EDELAY_IO_URING
+            case 'i':
+                if (!uring_is_supported()) {
+                    perror("io_uring is not supported");
+                    exit(EXIT_FAILURE);
+                }
+                use_uring = true;
+                break;
+#endif
+            default:
+                edelay_usage(argv[0]);
+                exit(option == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
         }
-        if (received == -1)
-            perror("recv");
-        // printf("%s", buffer);
-
-        // if (send(client_fd, buffer, numbytes + hdrbytes, 0) == -1) {
-        //     perror("send");
-        // }
-        client_connected = false;
-        pthread_join(send_thread, nullptr);
-        if (received != -1)
-            close(client_fd);
     }
 
-    close(socket_fd);
-    queue_destroy(&packet_queue);
-    return 0;
+    if (use_splice && use_uring) {
+        fprintf(stderr, "-p and -i can't be combined\n");
+        exit(EXIT_FAILURE);
+    }
+    // The pipes can't be read twice, and the io_uring sessions have a single upstream
+    if (upstream_count > 1 && (use_splice || use_uring)) {
+        fprintf(stderr, "Several -u only apply to the sessions served from queues, without -p and -i\n");
+        exit(EXIT_FAILURE);
+    }
+    // The io_uring loop times the release with its own timeouts
+    if (real_time && use_uring) {
+        fprintf(stderr, "-R and -i can't be combined\n");
+        exit(EXIT_FAILURE);
+    }
+    if (spill_directory != nullptr && (use_splice || use_uring)) {
+        fprintf(stderr, "-S only applies to the sessions served from queues, without -p and -i\n");
+        exit(EXIT_FAILURE);
+    }
+    // The file is a single mapped buffer, the segments of a spilled queue aren't kept in order anywhere
+    if (state_directory != nullptr && (use_splice || use_uring || spill_directory != nullptr)) {
+        fprintf(stderr, "-W only applies to the sessions served from queues, without -p, -i and -S\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Each session receives into and releases from its queue on the same thread
+    session_config_t session_config = {
+        .delay_ns = delay_ns,
+        .upstream_count = upstream_count,
+        .max_upstream_lag = max_upstream_lag,
+        .spin_ns = spin_ns,
+        .release_quantum_ns = release_quantum_ns,
+        .splice = use_splice,
+        .dump_requests = &dump_requests,
+        .state_directory = state_directory,
+        .queue_config = {
+            .initial_capacity = queue_capacity,
+            .overflow_behavior = QUEUE_OVERFLOW_RESIZE,
+            .concurrency = QUEUE_CONCURRENCY_SPSC,
+            .backing = QUEUE_BACKING_SEGMENTED,
+            // Give the memory taken by a burst back once the queue has been mostly empty for a while
+            .shrink_target = queue_capacity,
+            .shrink_low_water_percent = 25,
+            .shrink_period_ms = 10000,
+            .spill_directory = spill_directory,
+            .spill_threshold = SPILL_THRESHOLD,
+            // The sessions' queues are created on their shards' threads
+            .memory_flags = queue_memory_flags
+        }
+    };
+
+    queue_t test_queue;
+    if (!queue_init_config(&test_queue, &session_config.queue_config)) {
+        perror("queue init failed");
+        exit(EXIT_FAILURE);
+    } {
+        edelay_push_message(&test_queue, messij, sizeof(messij));
+        edelay_push_message(&test_queue, messij2, sizeof(messij2));
+        edelay_push_message(&test_queue, messij3, sizeof(messij3));
+
+        assert(edelay_pop_verify(&test_queue, messij, sizeof(messij)) == true);
+        assert(edelay_pop_verify(&test_queue, messij3, sizeof(messij3)) == false);
+        assert(edelay_pop_verify(&test_queue, messij3, sizeof(messij3)) == true);
+
+        edelay_push_message(&test_queue, messij, sizeof(messij));
+        assert(edelay_pop_verify(&test_queue, messij, sizeof(messij)) == true);
+    }
+    queue_destroy(&test_queue);
+
+    // A producer making room and another thread laying the buffer out anew never wait for each other
+    assert(edelay_check_locked_relayout(QUEUE_OVERFLOW_RESIZE) == true);
+    assert(edelay_check_locked_relayout(QUEUE_OVERFLOW_LOOP_REPLACE) == true);
+
+    // The chunk headers are found wherever the receives happen to split them
+    assert(edelay_check_rtmp_parser(1) == true);
+    assert(edelay_check_rtmp_parser(13) == true);
+    assert(edelay_check_rtmp_parser(CHECK_RTMP_SIZE) == true);
+
+    // A dropped upstream connection is handled where it's written to
+    signal(SIGPIPE, SIG_IGN);
+
+    for (int i = 0; i < upstream_count; i++) {
+        struct addrinfo upstream_hints;
+        bzero(&upstream_hints, sizeof upstream_hints);
+        upstream_hints.ai_family = AF_UNSPEC;
+        upstream_hints.ai_socktype = SOCK_STREAM;
+
+        // Resolved once, so that the event loop never blocks on DNS
+        struct addrinfo *upstream_info;
+        const int result = getaddrinfo(upstream_hosts[i], upstream_ports[i], &upstream_hints, &upstream_info);
+        if (result != 0) {
+            fprintf(stderr, "upstream %s getaddrinfo: %s\n", upstream_hosts[i], gai_strerror(result));
+            exit(EXIT_FAILURE);
+        }
+        session_config.upstreams[i] = upstream_info;
+    }
+
+    int cpus[MAX_SHARDS];
+    int cpu_count = real_time ? edelay_isolated_cpus(cpus, MAX_SHARDS) : 0;
+    if (real_time && cpu_count == 0)
+        fprintf(stderr, "No CPUs are isolated, the real-time shards share their CPUs with the rest of the system\n");
+    if (cpu_count == 0)
+        cpu_count = edelay_available_cpus(cpus, MAX_SHARDS);
+    const bool pinned = shard_count != -1 || real_time;
+    const int count = shard_count == -1 ? 1 : shard_count == 0 ? cpu_count : shard_count;
+
+    edelay_shard_t *shards = aligned_alloc(alignof(edelay_shard_t), count * sizeof(edelay_shard_t));
+    if (shards == nullptr) {
+        perror("shards alloc");
+        exit(EXIT_FAILURE);
+    }
+    bzero(shards, count * sizeof(edelay_shard_t));
+
+    for (int i = 0; i < count; i++) {
+        shards[i].index = i;
+        shards[i].cpu = pinned ? cpus[i % cpu_count] : -1;
+        // The kernel spreads the connections over the listeners sharing the port
+        shards[i].socket_fd = edelay_listen(pinned);
+        shards[i].session_config = session_config;
+        shards[i].session_config.stats = &shards[i].stats;
+    }
+
+    if (state_directory != nullptr) {
+        const int found = edelay_scan_state(state_directory, shards, count);
+        if (found > 0)
+            fprintf(stderr, "Found %d delay window%s in %s, resuming those of raw streams\n", found,
+                    found == 1 ? "" : "s", state_directory);
+    }
+
+    printf("Server listening on port %s with %d shard%s\n", PORT, count, count == 1 ? "" : "s");
+    // The stream may be written to stdout past stdio
+    fflush(stdout);
+
+    // Only this thread takes the signal, the shards inherit the mask
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    for (int i = 0; i < count; i++) {
+        const int result = pthread_create(&shards[i].thread, nullptr, edelay_shard_thread, &shards[i]);
+        if (result != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(result));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // The stats are read on a thread of their own, the shards never wait for a client
+    edelay_metrics_t metrics = {.shards = shards, .count = count, .socket_fd = -1};
+    if (stats_socket_path != nullptr) {
+        metrics.socket_fd = metrics_listen(stats_socket_path);
+        if (metrics.socket_fd == -1) {
+            perror("stats socket");
+            exit(EXIT_FAILURE);
+        }
+
+        pthread_t metrics_thread;
+        const int result = pthread_create(&metrics_thread, nullptr, edelay_metrics_thread, &metrics);
+        if (result != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(result));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    while (true) {
+        int signal_number;
+        if (sigwait(&signals, &signal_number) != 0)
+            continue;
+        if (signal_number == SIGUSR1)
+            edelay_print_stats(shards, count);
+        else if (signal_number == SIGUSR2)
+            // The sessions pick it up the next time they release something
+            atomic_fetch_add_explicit(&dump_requests, 1, memory_order_relaxed);
+    }
 }
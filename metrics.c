@@ -0,0 +1,108 @@
+//
+// Lock-free histograms written by a single thread, and a Unix socket that serves the metrics as Prometheus text
+//
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "metrics.h"
+#include "c23_compat.h"
+
+uint64_t metrics_histogram_bucket_floor(const size_t bucket) {
+    if (bucket < METRICS_HISTOGRAM_SUB_BUCKETS)
+        return bucket;
+
+    const size_t shift = bucket / METRICS_HISTOGRAM_SUB_BUCKETS - 1;
+    const uint64_t sub_bucket = bucket % METRICS_HISTOGRAM_SUB_BUCKETS;
+    return (METRICS_HISTOGRAM_SUB_BUCKETS + sub_bucket) << shift;
+}
+
+void metrics_histogram_add_to(metrics_histogram_snapshot_t *snapshot, const metrics_histogram_t *histogram) {
+    // Not a consistent cut, the counts may be off by the values being recorded right now
+    uint64_t count = 0;
+    for (size_t i = 0; i < METRICS_HISTOGRAM_BUCKETS; i++) {
+        const uint64_t bucket = atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+        snapshot->buckets[i] += bucket;
+        count += bucket;
+    }
+    snapshot->count += count;
+    snapshot->sum += atomic_load_explicit(&histogram->sum, memory_order_relaxed);
+
+    const uint64_t max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+    if (max > snapshot->max)
+        snapshot->max = max;
+}
+
+uint64_t metrics_histogram_quantile(const metrics_histogram_snapshot_t *snapshot, const double quantile) {
+    if (snapshot->count == 0)
+        return 0;
+
+    const uint64_t rank = (uint64_t) (quantile * (double) (snapshot->count - 1)) + 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < METRICS_HISTOGRAM_BUCKETS - 1; i++) {
+        seen += snapshot->buckets[i];
+        if (seen >= rank) {
+            // The end of the bucket, but never past the largest value recorded
+            const uint64_t upper = metrics_histogram_bucket_floor(i + 1) - 1;
+            return upper < snapshot->max ? upper : snapshot->max;
+        }
+    }
+    return snapshot->max;
+}
+
+uint64_t metrics_histogram_count_to(const metrics_histogram_snapshot_t *snapshot, const uint64_t bound) {
+    uint64_t count = 0;
+    for (size_t i = 0; i < METRICS_HISTOGRAM_BUCKETS - 1 && metrics_histogram_bucket_floor(i + 1) - 1 <= bound; i++)
+        count += snapshot->buckets[i];
+    return count;
+}
+
+int metrics_listen(const char *path) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    const int socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (socket_fd == -1)
+        return -1;
+
+    // A socket left behind by a previous run
+    unlink(path);
+    if (bind(socket_fd, (const struct sockaddr *) &address, sizeof(address)) == -1 || listen(socket_fd, 16) == -1) {
+        close(socket_fd);
+        return -1;
+    }
+
+    return socket_fd;
+}
+
+void metrics_serve(const int socket_fd, const metrics_writer_t writer, void *context) {
+    while (true) {
+        const int client_fd = accept4(socket_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client_fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror("stats accept");
+            return;
+        }
+
+        // A client that doesn't read won't hold the next one up for long
+        const struct timeval timeout = {.tv_sec = 1};
+        (void) setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        FILE *out = fdopen(client_fd, "w");
+        if (out == nullptr) {
+            close(client_fd);
+            continue;
+        }
+        writer(out, context);
+        fclose(out);
+    }
+}
@@ -0,0 +1,149 @@
+//
+// Lock-free histograms written by a single thread, and a Unix socket that serves the metrics as Prometheus text
+//
+
+#ifndef EMERGENCY_DELAY_METRICS_H
+#define EMERGENCY_DELAY_METRICS_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "c23_compat.h"
+
+/**
+ * Every power of two is split into this many linear sub-buckets, so a value is known within 1/16th of itself
+ */
+#define METRICS_HISTOGRAM_SUB_BITS 4
+#define METRICS_HISTOGRAM_SUB_BUCKETS (1 << METRICS_HISTOGRAM_SUB_BITS)
+/**
+ * Values up to 2^40 are told apart, that's 18 minutes in nanoseconds, the larger ones go to the last bucket
+ */
+#define METRICS_HISTOGRAM_MAX_MAGNITUDE 40
+#define METRICS_HISTOGRAM_BUCKETS \
+    ((METRICS_HISTOGRAM_MAX_MAGNITUDE - METRICS_HISTOGRAM_SUB_BITS + 2) * METRICS_HISTOGRAM_SUB_BUCKETS)
+
+/**
+ * A log-linear histogram in the manner of HdrHistogram. Only one thread records into it, any thread may read it.
+ */
+typedef struct {
+    _Atomic uint64_t buckets[METRICS_HISTOGRAM_BUCKETS];
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum;
+    _Atomic uint64_t max;
+} metrics_histogram_t;
+
+/**
+ * A histogram read out of one or more metrics_histogram_t
+ */
+typedef struct {
+    uint64_t buckets[METRICS_HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+} metrics_histogram_snapshot_t;
+
+/**
+ * Writes the metrics to a client of the stats socket.
+ *
+ * @param [in] out the client's stream
+ * @param [in] context the context given to metrics_serve
+ */
+typedef void (*metrics_writer_t)(FILE *out, void *context);
+
+/**
+ * Get the bucket a value goes to.
+ *
+ * @param [in] value the value
+ * @returns The index of the bucket
+ */
+static inline size_t metrics_histogram_bucket(const uint64_t value) {
+    if (value < METRICS_HISTOGRAM_SUB_BUCKETS)
+        return value;
+
+    const int magnitude = 63 - __builtin_clzll(value);
+    if (magnitude > METRICS_HISTOGRAM_MAX_MAGNITUDE)
+        return METRICS_HISTOGRAM_BUCKETS - 1;
+
+    const int shift = magnitude - METRICS_HISTOGRAM_SUB_BITS;
+    return (size_t) (shift + 1) * METRICS_HISTOGRAM_SUB_BUCKETS
+           + ((value >> shift) & (METRICS_HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+/**
+ * Add to a value that only the current thread writes, without a locked instruction.
+ */
+static inline void metrics_add(_Atomic uint64_t *counter, const uint64_t value) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value,
+                          memory_order_relaxed);
+}
+
+/**
+ * Record a value, only from the thread that owns the histogram.
+ *
+ * @param [in] histogram the histogram
+ * @param [in] value the value
+ */
+static inline void metrics_histogram_record(metrics_histogram_t *histogram, const uint64_t value) {
+    metrics_add(&histogram->buckets[metrics_histogram_bucket(value)], 1);
+    metrics_add(&histogram->count, 1);
+    metrics_add(&histogram->sum, value);
+    if (value > atomic_load_explicit(&histogram->max, memory_order_relaxed))
+        atomic_store_explicit(&histogram->max, value, memory_order_relaxed);
+}
+
+/**
+ * Get the smallest value that goes to a bucket.
+ *
+ * @param [in] bucket the index of the bucket
+ * @returns The value
+ */
+uint64_t metrics_histogram_bucket_floor(size_t bucket);
+
+/**
+ * Add what a histogram has recorded so far to a snapshot.
+ *
+ * @param [in,out] snapshot the snapshot, zeroed before the first histogram is added
+ * @param [in] histogram the histogram
+ */
+void metrics_histogram_add_to(metrics_histogram_snapshot_t *snapshot, const metrics_histogram_t *histogram);
+
+/**
+ * Get the value at a quantile, the upper end of the bucket it falls into.
+ *
+ * @param [in] snapshot the snapshot
+ * @param [in] quantile the quantile, from 0 to 1
+ * @returns The value, or 0 if nothing has been recorded
+ */
+uint64_t metrics_histogram_quantile(const metrics_histogram_snapshot_t *snapshot, double quantile);
+
+/**
+ * Get how many recorded values are surely no larger than the bound: those in the buckets that end at or below it.
+ *
+ * @param [in] snapshot the snapshot
+ * @param [in] bound the bound
+ * @returns The amount of values
+ */
+uint64_t metrics_histogram_count_to(const metrics_histogram_snapshot_t *snapshot, uint64_t bound);
+
+/**
+ * Create the stats socket, replacing whatever is at the path.
+ *
+ * @param [in] path the path of the Unix domain socket
+ * @returns The listening socket, or -1 if failed
+ */
+int metrics_listen(const char *path);
+
+/**
+ * Serve the metrics to every client of the stats socket until something goes terribly wrong.
+ * Only the writer runs on the thread that calls this, the data path never waits for it.
+ *
+ * @param [in] socket_fd the listening socket
+ * @param [in] writer writes the metrics
+ * @param [in] context passed to the writer
+ */
+void metrics_serve(int socket_fd, metrics_writer_t writer, void *context);
+
+#endif //EMERGENCY_DELAY_METRICS_H
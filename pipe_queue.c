@@ -0,0 +1,239 @@
+//
+// A delay queue that keeps the bytes in kernel pipes, they never enter the user space
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "pipe_queue.h"
+#include "c23_compat.h"
+
+#define PIPE_QUEUE_INITIAL_PIPES 4
+#define PIPE_QUEUE_INITIAL_ENTRIES 256
+
+/**
+ * Grow a ring array twice, the elements keep their order starting at index 0.
+ *
+ * @param [in,out] array the array
+ * @param [in] element_size the size of an element in bytes
+ * @param [in,out] capacity the capacity in elements
+ * @param [in,out] head the index of the first element
+ * @param [in] count the amount of elements
+ * @returns true if succeeded, false if failed
+ */
+static bool pipe_queue_grow_ring(void **array, const size_t element_size, size_t *capacity, size_t *head,
+                                 const size_t count) {
+    const size_t new_capacity = *capacity * 2;
+    char *new_array = calloc(new_capacity, element_size);
+    if (new_array == nullptr)
+        return false;
+
+    const char *old_array = *array;
+    const size_t head_count = *capacity - *head < count ? *capacity - *head : count;
+    memcpy(new_array, old_array + *head * element_size, head_count * element_size);
+    memcpy(new_array + head_count * element_size, old_array, (count - head_count) * element_size);
+
+    free(*array);
+    *array = new_array;
+    *capacity = new_capacity;
+    *head = 0;
+    return true;
+}
+
+static void pipe_queue_close_pipe(pipe_queue_pipe_t *pipe) {
+    if (pipe->read_fd != -1)
+        close(pipe->read_fd);
+    if (pipe->write_fd != -1)
+        close(pipe->write_fd);
+    pipe->read_fd = pipe->write_fd = -1;
+    pipe->entries = 0;
+}
+
+/**
+ * Append an empty pipe to the chain, the spare one if there is one.
+ *
+ * @param [in] queue a pointer to the queue
+ * @returns true if succeeded, false if failed
+ */
+static bool pipe_queue_add_pipe(pipe_queue_t *queue) {
+    if (queue->pipe_count == queue->pipe_capacity
+        && !pipe_queue_grow_ring((void **) &queue->pipes, sizeof(*queue->pipes), &queue->pipe_capacity,
+                                 &queue->pipe_head, queue->pipe_count))
+        return false;
+
+    pipe_queue_pipe_t *pipe = &queue->pipes[(queue->pipe_head + queue->pipe_count) % queue->pipe_capacity];
+    if (queue->spare.read_fd != -1) {
+        *pipe = queue->spare;
+        queue->spare.read_fd = queue->spare.write_fd = -1;
+        queue->pipe_count++;
+        return true;
+    }
+
+    int fds[2];
+    if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) == -1)
+        return false;
+
+    // Past the per-user limit the kernel only gives the default size, the chain is just longer then
+    (void) fcntl(fds[1], F_SETPIPE_SZ, (int) queue->pipe_size);
+
+    *pipe = (pipe_queue_pipe_t) {
+        .read_fd = fds[0],
+        .write_fd = fds[1],
+        .entries = 0
+    };
+    queue->pipe_count++;
+    return true;
+}
+
+/**
+ * Drop the first pipe of the chain once it's drained, unless it's the last one.
+ *
+ * @param [in] queue a pointer to the queue
+ */
+static void pipe_queue_drop_drained(pipe_queue_t *queue) {
+    pipe_queue_pipe_t *pipe = &queue->pipes[queue->pipe_head];
+    if (pipe->entries != 0 || queue->pipe_count == 1)
+        return;
+
+    if (queue->spare.read_fd == -1)
+        queue->spare = *pipe;
+    else
+        pipe_queue_close_pipe(pipe);
+    pipe->read_fd = pipe->write_fd = -1;
+
+    queue->pipe_head = (queue->pipe_head + 1) % queue->pipe_capacity;
+    queue->pipe_count--;
+}
+
+bool pipe_queue_init(pipe_queue_t *queue, const size_t pipe_size) {
+    if (queue == nullptr)
+        return false;
+
+    bzero(queue, sizeof(*queue));
+    queue->spare.read_fd = queue->spare.write_fd = -1;
+    queue->pipe_size = pipe_size == 0 ? PIPE_QUEUE_DEFAULT_PIPE_SIZE : pipe_size;
+
+    queue->pipes = calloc(PIPE_QUEUE_INITIAL_PIPES, sizeof(*queue->pipes));
+    queue->entries = calloc(PIPE_QUEUE_INITIAL_ENTRIES, sizeof(*queue->entries));
+    if (queue->pipes == nullptr || queue->entries == nullptr)
+        goto fail;
+    queue->pipe_capacity = PIPE_QUEUE_INITIAL_PIPES;
+    queue->entry_capacity = PIPE_QUEUE_INITIAL_ENTRIES;
+
+    if (!pipe_queue_add_pipe(queue))
+        goto fail;
+
+    return true;
+
+fail:
+    pipe_queue_destroy(queue);
+    return false;
+}
+
+void pipe_queue_destroy(pipe_queue_t *queue) {
+    if (queue == nullptr)
+        return;
+
+    for (size_t i = 0; i < queue->pipe_count; i++)
+        pipe_queue_close_pipe(&queue->pipes[(queue->pipe_head + i) % queue->pipe_capacity]);
+    pipe_queue_close_pipe(&queue->spare);
+
+    free(queue->pipes);
+    free(queue->entries);
+    queue->pipes = nullptr;
+    queue->entries = nullptr;
+    queue->pipe_count = queue->entry_count = 0;
+    queue->size = 0;
+}
+
+ssize_t pipe_queue_splice_in(pipe_queue_t *queue, const int fd, const size_t max_size, const int64_t timestamp) {
+    if (queue->entry_count == queue->entry_capacity
+        && !pipe_queue_grow_ring((void **) &queue->entries, sizeof(*queue->entries), &queue->entry_capacity,
+                                 &queue->entry_head, queue->entry_count))
+        return -1;
+
+    pipe_queue_pipe_t *tail = &queue->pipes[(queue->pipe_head + queue->pipe_count - 1) % queue->pipe_capacity];
+    ssize_t spliced = splice(fd, nullptr, tail->write_fd, nullptr, max_size, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (spliced == -1 && errno == EAGAIN) {
+        // Either the socket has nothing to read, or the pipe has run out of slots. A pipe counts slots
+        // rather than bytes, so the only way to tell is to ask the socket.
+        int readable = 0;
+        if (tail->entries == 0 || ioctl(fd, FIONREAD, &readable) == -1 || readable == 0) {
+            errno = EAGAIN;
+            return -1;
+        }
+
+        if (!pipe_queue_add_pipe(queue))
+            return -1;
+        tail = &queue->pipes[(queue->pipe_head + queue->pipe_count - 1) % queue->pipe_capacity];
+        spliced = splice(fd, nullptr, tail->write_fd, nullptr, max_size, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    }
+    if (spliced <= 0)
+        return spliced;
+
+    queue->entries[(queue->entry_head + queue->entry_count) % queue->entry_capacity] = (pipe_queue_entry_t) {
+        .size = spliced,
+        .timestamp = timestamp
+    };
+    queue->entry_count++;
+    tail->entries++;
+    queue->size += spliced;
+    return spliced;
+}
+
+ssize_t pipe_queue_splice_out(pipe_queue_t *queue, const int fd, const int64_t until) {
+    ssize_t total = 0;
+    while (queue->entry_count > 0 && queue->entries[queue->entry_head].timestamp <= until) {
+        pipe_queue_pipe_t *pipe = &queue->pipes[queue->pipe_head];
+
+        // Everything that is due in the first pipe goes out in one call
+        size_t length = queue->entries[queue->entry_head].size - queue->head_offset;
+        for (size_t i = 1; i < pipe->entries; i++) {
+            const pipe_queue_entry_t *entry = &queue->entries[(queue->entry_head + i) % queue->entry_capacity];
+            if (entry->timestamp > until)
+                break;
+            length += entry->size;
+        }
+
+        const ssize_t spliced = splice(pipe->read_fd, nullptr, fd, nullptr, length,
+                                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (spliced == -1) {
+            if (errno == EINTR)
+                continue;
+            if (total > 0 && errno == EAGAIN)
+                return total;
+            return -1;
+        }
+
+        total += spliced;
+        queue->size -= spliced;
+        size_t left = spliced;
+        while (left > 0) {
+            pipe_queue_entry_t *entry = &queue->entries[queue->entry_head];
+            const size_t part = entry->size - queue->head_offset < left ? entry->size - queue->head_offset : left;
+            queue->head_offset += part;
+            left -= part;
+            if (queue->head_offset == entry->size) {
+                queue->head_offset = 0;
+                queue->entry_head = (queue->entry_head + 1) % queue->entry_capacity;
+                queue->entry_count--;
+                pipe->entries--;
+            }
+        }
+        pipe_queue_drop_drained(queue);
+
+        // The descriptor can't take any more right now
+        if ((size_t) spliced < length)
+            break;
+    }
+
+    return total;
+}
+
+int64_t pipe_queue_next_timestamp(const pipe_queue_t *queue) {
+    return queue->entry_count == 0 ? -1 : queue->entries[queue->entry_head].timestamp;
+}
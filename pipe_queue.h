@@ -0,0 +1,116 @@
+//
+// A delay queue that keeps the bytes in kernel pipes, they never enter the user space
+//
+
+#ifndef EMERGENCY_DELAY_PIPE_QUEUE_H
+#define EMERGENCY_DELAY_PIPE_QUEUE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "c23_compat.h"
+
+/**
+ * The size requested for each pipe, the kernel may give less
+ */
+#define PIPE_QUEUE_DEFAULT_PIPE_SIZE (1024 * 1024)
+
+/**
+ * An index entry: how many bytes have arrived at once, and when
+ */
+typedef struct {
+    size_t size;
+    int64_t timestamp;
+} pipe_queue_entry_t;
+
+typedef struct {
+    int read_fd;
+    int write_fd;
+    /**
+     * How many index entries have their bytes in the pipe
+     */
+    size_t entries;
+} pipe_queue_pipe_t;
+
+typedef struct {
+    /**
+     * The chain of pipes, a ring. Bytes go into the last one and come out of the first one.
+     */
+    pipe_queue_pipe_t *pipes;
+    size_t pipe_capacity;
+    size_t pipe_head;
+    size_t pipe_count;
+    /**
+     * A drained pipe kept for the next time the chain grows
+     */
+    pipe_queue_pipe_t spare;
+
+    /**
+     * The side index of the queued bytes, a ring
+     */
+    pipe_queue_entry_t *entries;
+    size_t entry_capacity;
+    size_t entry_head;
+    size_t entry_count;
+    /**
+     * How many bytes of the first entry have already left the queue
+     */
+    size_t head_offset;
+
+    size_t pipe_size;
+    /**
+     * The total amount of queued bytes
+     */
+    size_t size;
+} pipe_queue_t;
+
+/**
+ * Initialize the queue.
+ *
+ * @param [out] queue a pointer to the queue
+ * @param [in] pipe_size the size to request for each pipe, 0 for the default
+ * @returns true if succeeded, false if failed
+ */
+NODISCARD bool pipe_queue_init(pipe_queue_t *queue, size_t pipe_size);
+
+/**
+ * Close the pipes and free the index.
+ *
+ * @param [in] queue a pointer to the queue
+ */
+void pipe_queue_destroy(pipe_queue_t *queue);
+
+/**
+ * Move what has arrived on the descriptor into the queue, without copying it to the user space.
+ *
+ * @param [in] queue a pointer to the queue
+ * @param [in] fd the non-blocking socket to move from
+ * @param [in] max_size the maximum amount of bytes to move
+ * @param [in] timestamp the arrival time of the bytes
+ * @returns The amount of moved bytes, 0 at the end of the stream, or -1 if failed.
+ * errno is EAGAIN if there is nothing to move right now.
+ */
+ssize_t pipe_queue_splice_in(pipe_queue_t *queue, int fd, size_t max_size, int64_t timestamp);
+
+/**
+ * Move the bytes that have arrived no later than the given time out of the queue, without copying them
+ * to the user space.
+ *
+ * @param [in] queue a pointer to the queue
+ * @param [in] fd the descriptor to move to
+ * @param [in] until the latest arrival time of the bytes to move
+ * @returns The amount of moved bytes, or -1 if failed. errno is EAGAIN if the descriptor can't take anything
+ * right now.
+ */
+ssize_t pipe_queue_splice_out(pipe_queue_t *queue, int fd, int64_t until);
+
+/**
+ * Get the arrival time of the first queued bytes.
+ *
+ * @param [in] queue a pointer to the queue
+ * @returns The timestamp, or -1 if the queue is empty
+ */
+int64_t pipe_queue_next_timestamp(const pipe_queue_t *queue);
+
+#endif //EMERGENCY_DELAY_PIPE_QUEUE_H
@@ -3,27 +3,720 @@
 //
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <string.h>
+#include <sched.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <linux/membarrier.h>
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include "queue.h"
 #include "c23_compat.h"
 
 #define MIN(x, y) (((x) < (y)) ? (x) : (y))
+#define MAX(x, y) (((x) > (y)) ? (x) : (y))
+
+#define QUEUE_FILE_MAGIC "EDQUEUE"
+#define QUEUE_FILE_VERSION 1
+/**
+ * The header takes the first page of the file, so that the buffer is page-aligned
+ */
+#define QUEUE_FILE_HEADER_SIZE 4096
+#define QUEUE_BOOT_ID_SIZE 40
+
+/**
+ * The first page of the file of QUEUE_BACKING_FILE, followed by the buffer
+ */
+struct queue_file_header {
+    char magic[8];
+    uint32_t version;
+    /**
+     * The boot the timestamps of CLOCK_MONOTONIC in the records belong to
+     */
+    char boot_id[QUEUE_BOOT_ID_SIZE];
+    int64_t capacity;
+    /**
+     * The positions of the queue, published right after the queue's own ones. The origin only changes while
+     * the queue is empty, or in the file of a new buffer before it replaces this one.
+     */
+    _Atomic int64_t origin;
+    _Atomic int64_t start;
+    _Atomic int64_t end;
+    /**
+     * The value of the queue's owner set with queue_set_file_tag, 0 in the files of earlier versions
+     */
+    _Atomic uint64_t tag;
+};
+
+static_assert(sizeof(struct queue_file_header) <= QUEUE_FILE_HEADER_SIZE, "The file header doesn't fit its page");
 
 bool queue_init(queue_t *queue, const ssize_t initial_capacity, const queue_overflow_behavior_t overflow_behavior) {
-    if (queue == nullptr)
+    const queue_config_t config = {
+        .initial_capacity = initial_capacity,
+        .overflow_behavior = overflow_behavior,
+        .concurrency = QUEUE_CONCURRENCY_LOCKED
+    };
+
+    return queue_init_config(queue, &config);
+}
+
+/**
+ * Rounds the size of memory mapped according to the queue's memory flags up to the pages it's made of.
+ *
+ * @param [in] queue a pointer to the queue
+ * @param [in] size the size in bytes
+ * @returns The size of the mapping in bytes
+ */
+static ssize_t queue_memory_size(const queue_t *queue, const ssize_t size) {
+    const ssize_t page_size = queue->memory_flags & QUEUE_MEMORY_HUGE_PAGES ? QUEUE_HUGE_PAGE_SIZE
+                                                                            : sysconf(_SC_PAGESIZE);
+    return (size + page_size - 1) / page_size * page_size;
+}
+
+/**
+ * Applies the queue's memory flags to freshly mapped memory.
+ *
+ * @param [in] queue a pointer to the queue
+ * @param [in] memory a pointer to the memory
+ * @param [in] size the size of the memory in bytes
+ * @returns true if succeeded, false if the memory couldn't be locked
+ */
+static bool queue_memory_prepare(const queue_t *queue, char *memory, const ssize_t size) {
+    if (queue->memory_flags & QUEUE_MEMORY_LOCAL) {
+        // Preferred rather than bound, a full node is better than a failed allocation
+        unsigned long nodemask[4] = {0};
+        const size_t bits = sizeof(nodemask[0]) * CHAR_BIT;
+        unsigned int cpu, node;
+        if (getcpu(&cpu, &node) == 0 && node < sizeof(nodemask) * CHAR_BIT) {
+            nodemask[node / bits] |= 1UL << (node % bits);
+            // The kernel reads one bit less than maxnode
+            (void) syscall(SYS_mbind, memory, size, MPOL_PREFERRED, nodemask, sizeof(nodemask) * CHAR_BIT + 1, 0);
+        }
+    }
+
+    // Locking faults the pages in as well
+    if (queue->memory_flags & QUEUE_MEMORY_LOCK)
+        return mlock(memory, size) == 0;
+
+    if ((queue->memory_flags & QUEUE_MEMORY_PREFAULT) && madvise(memory, size, MADV_POPULATE_WRITE) == -1) {
+        // Older kernels, touch every page instead
+        const ssize_t page_size = sysconf(_SC_PAGESIZE);
+        for (ssize_t offset = 0; offset < size; offset += page_size)
+            ((volatile char *) memory)[offset] = 0;
+    }
+
+    return true;
+}
+
+/**
+ * Reserves address space aligned to the alignment.
+ *
+ * @param [in] size the size in bytes, a multiple of the page size
+ * @param [in] alignment the alignment in bytes, a multiple of the page size, or 0 for the page size
+ * @returns A pointer to the inaccessible address space, or MAP_FAILED if failed
+ */
+static void *queue_memory_reserve(const ssize_t size, const ssize_t alignment) {
+    char *address = mmap(nullptr, size + alignment, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (address == MAP_FAILED || alignment == 0)
+        return address;
+
+    // Give back the slack on both sides of the aligned part
+    char *aligned = (char *) (((uintptr_t) address + alignment - 1) & ~(uintptr_t) (alignment - 1));
+    if (aligned > address)
+        munmap(address, aligned - address);
+    if (address + alignment > aligned)
+        munmap(aligned + size, address + alignment - aligned);
+    return aligned;
+}
+
+/**
+ * Maps memory for a buffer or a segment according to the queue's memory flags.
+ *
+ * @param [in] queue a pointer to the queue
+ * @param [in] size the size in bytes, rounded with queue_memory_size
+ * @returns A pointer to the memory, or nullptr if failed
+ */
+static char *queue_memory_map(const queue_t *queue, const ssize_t size) {
+    const bool huge_pages = queue->memory_flags & QUEUE_MEMORY_HUGE_PAGES;
+
+    // Explicit huge pages are only there if the system has reserved them
+    void *memory = MAP_FAILED;
+    if (huge_pages)
+        memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+    if (memory == MAP_FAILED) {
+        // Transparent huge pages only back the aligned parts of a mapping
+        memory = queue_memory_reserve(size, huge_pages ? QUEUE_HUGE_PAGE_SIZE : 0);
+        if (memory == MAP_FAILED)
+            return nullptr;
+        if (mprotect(memory, size, PROT_READ | PROT_WRITE) == -1) {
+            munmap(memory, size);
+            return nullptr;
+        }
+        if (huge_pages)
+            (void) madvise(memory, size, MADV_HUGEPAGE);
+    }
+
+    if (!queue_memory_prepare(queue, memory, size)) {
+        munmap(memory, size);
+        return nullptr;
+    }
+
+    return memory;
+}
+
+/**
+ * Rounds the capacity up to what the queue's backing can allocate.
+ *
+ * @param [in] queue a pointer to the queue
+ * @param [in] capacity the requested capacity in bytes
+ * @returns The capacity of the buffer in bytes
+ */
+static ssize_t queue_buffer_capacity(const queue_t *queue, const ssize_t capacity) {
+    // The segments are rounded instead
+    if (queue->backing != QUEUE_BACKING_SEGMENTED && (queue->memory_flags & QUEUE_MEMORY_HUGE_PAGES))
+        return queue_memory_size(queue, capacity);
+
+    if (queue->backing == QUEUE_BACKING_MIRRORED) {
+        const ssize_t page_size = sysconf(_SC_PAGESIZE);
+        return (capacity + page_size - 1) / page_size * page_size;
+    }
+
+    return QUEUE_SIZE_ALIGN(capacity, queue_record_header_t);
+}
+
+/**
+ * Maps the same memory twice back-to-back, so that [buffer + capacity, buffer + 2 * capacity)
+ * is an alias of [buffer, buffer + capacity).
+ *
+ * @param [in] capacity the capacity in bytes, a multiple of the page size
+ * @param [in] memfd_flags MFD_HUGETLB for explicit huge pages, or 0
+ * @param [in] alignment the alignment of the buffer in bytes, 0 for the page size
+ * @returns A pointer to the buffer, or nullptr if failed
+ */
+static char *queue_buffer_map_views(const ssize_t capacity, const unsigned int memfd_flags, const ssize_t alignment) {
+    const int fd = memfd_create("edelay-queue", MFD_CLOEXEC | memfd_flags);
+    if (fd == -1)
+        return nullptr;
+
+    char *buffer = nullptr;
+    if (ftruncate(fd, capacity) == -1)
+        goto done;
+
+    // Reserve the address space for both copies first, so that nothing else ends up in between
+    void *address = queue_memory_reserve(2 * capacity, alignment);
+    if (address == MAP_FAILED)
+        goto done;
+
+    if (mmap(address, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED
+        || mmap((char *) address + capacity, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0)
+        == MAP_FAILED) {
+        munmap(address, 2 * capacity);
+        goto done;
+    }
+
+    buffer = address;
+
+done:
+    // The mappings keep the memory alive
+    close(fd);
+    return buffer;
+}
+
+static char *queue_buffer_map_mirrored(const queue_t *queue, const ssize_t capacity) {
+    if (!(queue->memory_flags & QUEUE_MEMORY_HUGE_PAGES))
+        return queue_buffer_map_views(capacity, 0, 0);
+
+    char *buffer = queue_buffer_map_views(capacity, MFD_HUGETLB, QUEUE_HUGE_PAGE_SIZE);
+    if (buffer == nullptr) {
+        // Transparent huge pages for shared memory, if shmem_enabled allows them
+        buffer = queue_buffer_map_views(capacity, 0, QUEUE_HUGE_PAGE_SIZE);
+        if (buffer != nullptr)
+            (void) madvise(buffer, 2 * capacity, MADV_HUGEPAGE);
+    }
+    return buffer;
+}
+
+/**
+ * Reads the identifier of the current boot.
+ *
+ * @param [out] boot_id the identifier, a NUL-terminated UUID
+ * @returns true if succeeded, false if failed
+ */
+static bool queue_boot_id(char boot_id[QUEUE_BOOT_ID_SIZE]) {
+    bzero(boot_id, QUEUE_BOOT_ID_SIZE);
+    const int fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return false;
+
+    const ssize_t length = read(fd, boot_id, QUEUE_BOOT_ID_SIZE - 1);
+    close(fd);
+    if (length <= 0)
+        return false;
+
+    boot_id[strcspn(boot_id, "\n")] = '\0';
+    return true;
+}
+
+/**
+ * Gets the path a new buffer's file is written to before it replaces the queue's file.
+ *
+ * @param [in] queue a pointer to the queue
+ * @param [out] path the path
+ * @returns true if succeeded, false if the path is too long
+ */
+static bool queue_file_temp_path(const queue_t *queue, char path[PATH_MAX]) {
+    const int length = snprintf(path, PATH_MAX, "%s.new", queue->file_path);
+    if (length < 0 || length >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Creates the file of a new buffer next to the queue's file and maps it. The file takes the queue's file place
+ * with queue_file_replace once the buffer is ready.
+ *
+ * @param [in] queue a pointer to the queue
+ * @param [in] capacity the capacity in bytes
+ * @returns A pointer to the buffer, or nullptr if failed
+ */
+static char *queue_file_map(const queue_t *queue, const ssize_t capacity) {
+    char path[PATH_MAX];
+    if (!queue_file_temp_path(queue, path))
+        return nullptr;
+
+    const int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1)
+        return nullptr;
+
+    char *map = MAP_FAILED;
+    // Allocated for real, so that writing through the mapping can't hit a full disk with SIGBUS
+    if (posix_fallocate(fd, 0, QUEUE_FILE_HEADER_SIZE + capacity) == 0)
+        map = mmap(nullptr, QUEUE_FILE_HEADER_SIZE + capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    // The mapping keeps the file alive
+    close(fd);
+    if (map == MAP_FAILED || !queue_memory_prepare(queue, map, QUEUE_FILE_HEADER_SIZE + capacity)) {
+        if (map != MAP_FAILED)
+            munmap(map, QUEUE_FILE_HEADER_SIZE + capacity);
+        unlink(path);
+        return nullptr;
+    }
+
+    struct queue_file_header *header = (struct queue_file_header *) map;
+    memcpy(header->magic, QUEUE_FILE_MAGIC, sizeof(header->magic));
+    header->version = QUEUE_FILE_VERSION;
+    (void) queue_boot_id(header->boot_id);
+    header->capacity = capacity;
+    return map + QUEUE_FILE_HEADER_SIZE;
+}
+
+static struct queue_file_header *queue_file_header_of(char *buffer) {
+    return (struct queue_file_header *) (buffer - QUEUE_FILE_HEADER_SIZE);
+}
+
+/**
+ * Puts the file of a new buffer in place of the queue's file, once the buffer holds the queued items.
+ * The rename makes the new buffer and its positions current at once.
+ *
+ * @param [in] queue a pointer to the queue
+ * @param [in] buffer the new buffer, from queue_file_map
+ * @param [in] origin the position that maps to the first byte of the new buffer
+ * @param [in] start the start of the queue
+ * @param [in] end the end of the queue
+ * @returns true if succeeded, false if failed
+ */
+static bool queue_file_replace(queue_t *queue, char *buffer, const ssize_t origin, const ssize_t start,
+                               const ssize_t end) {
+    struct queue_file_header *header = queue_file_header_of(buffer);
+    if (queue->file_header != nullptr)
+        atomic_store_explicit(&header->tag, atomic_load_explicit(&queue->file_header->tag, memory_order_relaxed),
+                              memory_order_relaxed);
+    atomic_store_explicit(&header->origin, origin, memory_order_relaxed);
+    atomic_store_explicit(&header->start, start, memory_order_relaxed);
+    atomic_store_explicit(&header->end, end, memory_order_release);
+
+    char path[PATH_MAX];
+    if (!queue_file_temp_path(queue, path))
+        return false;
+    if (rename(path, queue->file_path) == -1) {
+        unlink(path);
+        return false;
+    }
+
+    queue->file_header = header;
+    return true;
+}
+
+/**
+ * Picks up the items an earlier queue has left in the queue's file, walking all of them so that a file that
+ * doesn't add up is never trusted.
+ *
+ * @param [in] queue a pointer to the queue
+ * @returns true if the items were picked up, false if there's no usable file
+ */
+static bool queue_file_recover(queue_t *queue) {
+    const int fd = open(queue->file_path, O_RDWR | O_CLOEXEC);
+    if (fd == -1)
+        return false;
+
+    bool recovered = false;
+    char *map = MAP_FAILED;
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) == -1 || file_stat.st_size <= QUEUE_FILE_HEADER_SIZE)
+        goto done;
+    map = mmap(nullptr, file_stat.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        goto done;
+
+    const struct queue_file_header *header = (const struct queue_file_header *) map;
+    char boot_id[QUEUE_BOOT_ID_SIZE];
+    const ssize_t capacity = header->capacity;
+    if (memcmp(header->magic, QUEUE_FILE_MAGIC, sizeof(header->magic)) != 0
+        || header->version != QUEUE_FILE_VERSION
+        || !queue_boot_id(boot_id) || strncmp(header->boot_id, boot_id, sizeof(boot_id)) != 0
+        || capacity != file_stat.st_size - QUEUE_FILE_HEADER_SIZE
+        || capacity != (ssize_t) QUEUE_SIZE_ALIGN(capacity, queue_record_header_t))
+        goto done;
+
+    const ssize_t origin = atomic_load_explicit(&header->origin, memory_order_relaxed);
+    const ssize_t start = atomic_load_explicit(&header->start, memory_order_relaxed);
+    const ssize_t end = atomic_load_explicit(&header->end, memory_order_acquire);
+    if (origin < 0 || start < origin || end < start || end - start > capacity)
+        goto done;
+
+    const char *buffer = map + QUEUE_FILE_HEADER_SIZE;
+    uint64_t items = 0;
+    for (ssize_t position = start; position < end;) {
+        const ssize_t offset = (position - origin) % capacity;
+        if (capacity - offset < (ssize_t) sizeof(queue_record_header_t))
+            goto done;
+
+        const queue_record_header_t *record = (const queue_record_header_t *) (buffer + offset);
+        const ssize_t record_size = QUEUE_RECORD_SIZE(record->size);
+        if (record_size > capacity - offset || record_size > end - position)
+            goto done;
+
+        if ((record->flags & QUEUE_RECORD_PADDING) == 0)
+            items++;
+        position += record_size;
+    }
+
+    if (!queue_memory_prepare(queue, map, file_stat.st_size))
+        goto done;
+
+    queue->file_header = (struct queue_file_header *) map;
+    queue->buffer = map + QUEUE_FILE_HEADER_SIZE;
+    queue->capacity = capacity;
+    queue->origin = origin;
+    atomic_store_explicit(&queue->start, start, memory_order_relaxed);
+    atomic_store_explicit(&queue->end, end, memory_order_relaxed);
+    queue->start_cache = start;
+    queue->end_cache = end;
+    atomic_store_explicit(&queue->committed_items, items, memory_order_relaxed);
+    recovered = true;
+
+done:
+    if (!recovered && map != MAP_FAILED)
+        munmap(map, file_stat.st_size);
+    close(fd);
+    return recovered;
+}
+
+static char *queue_buffer_alloc(const queue_t *queue, const ssize_t capacity) {
+    if (queue->backing == QUEUE_BACKING_MIRRORED) {
+        char *buffer = queue_buffer_map_mirrored(queue, capacity);
+        // Both views, so that neither of them faults
+        if (buffer != nullptr && !queue_memory_prepare(queue, buffer, 2 * capacity)) {
+            munmap(buffer, 2 * capacity);
+            return nullptr;
+        }
+        return buffer;
+    }
+
+    if (queue->backing == QUEUE_BACKING_FILE)
+        return queue_file_map(queue, capacity);
+
+    if (queue->memory_flags != 0)
+        return queue_memory_map(queue, queue_memory_size(queue, capacity));
+
+    return malloc(capacity);
+}
+
+static void queue_buffer_free(const queue_t *queue, char *buffer, const ssize_t capacity) {
+    if (queue->backing == QUEUE_BACKING_MIRRORED)
+        munmap(buffer, 2 * capacity);
+    else if (queue->backing == QUEUE_BACKING_FILE)
+        munmap(buffer - QUEUE_FILE_HEADER_SIZE, QUEUE_FILE_HEADER_SIZE + capacity);
+    else if (queue->memory_flags != 0)
+        munmap(buffer, queue_memory_size(queue, capacity));
+    else
+        free(buffer);
+}
+
+static bool queue_segment_is_spillable(const queue_t *queue, const queue_segment_t *segment) {
+    return queue->spill_map != nullptr && segment->data >= queue->spill_map
+           && segment->data < queue->spill_map + queue->spill_map_size;
+}
+
+/**
+ * Allocates a segment. Its data goes to the spill file if there is one and the file has room for it,
+ * otherwise it's mapped on its own if the queue has memory flags, or follows the segment in the same allocation.
+ *
+ * @note Must be called by the producer
+ * @param [in] queue a pointer to the queue
+ * @param [in] size the size of the segment's data in bytes
+ * @returns A pointer to the segment, or nullptr if failed
+ */
+static queue_segment_t *queue_segment_alloc(queue_t *queue, const ssize_t size) {
+    const ssize_t header_size = QUEUE_SIZE_ALIGN(sizeof(queue_segment_t), queue_record_header_t);
+
+    char *data = nullptr;
+    if (queue->spill_map != nullptr && size == queue->segment_size
+        && queue->spill_file_size + size <= queue->spill_map_size) {
+        // Allocated for real, so that writing through the mapping can't hit a full disk with SIGBUS
+        if (posix_fallocate(queue->spill_fd, queue->spill_file_size, size) == 0) {
+            data = queue->spill_map + queue->spill_file_size;
+            queue->spill_file_size += size;
+        } else {
+            // Don't try again, the rest of the segments stay in RAM
+            queue->spill_file_size = queue->spill_map_size;
+        }
+    }
+
+    const bool mapped = data == nullptr && queue->memory_flags != 0;
+    if (mapped) {
+        data = queue_memory_map(queue, queue_memory_size(queue, size));
+        if (data == nullptr)
+            return nullptr;
+    }
+
+    queue_segment_t *segment = malloc(data != nullptr ? header_size : header_size + size);
+    if (segment == nullptr) {
+        if (mapped)
+            munmap(data, queue_memory_size(queue, size));
+        return nullptr;
+    }
+
+    segment->size = size;
+    segment->data = data != nullptr ? data : (char *) segment + header_size;
+    segment->first_timestamp = 0;
+    segment->spilled = false;
+    segment->mapped = mapped;
+    return segment;
+}
+
+static void queue_segment_free(const queue_t *queue, queue_segment_t *segment) {
+    if (segment->mapped)
+        munmap(segment->data, queue_memory_size(queue, segment->size));
+    free(segment);
+}
+
+/**
+ * Gets a segment, reusing a drained one if possible.
+ *
+ * @note Must be called by the producer
+ * @param [in] queue a pointer to the queue
+ * @param [in] size the size of the segment's data in bytes
+ * @returns A pointer to the segment, or nullptr if failed
+ */
+static queue_segment_t *queue_segment_get(queue_t *queue, const ssize_t size) {
+    queue_segment_t *segment = nullptr;
+
+    if (size == queue->segment_size) {
+        // The producer is the only one taking segments off the list, so the head can't be reused under our feet
+        segment = atomic_load_explicit(&queue->free_segments, memory_order_acquire);
+        while (segment != nullptr
+               && !atomic_compare_exchange_weak_explicit(&queue->free_segments, &segment,
+                                                         atomic_load_explicit(&segment->next, memory_order_relaxed),
+                                                         memory_order_acquire, memory_order_acquire));
+        if (segment != nullptr)
+            atomic_fetch_sub_explicit(&queue->free_segment_count, 1, memory_order_relaxed);
+    }
+
+    if (segment == nullptr) {
+        segment = queue_segment_alloc(queue, size);
+        if (segment == nullptr)
+            return nullptr;
+    }
+
+    atomic_store_explicit(&segment->next, nullptr, memory_order_relaxed);
+    return segment;
+}
+
+/**
+ * Puts a segment that is not used anymore to the list of free segments, or frees it if there are enough of them.
+ *
+ * @param [in] queue a pointer to the queue
+ * @param [in] segment a pointer to the segment
+ */
+static void queue_segment_put(queue_t *queue, queue_segment_t *segment) {
+    if (segment->spilled) {
+        segment->spilled = false;
+        queue->spilled_bytes -= segment->size;
+    }
+
+    const ssize_t free_count = atomic_load_explicit(&queue->free_segment_count, memory_order_relaxed);
+    if (queue_segment_is_spillable(queue, segment)) {
+        // The file never gives its space back, so the segment is always kept, just not always in RAM
+        if (free_count >= queue->spill_threshold / queue->segment_size) {
+            (void) madvise(segment->data, segment->size, MADV_DONTNEED);
+            (void) posix_fadvise(queue->spill_fd, segment->data - queue->spill_map, segment->size,
+                                 POSIX_FADV_DONTNEED);
+        }
+    } else if (segment->size != queue->segment_size
+               || free_count >= atomic_load_explicit(&queue->capacity, memory_order_relaxed) / queue->segment_size) {
+        queue_segment_free(queue, segment);
+        return;
+    }
+
+    atomic_fetch_add_explicit(&queue->free_segment_count, 1, memory_order_relaxed);
+    queue_segment_t *head = atomic_load_explicit(&queue->free_segments, memory_order_relaxed);
+    do {
+        atomic_store_explicit(&segment->next, head, memory_order_relaxed);
+    } while (!atomic_compare_exchange_weak_explicit(&queue->free_segments, &head, segment,
+                                                    memory_order_release, memory_order_relaxed));
+}
+
+/**
+ * Frees the free segments that exceed the capacity.
+ *
+ * @note Must be called by the producer
+ * @param [in] queue a pointer to the queue
+ * @param [in] limit how many free segments to keep
+ */
+static void queue_segment_trim(queue_t *queue, const ssize_t limit) {
+    // The spill file segments are only freed along with the queue
+    if (queue->spill_map != nullptr && limit > 0)
+        return;
+
+    while (atomic_load_explicit(&queue->free_segment_count, memory_order_relaxed) > limit) {
+        queue_segment_t *segment = queue_segment_get(queue, queue->segment_size);
+        queue_segment_free(queue, segment);
+    }
+}
+
+/**
+ * Creates the unlinked spill file and reserves the address space for all of it.
+ *
+ * @param [in] queue a pointer to the queue
+ * @param [in] config a pointer to the queue configuration
+ * @returns true if succeeded, false if failed
+ */
+static bool queue_spill_open(queue_t *queue, const queue_config_t *config) {
+    // Segments are dropped from RAM and read back a page at a time
+    const ssize_t page_size = sysconf(_SC_PAGESIZE);
+    queue->segment_size = (queue->segment_size + page_size - 1) / page_size * page_size;
+    queue->spill_threshold = config->spill_threshold;
+
+    const ssize_t file_size = config->spill_file_size > 0 ? config->spill_file_size : QUEUE_DEFAULT_SPILL_FILE_SIZE;
+    queue->spill_map_size = file_size / queue->segment_size * queue->segment_size;
+
+    queue->spill_fd = open(config->spill_directory, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (queue->spill_fd == -1)
+        return false;
+
+    // The file grows into the mapping as segments are allocated
+    char *map = mmap(nullptr, queue->spill_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, queue->spill_fd, 0);
+    if (map == MAP_FAILED) {
+        close(queue->spill_fd);
+        queue->spill_fd = -1;
+        return false;
+    }
+
+    queue->spill_map = map;
+    return true;
+}
+
+/**
+ * Lets the process use expedited membarrier(), which runs a full fence on every thread of the process that is running.
+ *
+ * @returns true if succeeded, false if the kernel doesn't support it
+ */
+static bool queue_membarrier_register(void) {
+    // Registering again is a no-op, only the first call of the process takes a moment
+    return syscall(SYS_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0, 0) == 0;
+}
+
+static bool queue_is_allocated(const queue_t *queue) {
+    return queue->buffer != nullptr || queue->tail_segment != nullptr;
+}
+
+bool queue_init_config(queue_t *queue, const queue_config_t *config) {
+    if (queue == nullptr || config == nullptr)
         return false;
 
     bzero(queue, sizeof(*queue));
 
-    queue->overflow_behavior = overflow_behavior;
+    queue->overflow_behavior = config->overflow_behavior;
+    queue->concurrency = config->concurrency;
+    queue->backing = config->backing;
+    queue->max_capacity = config->max_capacity;
+    queue->shrink_target = config->shrink_target;
+    queue->shrink_low_water_percent = config->shrink_low_water_percent;
+    queue->shrink_period_ms = config->shrink_period_ms;
+    queue->memory_flags = config->memory_flags;
     queue->start = 0;
     queue->end = 0;
-    queue->size = (initial_capacity + QUEUE_ITEM_BUFFER_SIZE - 1) / QUEUE_ITEM_BUFFER_SIZE;
-    queue->buffer = malloc(queue->size * QUEUE_ITEM_SIZE);
-    if (queue->buffer == nullptr)
+    queue->reserved = -1;
+    queue->spill_fd = -1;
+    queue->membarrier = queue->concurrency == QUEUE_CONCURRENCY_SPSC && queue_membarrier_register();
+    queue->capacity = queue_buffer_capacity(queue, config->initial_capacity);
+    if (queue->capacity <= 0)
         return false;
 
+    if (queue->backing == QUEUE_BACKING_SEGMENTED) {
+        queue->segment_size = QUEUE_SIZE_ALIGN(config->segment_size > 0 ? config->segment_size
+                                                                        : QUEUE_DEFAULT_SEGMENT_SIZE,
+                                               queue_record_header_t);
+        if (queue->memory_flags & QUEUE_MEMORY_HUGE_PAGES)
+            queue->segment_size = queue_memory_size(queue, queue->segment_size);
+        if (config->spill_directory != nullptr && !queue_spill_open(queue, config))
+            return false;
+        queue->tail_segment = queue_segment_get(queue, queue->segment_size);
+        if (queue->tail_segment == nullptr)
+            return false;
+        queue->tail_segment->position = 0;
+        queue->head_segment = queue->tail_segment;
+
+        // The segments are recycled once drained, so only the first pass through the queue would fault
+        if (queue->memory_flags & (QUEUE_MEMORY_PREFAULT | QUEUE_MEMORY_LOCK)) {
+            for (ssize_t size = queue->segment_size; size < queue->capacity; size += queue->segment_size) {
+                queue_segment_t *segment = queue_segment_alloc(queue, queue->segment_size);
+                if (segment == nullptr)
+                    return false;
+                queue_segment_put(queue, segment);
+            }
+        }
+    } else if (queue->backing == QUEUE_BACKING_FILE) {
+        queue->file_path = config->file_path;
+        if (queue->file_path == nullptr)
+            return false;
+        if (!queue_file_recover(queue)) {
+            char *buffer = queue_buffer_alloc(queue, queue->capacity);
+            if (buffer == nullptr)
+                return false;
+            if (!queue_file_replace(queue, buffer, 0, 0, 0)) {
+                queue_buffer_free(queue, buffer, queue->capacity);
+                return false;
+            }
+            queue->buffer = buffer;
+        }
+    } else {
+        queue->buffer = queue_buffer_alloc(queue, queue->capacity);
+        if (queue->buffer == nullptr)
+            return false;
+    }
+
     if (pthread_mutex_init(&queue->pop_lock, NULL) != 0
         || pthread_mutex_init(&queue->push_lock, NULL) != 0)
         return false;
@@ -38,77 +731,376 @@ void queue_destroy(queue_t *queue) {
     queue_clear(queue);
 
     if (queue->buffer != nullptr) {
-        free(queue->buffer);
+        queue_buffer_free(queue, queue->buffer, queue->capacity);
         queue->buffer = nullptr;
+        queue->file_header = nullptr;
+    }
+
+    if (queue->tail_segment != nullptr) {
+        // After queue_clear the head segment is the tail one
+        queue_segment_free(queue, queue->tail_segment);
+        queue->head_segment = queue->tail_segment = nullptr;
+        queue_segment_trim(queue, 0);
+    }
+
+    if (queue->spill_map != nullptr) {
+        munmap(queue->spill_map, queue->spill_map_size);
+        close(queue->spill_fd);
+        queue->spill_map = nullptr;
+        queue->spill_fd = -1;
     }
 
+    free(queue->skip_buffer);
+    queue->skip_buffer = nullptr;
+    queue->skip_buffer_size = 0;
+
     // TODO: undefined behavior when the queue is still being used by the other threads
     assert(pthread_mutex_destroy(&queue->pop_lock) == 0);
     assert(pthread_mutex_destroy(&queue->push_lock) == 0);
 }
 
-static ssize_t queue_free_space_chunks(const queue_t *queue) {
-    if (queue == nullptr)
-        return 0;
+/*
+ * Synchronization
+ *
+ * Both modes share the same cursor protocol: the producer owns `end`, the consumer owns `start`, and each side
+ * publishes its cursor with a release store and reads the other one with an acquire load. The locked mode
+ * additionally serializes the producers with push_lock and the consumers with pop_lock.
+ *
+ * In the SPSC mode the consumer does not take pop_lock, so a relayout of the buffer (which moves the items around)
+ * has to wait until the consumer is out of the buffer. The consumer announces itself through consumer_busy,
+ * the resizing thread through relayout; if the consumer sees a relayout in progress, it backs off and waits
+ * for it on pop_lock, which the resizing thread holds for the whole relayout. Each side's store has to be visible
+ * before its load of the other's flag, which takes a full fence. Where the kernel has expedited membarrier(),
+ * the resizing thread runs that fence on the consumer's behalf, and the consumer only keeps the compiler from
+ * reordering the two.
+ *
+ * A relayout holds both locks, always taking push_lock before pop_lock: the producer may have to lay the buffer out
+ * anew to make room while it holds push_lock, and no consumer ever waits for push_lock while holding pop_lock.
+ *
+ * Several consumers may share the queue through cursors, each of them reading the whole queue. The cursors are
+ * consumer state like the start: they are moved only on the consumer side, and by the producer under a relayout.
+ * The start follows the slowest cursor, so the producer sees a single consumer either way.
+ */
+
+static void queue_producer_enter(queue_t *queue) {
+    if (queue->concurrency == QUEUE_CONCURRENCY_LOCKED)
+        pthread_mutex_lock(&queue->push_lock);
+}
+
+static void queue_producer_leave(queue_t *queue) {
+    if (queue->concurrency == QUEUE_CONCURRENCY_LOCKED)
+        pthread_mutex_unlock(&queue->push_lock);
+}
+
+static void queue_consumer_enter(queue_t *queue) {
+    if (queue->concurrency == QUEUE_CONCURRENCY_LOCKED) {
+        pthread_mutex_lock(&queue->pop_lock);
+        return;
+    }
+
+    while (true) {
+        atomic_store_explicit(&queue->consumer_busy, true, memory_order_relaxed);
+        // The store has to be visible before the load, the relayout takes care of that with membarrier()
+        // if it can, so that only the rare relayout pays for the fence
+        if (queue->membarrier)
+            atomic_signal_fence(memory_order_seq_cst);
+        else
+            atomic_thread_fence(memory_order_seq_cst);
+        // Pairs with the release in queue_relayout_end(), so a relayout that has just finished is seen whole
+        if (!atomic_load_explicit(&queue->relayout, memory_order_acquire))
+            return;
+
+        atomic_store_explicit(&queue->consumer_busy, false, memory_order_release);
+        // Wait for the relayout to finish
+        pthread_mutex_lock(&queue->pop_lock);
+        pthread_mutex_unlock(&queue->pop_lock);
+    }
+}
+
+static void queue_consumer_leave(queue_t *queue) {
+    if (queue->concurrency == QUEUE_CONCURRENCY_LOCKED) {
+        pthread_mutex_unlock(&queue->pop_lock);
+        return;
+    }
+
+    atomic_store_explicit(&queue->consumer_busy, false, memory_order_release);
+}
+
+static void queue_relayout_begin(queue_t *queue, const bool push_locked) {
+    // push_lock always comes first, the producer already holds it when it makes room for a record
+    if (!push_locked)
+        pthread_mutex_lock(&queue->push_lock);
+    pthread_mutex_lock(&queue->pop_lock);
+
+    if (queue->concurrency == QUEUE_CONCURRENCY_SPSC) {
+        atomic_store_explicit(&queue->relayout, true, memory_order_relaxed);
+        // Either the consumer has announced itself by now, or it sees the relayout once it's fenced
+        if (!queue->membarrier || syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0) == -1)
+            atomic_thread_fence(memory_order_seq_cst);
+        while (atomic_load_explicit(&queue->consumer_busy, memory_order_acquire))
+            sched_yield();
+    }
+}
+
+static void queue_relayout_end(queue_t *queue, const bool push_locked) {
+    if (queue->concurrency == QUEUE_CONCURRENCY_SPSC)
+        atomic_store_explicit(&queue->relayout, false, memory_order_release);
+
+    pthread_mutex_unlock(&queue->pop_lock);
+    if (!push_locked)
+        pthread_mutex_unlock(&queue->push_lock);
+}
 
-    if (queue->start <= queue->end)
-        return queue->size - queue->end + queue->start;
-    return queue->start - queue->end;
+/**
+ * Publishes the start of the queue, and keeps it in the file if there is one.
+ *
+ * @param [in] queue a pointer to the queue
+ * @param [in] start the new start
+ * @param [in] order the memory order the start is stored with
+ */
+static void queue_store_start(queue_t *queue, const ssize_t start, const memory_order order) {
+    atomic_store_explicit(&queue->start, start, order);
+    if (queue->file_header != nullptr)
+        atomic_store_explicit(&queue->file_header->start, start, memory_order_release);
+}
+
+/**
+ * Starts the buffer over from the given position, only while the queue is empty.
+ *
+ * @param [in] queue a pointer to the queue
+ * @param [in] origin the position that maps to the first byte of the buffer
+ */
+static void queue_store_origin(queue_t *queue, const ssize_t origin) {
+    queue->origin = origin;
+    // Only read back while the queue isn't empty, that is after the next end is published
+    if (queue->file_header != nullptr)
+        atomic_store_explicit(&queue->file_header->origin, origin, memory_order_relaxed);
+}
+
+static ssize_t queue_offset(const queue_t *queue, const ssize_t position) {
+    return (position - queue->origin) % queue->capacity;
+}
+
+/**
+ * Gets the amount of bytes that can be accessed in one go from the position.
+ *
+ * @param [in] queue a pointer to the queue
+ * @param [in] position the position in the queue
+ * @returns The amount of bytes until the end of the buffer, or the whole capacity for a mirrored buffer
+ */
+static ssize_t queue_contiguous(const queue_t *queue, const ssize_t position) {
+    if (queue->backing == QUEUE_BACKING_MIRRORED)
+        return queue->capacity;
+
+    return queue->capacity - queue_offset(queue, position);
+}
+
+static queue_record_header_t *queue_record_at(const queue_t *queue, const ssize_t position) {
+    return (queue_record_header_t *) (queue->buffer + queue_offset(queue, position));
+}
+
+/**
+ * Gets the amount of bytes the producer can write in one go from its position.
+ *
+ * @note Must be called by the producer
+ * @param [in] queue a pointer to the queue
+ * @param [in] end the producer's position
+ * @returns The amount of bytes until the end of the buffer or the producer's segment
+ */
+static ssize_t queue_producer_contiguous(const queue_t *queue, const ssize_t end) {
+    if (queue->backing == QUEUE_BACKING_SEGMENTED)
+        return queue->tail_segment->position + queue->tail_segment->size - end;
+
+    return queue_contiguous(queue, end);
+}
+
+static queue_record_header_t *queue_producer_record_at(const queue_t *queue, const ssize_t position) {
+    if (queue->backing == QUEUE_BACKING_SEGMENTED)
+        return (queue_record_header_t *) (queue->tail_segment->data + (position - queue->tail_segment->position));
+
+    return queue_record_at(queue, position);
+}
+
+/**
+ * Gets the record at the consumer's position, moving on to the next segment if the current one is drained.
+ *
+ * @note Must be called by the consumer, and only if the queue is not empty at the position
+ * @param [in] queue a pointer to the queue
+ * @param [in] start the consumer's position
+ * @returns A pointer to the record's header
+ */
+static queue_record_header_t *queue_consumer_record_at(queue_t *queue, const ssize_t start) {
+    if (queue->backing != QUEUE_BACKING_SEGMENTED)
+        return queue_record_at(queue, start);
+
+    queue_segment_t *head = queue->head_segment;
+    if (start == head->position + head->size) {
+        // There is something after the position, so the producer has linked the next segment already
+        queue->head_segment = atomic_load_explicit(&head->next, memory_order_acquire);
+        queue_segment_put(queue, head);
+        head = queue->head_segment;
+    }
+
+    return (queue_record_header_t *) (head->data + (start - head->position));
 }
 
 bool queue_is_empty(const queue_t *queue) {
-    return queue->start == queue->end;
+    return atomic_load_explicit(&queue->start, memory_order_acquire)
+           == atomic_load_explicit(&queue->end, memory_order_acquire);
+}
+
+/**
+ * Wakes up the consumer blocked in queue_wait_nonempty.
+ *
+ * @param [in] queue a pointer to the queue
+ */
+static void queue_futex_wake(queue_t *queue) {
+    atomic_fetch_add_explicit(&queue->wake_sequence, 1, memory_order_seq_cst);
+    syscall(SYS_futex, &queue->wake_sequence, FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+}
+
+/**
+ * Wakes the consumer up if it is blocked waiting for an item.
+ *
+ * @note Must be called by the producer after publishing an item
+ * @param [in] queue a pointer to the queue
+ */
+static void queue_notify(queue_t *queue) {
+    // Pairs with the fence in queue_wait_nonempty: either we see the flag, or the consumer sees the item
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&queue->consumer_waiting, memory_order_relaxed))
+        queue_futex_wake(queue);
+}
+
+bool queue_wait_nonempty(queue_t *queue, const int64_t deadline) {
+    if (queue == nullptr)
+        return false;
+
+    const struct timespec timeout = {
+        .tv_sec = deadline / 1000000000,
+        .tv_nsec = deadline % 1000000000
+    };
+
+    while (queue_is_empty(queue)) {
+        const uint32_t sequence = atomic_load_explicit(&queue->wake_sequence, memory_order_seq_cst);
+        atomic_store_explicit(&queue->consumer_waiting, true, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+
+        if (!queue_is_empty(queue))
+            break;
+        if (atomic_load_explicit(&queue->wake_pending, memory_order_seq_cst))
+            break;
+
+        // FUTEX_WAIT_BITSET takes an absolute CLOCK_MONOTONIC deadline, unlike FUTEX_WAIT
+        const long result = syscall(SYS_futex, &queue->wake_sequence, FUTEX_WAIT_BITSET_PRIVATE, sequence,
+                                    deadline < 0 ? nullptr : &timeout, nullptr, FUTEX_BITSET_MATCH_ANY);
+        if (result == -1 && errno == ETIMEDOUT)
+            break;
+    }
+
+    atomic_store_explicit(&queue->consumer_waiting, false, memory_order_relaxed);
+    atomic_store_explicit(&queue->wake_pending, false, memory_order_relaxed);
+
+    return !queue_is_empty(queue);
+}
+
+void queue_wake(queue_t *queue) {
+    if (queue == nullptr)
+        return;
+
+    atomic_store_explicit(&queue->wake_pending, true, memory_order_seq_cst);
+    queue_futex_wake(queue);
 }
 
 ssize_t queue_free_space(const queue_t *queue) {
-    return queue_free_space_chunks(queue) * QUEUE_ITEM_BUFFER_SIZE;
+    if (queue == nullptr)
+        return 0;
+
+    const ssize_t end = atomic_load_explicit(&queue->end, memory_order_acquire);
+    const ssize_t start = atomic_load_explicit(&queue->start, memory_order_acquire);
+    return queue->capacity - (end - start);
 }
 
 ssize_t queue_size(const queue_t *queue) {
-    return queue->size * QUEUE_ITEM_BUFFER_SIZE;
+    return queue->capacity;
+}
+
+/**
+ * Changes the capacity of a segmented queue, which is just a limit, so nothing has to be moved.
+ *
+ * @param [in] queue a pointer to the queue
+ * @param [in] new_capacity the new capacity in bytes
+ * @param [in] push_locked whether the calling thread already holds push_lock
+ * @returns true if succeeded, false if the items don't fit into the new capacity
+ */
+static bool queue_resize_segmented(queue_t *queue, const ssize_t new_capacity, const bool push_locked) {
+    if (!push_locked)
+        pthread_mutex_lock(&queue->push_lock);
+
+    const bool success = new_capacity >= atomic_load_explicit(&queue->end, memory_order_relaxed)
+                                          - atomic_load_explicit(&queue->start, memory_order_acquire);
+    if (success) {
+        atomic_store_explicit(&queue->capacity, new_capacity, memory_order_relaxed);
+        queue_segment_trim(queue, new_capacity / queue->segment_size);
+    }
+
+    if (!push_locked)
+        pthread_mutex_unlock(&queue->push_lock);
+
+    return success;
 }
 
 static bool queue_resize_internal(queue_t *queue, ssize_t new_capacity, const bool push_locked) {
-    if (queue == nullptr || queue->buffer == nullptr)
+    if (queue == nullptr || !queue_is_allocated(queue))
         return false;
 
-    new_capacity = (new_capacity + QUEUE_ITEM_BUFFER_SIZE - 1) / QUEUE_ITEM_BUFFER_SIZE;
+    new_capacity = queue_buffer_capacity(queue, new_capacity);
 
-    if (new_capacity == queue->size)
+    if (new_capacity <= 0)
+        return false;
+    if (new_capacity == queue->capacity)
         return true;
+    if (queue->backing == QUEUE_BACKING_SEGMENTED)
+        return queue_resize_segmented(queue, new_capacity, push_locked);
 
     bool success = false;
 
-    pthread_mutex_lock(&queue->pop_lock);
-    if (!push_locked)
-        pthread_mutex_lock(&queue->push_lock);
+    queue_relayout_begin(queue, push_locked);
 
-    if (new_capacity < queue->size) {
-        // TODO: shrink
+    const ssize_t start = atomic_load_explicit(&queue->start, memory_order_relaxed);
+    const ssize_t end = atomic_load_explicit(&queue->end, memory_order_relaxed);
+
+    // Shrinking is only possible down to the queued items
+    const ssize_t used = end - start;
+    if (new_capacity < used)
         goto fail;
-    } else {
-        queue_item_t *new_buffer = realloc(queue->buffer, new_capacity * QUEUE_ITEM_SIZE);
-        if (new_buffer == nullptr)
-            goto fail;
-
-        if (queue->start > queue->end) {
-            // Rearrange the items if they loop around
-            ssize_t free_item_space = new_capacity - queue->size;
-            ssize_t take_from_end = MIN(queue->end, free_item_space);
-            memcpy(&new_buffer[queue->size], &new_buffer[0], take_from_end * QUEUE_ITEM_SIZE);
-            memcpy(&new_buffer[0], &new_buffer[free_item_space], (queue->end - take_from_end) * QUEUE_ITEM_SIZE);
-            queue->end = queue->size + take_from_end;
-        }
 
-        queue->buffer = new_buffer;
+    char *new_buffer = queue_buffer_alloc(queue, new_capacity);
+    if (new_buffer == nullptr)
+        goto fail;
+
+    // Compact the items to the beginning of the new buffer, unwrapping them if they loop around
+    const ssize_t offset = queue_offset(queue, start);
+    const ssize_t first_part = MIN(used, queue_contiguous(queue, start));
+    memcpy(new_buffer, queue->buffer + offset, first_part);
+    memcpy(new_buffer + first_part, queue->buffer, used - first_part);
+
+    // The file of the new buffer replaces the old one only once it holds all the items
+    if (queue->backing == QUEUE_BACKING_FILE && !queue_file_replace(queue, new_buffer, start, start, end)) {
+        queue_buffer_free(queue, new_buffer, new_capacity);
+        goto fail;
     }
-    queue->size = new_capacity;
+
+    queue_buffer_free(queue, queue->buffer, queue->capacity);
+    queue->buffer = new_buffer;
+    queue->origin = start;
+    queue->capacity = new_capacity;
+    queue->start_cache = start;
+    queue->end_cache = end;
     success = true;
 
 fail:
-    pthread_mutex_unlock(&queue->pop_lock);
-    if (!push_locked)
-        pthread_mutex_unlock(&queue->push_lock);
+    queue_relayout_end(queue, push_locked);
 
     return success;
 }
@@ -117,144 +1109,931 @@ bool queue_resize(queue_t *queue, const ssize_t new_capacity) {
     return queue_resize_internal(queue, new_capacity, false);
 }
 
-NODISCARD
+/**
+ * Gets the amount of free space a record needs at the end of the queue.
+ *
+ * @param [in] queue a pointer to the queue
+ * @param [in] end the producer's position
+ * @param [in] record_size the size of the record in bytes
+ * @returns The record's size plus the padding in front of it if it doesn't fit until the end of the buffer
+ */
+static ssize_t queue_needed_space(const queue_t *queue, const ssize_t end, const ssize_t record_size) {
+    // A record never wraps around, the space left until the end of the buffer is skipped instead
+    const ssize_t contiguous = queue_producer_contiguous(queue, end);
+    return record_size + (contiguous < record_size ? contiguous : 0);
+}
+
+/**
+ * Grows the buffer so that the record fits.
+ *
+ * @note Must be called by the producer
+ * @param [in] queue a pointer to the queue
+ * @param [in] record_size the size of the record in bytes
+ * @returns true if succeeded, false if the buffer can't grow any further
+ */
+static bool queue_grow(queue_t *queue, const ssize_t record_size) {
+    const ssize_t end = atomic_load_explicit(&queue->end, memory_order_relaxed);
+    const ssize_t used = end - atomic_load_explicit(&queue->start, memory_order_acquire);
+
+    // After a relayout the items start at the beginning of the buffer, so no padding is needed.
+    // A segmented queue is not laid out anew, but its new segments are allocated only as they are needed.
+    const ssize_t needed = queue->backing == QUEUE_BACKING_SEGMENTED
+                               ? queue_needed_space(queue, end, record_size)
+                               : record_size;
+    // At least double it: at the same capacity the record might only fit once the padding in front of it is gone,
+    // and the buffer is not laid out anew then
+    ssize_t new_capacity = queue->capacity;
+    do
+        new_capacity *= 2;
+    while (new_capacity - used < needed);
+
+    if (queue->max_capacity > 0 && new_capacity > queue->max_capacity) {
+        new_capacity = queue_buffer_capacity(queue, queue->max_capacity);
+        if (new_capacity - used < needed || new_capacity <= queue->capacity)
+            return false;
+    }
+
+    if (!queue_resize_internal(queue, new_capacity, queue->concurrency == QUEUE_CONCURRENCY_LOCKED))
+        return false;
+
+    atomic_fetch_add_explicit(&queue->resizes, 1, memory_order_relaxed);
+    return true;
+}
 
-static bool queue_push_chunk(queue_t *queue, const ssize_t size, const bool continued, const char *buffer) {
-    if (queue_free_space_chunks(queue) == 0)
-        // TODO: handle the overflow gracefully with queue->overflow_behavior
+/**
+ * Moves the cursors that are behind the start of the queue up to it, after the records in front of it were dropped.
+ *
+ * @note Must be called under a relayout, after the start has been moved
+ * @param [in] queue a pointer to the queue
+ */
+static void queue_cursors_follow(queue_t *queue) {
+    const ssize_t start = atomic_load_explicit(&queue->start, memory_order_relaxed);
+    for (queue_cursor_t *cursor = queue->cursors; cursor != nullptr; cursor = cursor->next) {
+        // A lapsed cursor is never looked into again
+        if (cursor->lapsed || cursor->position >= start)
+            continue;
+
+        cursor->position = start;
+        cursor->segment = queue->head_segment;
+        cursor->read_offset = 0;
+        cursor->sequence = atomic_load_explicit(&queue->consumed_items, memory_order_relaxed);
+    }
+}
+
+/**
+ * Drops the oldest items until the record fits.
+ *
+ * @note Must be called by the producer
+ * @param [in] queue a pointer to the queue
+ * @param [in] record_size the size of the record in bytes
+ * @returns true if succeeded, false if the record doesn't fit even into an empty buffer
+ */
+static bool queue_evict(queue_t *queue, const ssize_t record_size) {
+    if (record_size > queue->capacity)
         return false;
 
-    assert(size <= QUEUE_ITEM_BUFFER_SIZE);
+    const bool push_locked = queue->concurrency == QUEUE_CONCURRENCY_LOCKED;
+    queue_relayout_begin(queue, push_locked);
+
+    const ssize_t end = atomic_load_explicit(&queue->end, memory_order_relaxed);
+    ssize_t start = atomic_load_explicit(&queue->start, memory_order_relaxed);
+    while (start != end && queue->capacity - (end - start) < queue_needed_space(queue, end, record_size)) {
+        const queue_record_header_t *header = queue_consumer_record_at(queue, start);
+        if ((header->flags & QUEUE_RECORD_PADDING) == 0) {
+            // A partially popped item is dropped too, the consumer is not in the middle of a peek here
+            atomic_fetch_add_explicit(&queue->dropped_items, 1, memory_order_relaxed);
+            atomic_fetch_add_explicit(&queue->dropped_bytes, header->size - queue->read_offset,
+                                      memory_order_relaxed);
+            // The consumer is kept out during the relayout
+            atomic_fetch_add_explicit(&queue->consumed_items, 1, memory_order_relaxed);
+            queue->read_offset = 0;
+        }
 
-    const ssize_t index = queue->end;
-    queue->end++;
-    if (queue->end >= queue->size)
-        queue->end -= queue->size;
+        start += QUEUE_RECORD_SIZE(header->size);
+    }
 
-    queue_item_t *item = &queue->buffer[index];
-    item->header.offset = 0;
-    item->header.size = size;
-    item->header.continued = continued;
+    queue_store_start(queue, start, memory_order_relaxed);
+    if (start == end && queue->backing != QUEUE_BACKING_SEGMENTED)
+        // Nothing is left to skip the padding for, start over from the beginning of the buffer
+        queue_store_origin(queue, end);
 
-    memcpy(item->buffer, buffer, size);
+    queue->start_cache = start;
+    queue->end_cache = end;
+    // The consumers lose the dropped items too
+    queue_cursors_follow(queue);
 
-    return true;
+    queue_relayout_end(queue, push_locked);
+
+    return queue->capacity - (end - start) >= queue_needed_space(queue, end, record_size);
+}
+
+/**
+ * Makes room for a record at the end of the queue without publishing it,
+ * applying the queue's overflow behavior if there is not enough space.
+ *
+ * @note Must be called by the producer
+ * @param [in] queue a pointer to the queue
+ * @param [in] size the record's payload size in bytes
+ * @param [out] skipped set if the record should be dropped according to the overflow behavior
+ * @returns A pointer to the record's header, or nullptr if the record doesn't fit
+ */
+static queue_record_header_t *queue_reserve_record(queue_t *queue, const ssize_t size, bool *skipped) {
+    const ssize_t record_size = QUEUE_RECORD_SIZE(size);
+    ssize_t end = atomic_load_explicit(&queue->end, memory_order_relaxed);
+    ssize_t needed = queue_needed_space(queue, end, record_size);
+
+    *skipped = false;
+
+    // Only go for the consumer's cache line if the cached start says there is no room
+    if (queue->capacity - (end - queue->start_cache) < needed) {
+        queue->start_cache = atomic_load_explicit(&queue->start, memory_order_acquire);
+        if (queue->capacity - (end - queue->start_cache) < needed) {
+            bool has_room = false;
+            switch (queue->overflow_behavior) {
+                case QUEUE_OVERFLOW_SKIP:
+                    break;
+                case QUEUE_OVERFLOW_RESIZE:
+                    if (!queue_grow(queue, record_size))
+                        return nullptr;
+                    has_room = true;
+                    break;
+                case QUEUE_OVERFLOW_LOOP_REPLACE:
+                    has_room = queue_evict(queue, record_size);
+                    break;
+            }
+
+            if (!has_room) {
+                *skipped = true;
+                return nullptr;
+            }
+
+            // The buffer might have been laid out anew, and the consumer might have moved on meanwhile
+            end = atomic_load_explicit(&queue->end, memory_order_relaxed);
+            queue->start_cache = atomic_load_explicit(&queue->start, memory_order_acquire);
+            needed = queue_needed_space(queue, end, record_size);
+            assert(queue->capacity - (end - queue->start_cache) >= needed);
+        }
+    }
+
+    queue_segment_t *segment = nullptr;
+    if (queue->backing == QUEUE_BACKING_SEGMENTED && queue_producer_contiguous(queue, end) < record_size) {
+        segment = queue_segment_get(queue, MAX(queue->segment_size, record_size));
+        if (segment == nullptr)
+            return nullptr;
+        segment->position = end + (needed - record_size);
+    }
+
+    if (needed > record_size) {
+        // Not visible to the consumer until the record after it is committed
+        queue_record_header_t *padding = queue_producer_record_at(queue, end);
+        padding->size = needed - record_size - sizeof(queue_record_header_t);
+        padding->flags = QUEUE_RECORD_PADDING;
+        end += needed - record_size;
+    }
+
+    queue->reserved = end;
+    queue->reserved_size = size;
+    queue->reserved_segment = segment;
+    queue->reserved_header = segment != nullptr
+                                 ? (queue_record_header_t *) segment->data
+                                 : queue_producer_record_at(queue, end);
+    return queue->reserved_header;
+}
+
+/**
+ * Counts an item that was dropped according to the overflow behavior.
+ *
+ * @param [in] queue a pointer to the queue
+ * @param [in] size the item's size in bytes
+ */
+static void queue_count_skipped(queue_t *queue, const ssize_t size) {
+    atomic_fetch_add_explicit(&queue->dropped_items, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&queue->dropped_bytes, size, memory_order_relaxed);
+}
+
+/**
+ * Shrinks the buffer toward the shrink target once its occupancy has stayed below the low-water mark
+ * for the shrink period.
+ *
+ * @note Must be called by the producer
+ * @param [in] queue a pointer to the queue
+ */
+static void queue_auto_shrink(queue_t *queue) {
+    if (queue->shrink_target <= 0 || queue->capacity <= queue->shrink_target)
+        return;
+
+    const ssize_t used = atomic_load_explicit(&queue->end, memory_order_relaxed)
+                         - atomic_load_explicit(&queue->start, memory_order_acquire);
+    if (used * 100 >= queue->capacity * queue->shrink_low_water_percent) {
+        queue->low_water_since = 0;
+        return;
+    }
+
+    struct timespec now_ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now_ts);
+    const int64_t now = (int64_t) now_ts.tv_sec * 1000 + now_ts.tv_nsec / 1000000;
+    if (queue->low_water_since == 0) {
+        queue->low_water_since = now;
+        return;
+    }
+    if (now - queue->low_water_since < queue->shrink_period_ms)
+        return;
+
+    // Halve the buffer at most once per period, so that a burst right after a shrink doesn't undo all of it.
+    // A locked producer still holds push_lock here, which the relayout takes first anyway.
+    queue->low_water_since = now;
+    const ssize_t new_capacity = MAX(queue->shrink_target, queue->capacity / 2);
+    if (queue_resize_internal(queue, new_capacity, queue->concurrency == QUEUE_CONCURRENCY_LOCKED))
+        atomic_fetch_add_explicit(&queue->shrinks, 1, memory_order_relaxed);
+}
+
+/**
+ * Publishes the reserved record.
+ *
+ * @note Must be called by the producer
+ * @param [in] queue a pointer to the queue
+ * @param [in] size the record's actual payload size in bytes, 0 to drop the record
+ * @param [in] timestamp the record's timestamp
+ */
+static void queue_commit_record(queue_t *queue, const ssize_t size, const int64_t timestamp) {
+    assert(size <= queue->reserved_size);
+
+    if (queue->reserved_segment != nullptr) {
+        if (size > 0) {
+            // Linked before the record is published, so the consumer finds it once it gets there
+            queue->reserved_segment->first_timestamp = timestamp;
+            atomic_store_explicit(&queue->tail_segment->next, queue->reserved_segment, memory_order_release);
+            queue->tail_segment = queue->reserved_segment;
+        } else {
+            queue_segment_put(queue, queue->reserved_segment);
+        }
+    }
+
+    if (size > 0) {
+        queue_record_header_t *header = queue->reserved_header;
+        header->size = size;
+        header->flags = 0;
+        header->timestamp = timestamp;
+        atomic_store_explicit(&queue->committed_items,
+                              atomic_load_explicit(&queue->committed_items, memory_order_relaxed) + 1,
+                              memory_order_relaxed);
+        atomic_store_explicit(&queue->end, queue->reserved + QUEUE_RECORD_SIZE(size), memory_order_release);
+        if (queue->file_header != nullptr)
+            atomic_store_explicit(&queue->file_header->end, queue->reserved + QUEUE_RECORD_SIZE(size),
+                                  memory_order_release);
+        queue_notify(queue);
+    }
+
+    queue->reserved = -1;
+    queue->reserved_size = 0;
+    queue->reserved_header = nullptr;
+    queue->reserved_segment = nullptr;
+
+    queue_auto_shrink(queue);
 }
 
 NODISCARD
 
-bool queue_push(queue_t *queue, ssize_t size, const char *buffer) {
-    if (queue == nullptr || queue->buffer == nullptr || buffer == nullptr)
+bool queue_push(queue_t *queue, const ssize_t size, const char *buffer, const int64_t timestamp) {
+    if (queue == nullptr || !queue_is_allocated(queue) || buffer == nullptr || size < 0 || size > UINT32_MAX)
         return false;
 
-    bool success = false;
+    queue_producer_enter(queue);
 
-    pthread_mutex_lock(&queue->push_lock);
-
-    const ssize_t chunks = (size + QUEUE_ITEM_BUFFER_SIZE - 1) / QUEUE_ITEM_BUFFER_SIZE;
-    const ssize_t end_initial = queue->end;
-    for (int i = 0; i < chunks && size > 0; i++) {
-        const ssize_t size_to_push = MIN(QUEUE_ITEM_BUFFER_SIZE, size);
-        const bool has_more_chunks = i != chunks - 1;
-        if (!queue_push_chunk(queue, size_to_push, has_more_chunks, buffer)) {
-            // Undo all the chunks
-            queue->end = end_initial;
-            goto fail;
+    bool skipped;
+    queue_record_header_t *header = queue_reserve_record(queue, size, &skipped);
+    if (header != nullptr) {
+        memcpy(header + 1, buffer, size);
+        queue_commit_record(queue, size, timestamp);
+    } else if (skipped) {
+        queue_count_skipped(queue, size);
+    }
+
+    queue_producer_leave(queue);
+
+    return header != nullptr || skipped;
+}
+
+NODISCARD
+
+char *queue_reserve(queue_t *queue, const ssize_t max_size) {
+    if (queue == nullptr || !queue_is_allocated(queue) || max_size < 0 || max_size > UINT32_MAX)
+        return nullptr;
+
+    queue_producer_enter(queue);
+
+    bool skipped;
+    queue_record_header_t *header = queue_reserve_record(queue, max_size, &skipped);
+    if (header != nullptr)
+        return (char *) (header + 1);
+
+    if (skipped) {
+        // The data still has to go somewhere, hand out the scratch buffer instead
+        if (queue->skip_buffer_size < max_size) {
+            char *skip_buffer = realloc(queue->skip_buffer, max_size);
+            if (skip_buffer != nullptr) {
+                queue->skip_buffer = skip_buffer;
+                queue->skip_buffer_size = max_size;
+            }
         }
 
-        size -= size_to_push;
-        buffer += size_to_push;
+        if (queue->skip_buffer_size >= max_size) {
+            queue->reserved = QUEUE_RESERVED_SKIPPED;
+            queue->reserved_size = max_size;
+            return queue->skip_buffer;
+        }
     }
-    success = true;
 
-fail:
-    pthread_mutex_unlock(&queue->push_lock);
+    queue_producer_leave(queue);
+    return nullptr;
+}
+
+bool queue_commit(queue_t *queue, const ssize_t size, const int64_t timestamp) {
+    if (queue == nullptr || queue->reserved == -1)
+        return false;
+
+    const bool success = size >= 0 && size <= queue->reserved_size;
+    if (queue->reserved == QUEUE_RESERVED_SKIPPED) {
+        if (success && size > 0)
+            queue_count_skipped(queue, size);
+        queue->reserved = -1;
+        queue->reserved_size = 0;
+    } else {
+        queue_commit_record(queue, success ? size : 0, timestamp);
+    }
+
+    queue_producer_leave(queue);
 
     return success;
 }
 
-NODISCARD
+queue_mark_t queue_reserved_mark(const queue_t *queue) {
+    return (queue_mark_t) {
+        .position = queue->reserved,
+        .segment = queue->reserved_segment != nullptr ? queue->reserved_segment : queue->tail_segment,
+        .sequence = atomic_load_explicit(&queue->committed_items, memory_order_relaxed)
+    };
+}
 
-bool queue_pop(queue_t *queue, ssize_t size, char *buffer, ssize_t *written) {
-    if (queue == nullptr || queue->buffer == nullptr || buffer == nullptr || written == nullptr || size == 0)
+bool queue_skip_to(queue_t *queue, const queue_mark_t *mark, const ssize_t offset) {
+    if (queue == nullptr || mark == nullptr || mark->position < 0)
         return false;
 
-    if (queue->start == queue->end)
+    queue_consumer_enter(queue);
+
+    // The consumers sharing the queue skip on their own
+    if (queue->cursors != nullptr) {
+        queue_consumer_leave(queue);
         return false;
+    }
 
-    pthread_mutex_lock(&queue->pop_lock);
+    const ssize_t start = atomic_load_explicit(&queue->start, memory_order_relaxed);
+    const ssize_t end = atomic_load_explicit(&queue->end, memory_order_acquire);
+    if (mark->position < start || mark->position >= end
+        || (mark->position == start && offset < queue->read_offset)) {
+        queue_consumer_leave(queue);
+        return false;
+    }
 
-    bool has_more_chunks = false;
-    ssize_t chunks_size = 0;
-    ssize_t pop_size = 0;
-    do {
-        queue_item_t *item = &queue->buffer[queue->start];
-        const ssize_t size_to_pop = MIN(item->header.size, size);
+    // The segments in between are handed back without looking into them
+    if (queue->backing == QUEUE_BACKING_SEGMENTED) {
+        while (queue->head_segment != mark->segment) {
+            queue_segment_t *head = queue->head_segment;
+            queue->head_segment = atomic_load_explicit(&head->next, memory_order_acquire);
+            queue_segment_put(queue, head);
+        }
+    }
 
-        memcpy(buffer, item->buffer + item->header.offset, size_to_pop);
+    queue->read_offset = offset;
+    queue->end_cache = end;
+    atomic_store_explicit(&queue->consumed_items, mark->sequence, memory_order_relaxed);
+    queue_store_start(queue, mark->position, memory_order_release);
 
-        size -= size_to_pop;
-        chunks_size += item->header.size;
-        pop_size += size_to_pop;
+    queue_consumer_leave(queue);
+    return true;
+}
 
-        item->header.offset = size_to_pop;
-        item->header.size -= item->header.offset;
-        assert(item->header.size >= 0);
+void queue_get_stats(const queue_t *queue, queue_stats_t *stats) {
+    if (queue == nullptr || stats == nullptr)
+        return;
 
-        has_more_chunks = item->header.continued;
+    stats->dropped_items = atomic_load_explicit(&queue->dropped_items, memory_order_relaxed);
+    stats->dropped_bytes = atomic_load_explicit(&queue->dropped_bytes, memory_order_relaxed);
+    stats->resizes = atomic_load_explicit(&queue->resizes, memory_order_relaxed);
+    stats->shrinks = atomic_load_explicit(&queue->shrinks, memory_order_relaxed);
+    stats->queued_items = atomic_load_explicit(&queue->committed_items, memory_order_relaxed)
+                          - atomic_load_explicit(&queue->consumed_items, memory_order_relaxed);
+    stats->used_bytes = atomic_load_explicit(&queue->end, memory_order_relaxed)
+                        - atomic_load_explicit(&queue->start, memory_order_relaxed);
+    stats->capacity = atomic_load_explicit(&queue->capacity, memory_order_relaxed);
+}
 
-        // If the item was fully copied
-        if (item->header.size == 0) {
-            queue->start++;
-            if (queue->start >= queue->size)
-                queue->start -= queue->size;
+bool queue_set_file_tag(queue_t *queue, const uint64_t tag) {
+    if (queue == nullptr || queue->file_header == nullptr)
+        return false;
+
+    atomic_store_explicit(&queue->file_header->tag, tag, memory_order_relaxed);
+    return true;
+}
+
+uint64_t queue_file_tag(const queue_t *queue) {
+    if (queue == nullptr || queue->file_header == nullptr)
+        return 0;
+
+    return atomic_load_explicit(&queue->file_header->tag, memory_order_relaxed);
+}
+
+/**
+ * Finds the first record that is not padding.
+ *
+ * @note Must be called by the consumer
+ * @param [in] queue a pointer to the queue
+ * @param [in,out] start the consumer's position, moved past the padding
+ * @returns A pointer to the record's header, or nullptr if the queue is empty
+ */
+static queue_record_header_t *queue_first_record(queue_t *queue, ssize_t *start) {
+    while (true) {
+        // Only go for the producer's cache line if the cached end says the queue is empty
+        if (*start == queue->end_cache) {
+            queue->end_cache = atomic_load_explicit(&queue->end, memory_order_acquire);
+            if (*start == queue->end_cache)
+                return nullptr;
         }
 
-        if (has_more_chunks)
-            assert(queue_free_space_chunks(queue) > 0);
-    } while (size > 0 && queue_free_space_chunks(queue) > 0 && has_more_chunks);
+        queue_record_header_t *header = queue_consumer_record_at(queue, *start);
+        if ((header->flags & QUEUE_RECORD_PADDING) == 0)
+            return header;
 
-    // Count how many chunks have we missed
-    ssize_t start_temp = queue->start;
-    while (has_more_chunks) {
-        const queue_item_t *item = &queue->buffer[start_temp];
-        assert(item->header.offset == 0);
-        chunks_size += item->header.size;
-        has_more_chunks = item->header.continued;
+        *start += QUEUE_RECORD_SIZE(header->size);
+    }
+}
 
-        start_temp++;
-        if (start_temp >= queue->size)
-            start_temp -= queue->size;
+/**
+ * Finds the first record that is not padding at or after the position, without consuming anything.
+ *
+ * @note Must be called by the consumer
+ * @param [in] queue a pointer to the queue
+ * @param [in,out] segment the segment the position is in, moved on if the position is at its end
+ * @param [in,out] position the position to look from, moved past the padding
+ * @returns A pointer to the record's header, or nullptr if there is nothing at the position
+ */
+static const queue_record_header_t *queue_next_record(queue_t *queue, const queue_segment_t **segment,
+                                                      ssize_t *position) {
+    while (true) {
+        if (*position == queue->end_cache) {
+            queue->end_cache = atomic_load_explicit(&queue->end, memory_order_acquire);
+            if (*position == queue->end_cache)
+                return nullptr;
+        }
 
-        if (has_more_chunks
-            && (start_temp <= queue->end
-                    ? queue->size - queue->end + start_temp
-                    : start_temp - queue->end) <= 0)
-            has_more_chunks = false;
+        const queue_record_header_t *header;
+        if (queue->backing == QUEUE_BACKING_SEGMENTED) {
+            if (*position == (*segment)->position + (*segment)->size)
+                *segment = atomic_load_explicit(&(*segment)->next, memory_order_acquire);
+            header = (const queue_record_header_t *) ((*segment)->data + (*position - (*segment)->position));
+        } else {
+            header = queue_record_at(queue, *position);
+        }
+
+        if ((header->flags & QUEUE_RECORD_PADDING) == 0)
+            return header;
 
-        if (has_more_chunks)
-            assert(queue_free_space_chunks(queue) > 0);
+        *position += QUEUE_RECORD_SIZE(header->size);
     }
+}
 
-    if (pop_size == chunks_size)
-        *written = pop_size;
-    else
-        *written = pop_size - chunks_size;
+/**
+ * Finds the part of the first record that hasn't been popped yet.
+ *
+ * @note Must be called by the consumer
+ * @param [in] queue a pointer to the queue
+ * @param [out] size the size of the span in bytes
+ * @param [out] timestamp the record's timestamp, may be nullptr
+ * @returns A pointer to the span, or nullptr if the queue is empty
+ */
+static const char *queue_first_span(queue_t *queue, ssize_t *size, int64_t *timestamp) {
+    ssize_t start = atomic_load_explicit(&queue->start, memory_order_relaxed);
+    const queue_record_header_t *header = queue_first_record(queue, &start);
+    // Hand the skipped padding back to the producer
+    queue_store_start(queue, start, memory_order_release);
+    if (header == nullptr)
+        return nullptr;
+
+    *size = header->size - queue->read_offset;
+    if (timestamp != nullptr)
+        *timestamp = header->timestamp;
+    return (const char *) (header + 1) + queue->read_offset;
+}
 
-    pthread_mutex_unlock(&queue->pop_lock);
+/**
+ * Consumes the first bytes of the first record, and the record itself once it is fully consumed.
+ *
+ * @note Must be called by the consumer after queue_first_span
+ * @param [in] queue a pointer to the queue
+ * @param [in] size the amount of bytes to consume
+ */
+static void queue_consume(queue_t *queue, const ssize_t size) {
+    const ssize_t start = atomic_load_explicit(&queue->start, memory_order_relaxed);
+    const queue_record_header_t *header = queue_consumer_record_at(queue, start);
+
+    queue->read_offset += size;
+    assert(queue->read_offset <= header->size);
+    if (queue->read_offset == header->size) {
+        queue->read_offset = 0;
+        atomic_store_explicit(&queue->consumed_items,
+                              atomic_load_explicit(&queue->consumed_items, memory_order_relaxed) + 1,
+                              memory_order_relaxed);
+        queue_store_start(queue, start + QUEUE_RECORD_SIZE(header->size), memory_order_release);
+    }
+}
+
+ssize_t queue_peek_size(queue_t *queue) {
+    if (queue == nullptr || !queue_is_allocated(queue))
+        return -1;
+
+    queue_consumer_enter(queue);
+
+    ssize_t size = -1;
+    queue_first_span(queue, &size, nullptr);
+
+    queue_consumer_leave(queue);
+
+    return size;
+}
+
+NODISCARD
+
+bool queue_pop(queue_t *queue, const ssize_t size, char *buffer, ssize_t *written) {
+    if (queue == nullptr || !queue_is_allocated(queue) || buffer == nullptr || written == nullptr || size == 0)
+        return false;
+
+    queue_consumer_enter(queue);
+
+    ssize_t remaining;
+    const char *span = queue_first_span(queue, &remaining, nullptr);
+    if (span == nullptr) {
+        queue_consumer_leave(queue);
+        return false;
+    }
+
+    const ssize_t pop_size = MIN(remaining, size);
+    memcpy(buffer, span, pop_size);
+    *written = pop_size == remaining ? pop_size : pop_size - remaining;
+    queue_consume(queue, pop_size);
+
+    queue_consumer_leave(queue);
 
     return true;
 }
 
-void queue_clear(queue_t *queue) {
+NODISCARD
+
+const char *queue_peek_span(queue_t *queue, ssize_t *size, int64_t *timestamp) {
+    if (queue == nullptr || !queue_is_allocated(queue) || size == nullptr)
+        return nullptr;
+
+    queue_consumer_enter(queue);
+
+    const char *span = queue_first_span(queue, size, timestamp);
+    if (span == nullptr)
+        queue_consumer_leave(queue);
+
+    return span;
+}
+
+/**
+ * Gathers the spans of the records from the given one up to the first record timestamped later than until.
+ *
+ * @note Must be called by the consumer
+ * @param [in] queue a pointer to the queue
+ * @param [in] segment the segment the first record is in
+ * @param [in] position the position of the first record
+ * @param [in] header the first record, or nullptr if there is none
+ * @param [in] offset how much of the first record's payload has already been popped
+ * @param [in] until the latest timestamp of the records to include
+ * @param [out] iov the spans, one per record
+ * @param [in] max_iov the maximum amount of spans
+ * @param [out] first_timestamp the timestamp of the first record included, may be nullptr
+ * @param [out] next_timestamp the timestamp of the first record left out, or -1 if there's none, may be nullptr
+ * @returns The amount of spans
+ */
+static size_t queue_gather_spans(queue_t *queue, const queue_segment_t *segment, ssize_t position,
+                                 const queue_record_header_t *header, ssize_t offset, const int64_t until,
+                                 struct iovec *iov, const size_t max_iov, int64_t *first_timestamp,
+                                 int64_t *next_timestamp) {
+    // Only the first record can be partially popped, the rest are taken whole
+    size_t count = 0;
+    if (first_timestamp != nullptr && header != nullptr)
+        *first_timestamp = header->timestamp;
+    while (header != nullptr && header->timestamp <= until && count < max_iov) {
+        iov[count].iov_base = (char *) (header + 1) + offset;
+        iov[count].iov_len = header->size - offset;
+        count++;
+
+        offset = 0;
+        position += QUEUE_RECORD_SIZE(header->size);
+        header = queue_next_record(queue, &segment, &position);
+    }
+
+    if (next_timestamp != nullptr)
+        *next_timestamp = header != nullptr ? header->timestamp : -1;
+
+    return count;
+}
+
+NODISCARD
+
+ssize_t queue_peek_spans(queue_t *queue, const int64_t until, struct iovec *iov, const size_t max_iov,
+                         int64_t *first_timestamp, int64_t *next_timestamp) {
+    if (queue == nullptr || !queue_is_allocated(queue) || iov == nullptr || max_iov == 0)
+        return -1;
+
+    queue_consumer_enter(queue);
+
+    ssize_t position = atomic_load_explicit(&queue->start, memory_order_relaxed);
+    const queue_record_header_t *header = queue_first_record(queue, &position);
+    // Hand the skipped padding back to the producer
+    queue_store_start(queue, position, memory_order_release);
+
+    const size_t count = queue_gather_spans(queue, queue->head_segment, position, header, queue->read_offset, until,
+                                            iov, max_iov, first_timestamp, next_timestamp);
+    if (count == 0)
+        queue_consumer_leave(queue);
+
+    return (ssize_t) count;
+}
+
+void queue_release(queue_t *queue, ssize_t size) {
     if (queue == nullptr)
         return;
 
-    pthread_mutex_lock(&queue->pop_lock);
-    pthread_mutex_lock(&queue->push_lock);
+    while (size > 0) {
+        ssize_t remaining;
+        if (queue_first_span(queue, &remaining, nullptr) == nullptr)
+            break;
 
-    queue->start = queue->end = 0;
+        const ssize_t consumed = MIN(remaining, size);
+        queue_consume(queue, consumed);
+        size -= consumed;
+    }
 
-    pthread_mutex_unlock(&queue->pop_lock);
-    pthread_mutex_unlock(&queue->push_lock);
+    queue_consumer_leave(queue);
+}
+
+/**
+ * Lapses the cursors that have fallen too far behind, then moves the start of the queue up to the slowest
+ * of the rest. The records in between are not looked into, the drained segments are handed back whole.
+ *
+ * @note Must be called by the consumer
+ * @param [in] queue a pointer to the queue
+ */
+static void queue_cursors_reclaim(queue_t *queue) {
+    // The lag is measured from the cursor furthest ahead, the delay window itself doesn't count
+    ssize_t leader = -1;
+    for (const queue_cursor_t *cursor = queue->cursors; cursor != nullptr; cursor = cursor->next) {
+        if (!cursor->lapsed)
+            leader = MAX(leader, cursor->position);
+    }
+
+    const queue_cursor_t *slowest = nullptr;
+    for (queue_cursor_t *cursor = queue->cursors; cursor != nullptr; cursor = cursor->next) {
+        if (cursor->lapsed)
+            continue;
+        if (cursor->max_lag > 0 && leader - cursor->position > cursor->max_lag) {
+            cursor->lapsed = true;
+            continue;
+        }
+        if (slowest == nullptr || cursor->position < slowest->position)
+            slowest = cursor;
+    }
+
+    // Nothing is reclaimed without a live cursor, the owners are going to detach the lapsed ones
+    if (slowest == nullptr || slowest->position <= atomic_load_explicit(&queue->start, memory_order_relaxed))
+        return;
+
+    // A cursor right at the end of a segment may still point to it, so only the segments that end before
+    // every cursor are handed back
+    if (queue->backing == QUEUE_BACKING_SEGMENTED) {
+        while (queue->head_segment->position + queue->head_segment->size < slowest->position) {
+            queue_segment_t *head = queue->head_segment;
+            queue->head_segment = atomic_load_explicit(&head->next, memory_order_acquire);
+            queue_segment_put(queue, head);
+        }
+    }
+
+    queue->read_offset = 0;
+    atomic_store_explicit(&queue->consumed_items, slowest->sequence, memory_order_relaxed);
+    queue_store_start(queue, slowest->position, memory_order_release);
+}
+
+bool queue_cursor_attach(queue_t *queue, queue_cursor_t *cursor, const ssize_t max_lag) {
+    if (queue == nullptr || !queue_is_allocated(queue) || cursor == nullptr || max_lag < 0)
+        return false;
+
+    queue_consumer_enter(queue);
+
+    cursor->position = atomic_load_explicit(&queue->start, memory_order_relaxed);
+    cursor->segment = queue->head_segment;
+    cursor->read_offset = queue->read_offset;
+    cursor->sequence = atomic_load_explicit(&queue->consumed_items, memory_order_relaxed);
+    cursor->max_lag = max_lag;
+    cursor->lapsed = false;
+    cursor->next = queue->cursors;
+    queue->cursors = cursor;
+
+    queue_consumer_leave(queue);
+    return true;
+}
+
+void queue_cursor_detach(queue_t *queue, queue_cursor_t *cursor) {
+    if (queue == nullptr || cursor == nullptr)
+        return;
+
+    queue_consumer_enter(queue);
+
+    for (queue_cursor_t **link = &queue->cursors; *link != nullptr; link = &(*link)->next) {
+        if (*link == cursor) {
+            *link = cursor->next;
+            break;
+        }
+    }
+    cursor->next = nullptr;
+    queue_cursors_reclaim(queue);
+
+    queue_consumer_leave(queue);
+}
+
+NODISCARD
+
+ssize_t queue_cursor_peek_spans(queue_t *queue, queue_cursor_t *cursor, const int64_t until, struct iovec *iov,
+                                const size_t max_iov, int64_t *first_timestamp, int64_t *next_timestamp) {
+    if (queue == nullptr || !queue_is_allocated(queue) || cursor == nullptr || iov == nullptr || max_iov == 0)
+        return -1;
+
+    queue_consumer_enter(queue);
+
+    if (cursor->lapsed) {
+        queue_consumer_leave(queue);
+        return -1;
+    }
+
+    // The cursor is moved past the padding and on to the next segment, it's still at the same record
+    const queue_record_header_t *header = queue_next_record(queue, &cursor->segment, &cursor->position);
+    const size_t count = queue_gather_spans(queue, cursor->segment, cursor->position, header, cursor->read_offset,
+                                            until, iov, max_iov, first_timestamp, next_timestamp);
+    if (count == 0)
+        queue_consumer_leave(queue);
+
+    return (ssize_t) count;
+}
+
+void queue_cursor_release(queue_t *queue, queue_cursor_t *cursor, ssize_t size) {
+    if (queue == nullptr || cursor == nullptr)
+        return;
+
+    while (size > 0) {
+        const queue_record_header_t *header = queue_next_record(queue, &cursor->segment, &cursor->position);
+        if (header == nullptr)
+            break;
+
+        const ssize_t consumed = MIN(header->size - cursor->read_offset, size);
+        cursor->read_offset += consumed;
+        size -= consumed;
+        if (cursor->read_offset == header->size) {
+            cursor->read_offset = 0;
+            cursor->position += QUEUE_RECORD_SIZE(header->size);
+            cursor->sequence++;
+        }
+    }
+
+    queue_cursors_reclaim(queue);
+
+    queue_consumer_leave(queue);
+}
+
+bool queue_cursor_skip_to(queue_t *queue, queue_cursor_t *cursor, const queue_mark_t *mark, const ssize_t offset) {
+    if (queue == nullptr || cursor == nullptr || mark == nullptr || mark->position < 0)
+        return false;
+
+    queue_consumer_enter(queue);
+
+    const ssize_t end = atomic_load_explicit(&queue->end, memory_order_acquire);
+    if (cursor->lapsed || mark->position < cursor->position || mark->position >= end
+        || (mark->position == cursor->position && offset < cursor->read_offset)) {
+        queue_consumer_leave(queue);
+        return false;
+    }
+
+    // Whatever is in between stays queued for the other cursors
+    cursor->position = mark->position;
+    cursor->segment = mark->segment;
+    cursor->read_offset = offset;
+    cursor->sequence = mark->sequence;
+    queue_cursors_reclaim(queue);
+
+    queue_consumer_leave(queue);
+    return true;
+}
+
+/**
+ * Gets the segment a spill cursor points to, or the first one after the head segment if the cursor
+ * has fallen behind the consumer.
+ *
+ * @note Must be called by the consumer
+ * @param [in] queue a pointer to the queue
+ * @param [in] segment the segment the cursor points to
+ * @param [in] position the position the segment had when the cursor was set
+ * @returns A pointer to the segment, or nullptr if the head segment is the only one
+ */
+static queue_segment_t *queue_spill_cursor(const queue_t *queue, queue_segment_t *segment, const ssize_t position) {
+    // A segment that is still queued is past the head one, a recycled one was at or before it
+    if (segment != nullptr && position > queue->head_segment->position)
+        return segment;
+
+    return atomic_load_explicit(&queue->head_segment->next, memory_order_acquire);
+}
+
+void queue_spill(queue_t *queue, const int64_t prefetch_until) {
+    if (queue == nullptr || queue->spill_map == nullptr)
+        return;
+
+    queue_consumer_enter(queue);
+
+    // Have the kernel read the segments that become due soon back ahead of time
+    queue_segment_t *segment = queue_spill_cursor(queue, queue->spill_front, queue->spill_front_position);
+    if (segment == nullptr) {
+        queue_consumer_leave(queue);
+        return;
+    }
+
+    queue_segment_t *next;
+    while (segment->first_timestamp <= prefetch_until
+           && (next = atomic_load_explicit(&segment->next, memory_order_acquire)) != nullptr) {
+        if (segment->spilled) {
+            (void) posix_fadvise(queue->spill_fd, segment->data - queue->spill_map, segment->size,
+                                 POSIX_FADV_WILLNEED);
+            segment->spilled = false;
+            queue->spilled_bytes -= segment->size;
+        }
+        segment = next;
+    }
+    queue->spill_front = segment;
+    queue->spill_front_position = segment->position;
+
+    // Spill the oldest segments past the read-ahead window, the tail one is still being written
+    if (queue->spill_back == nullptr || queue->spill_back_position < segment->position) {
+        queue->spill_back = segment;
+        queue->spill_back_position = segment->position;
+    }
+    segment = queue->spill_back;
+
+    ssize_t resident = atomic_load_explicit(&queue->end, memory_order_acquire)
+                       - atomic_load_explicit(&queue->start, memory_order_relaxed) - queue->spilled_bytes;
+    while (resident > queue->spill_threshold
+           && (next = atomic_load_explicit(&segment->next, memory_order_acquire)) != nullptr) {
+        if (!segment->spilled && queue_segment_is_spillable(queue, segment)) {
+            const off_t offset = segment->data - queue->spill_map;
+            // Unmapped pages keep their contents in the page cache, from where they are written out
+            // and dropped. The pages still being written when the advice comes are left to the kernel to reclaim.
+            (void) madvise(segment->data, segment->size, MADV_DONTNEED);
+            (void) sync_file_range(queue->spill_fd, offset, segment->size, SYNC_FILE_RANGE_WRITE);
+            (void) posix_fadvise(queue->spill_fd, offset, segment->size, POSIX_FADV_DONTNEED);
+            segment->spilled = true;
+            queue->spilled_bytes += segment->size;
+            resident -= segment->size;
+        }
+        segment = next;
+    }
+    queue->spill_back = segment;
+    queue->spill_back_position = segment->position;
+
+    queue_consumer_leave(queue);
+}
+
+uint64_t queue_clear(queue_t *queue) {
+    if (queue == nullptr)
+        return 0;
+
+    queue_relayout_begin(queue, false);
+
+    // The positions keep growing, the queue just starts over from where it ended
+    const ssize_t end = atomic_load_explicit(&queue->end, memory_order_relaxed);
+    while (queue->head_segment != queue->tail_segment) {
+        queue_segment_t *head = queue->head_segment;
+        queue->head_segment = atomic_load_explicit(&head->next, memory_order_relaxed);
+        queue_segment_put(queue, head);
+    }
+
+    const uint64_t committed = atomic_load_explicit(&queue->committed_items, memory_order_relaxed);
+    const uint64_t cleared = committed - atomic_load_explicit(&queue->consumed_items, memory_order_relaxed);
+    atomic_store_explicit(&queue->consumed_items, committed, memory_order_relaxed);
+    queue_store_start(queue, end, memory_order_relaxed);
+    queue_store_origin(queue, end);
+    queue->start_cache = queue->end_cache = end;
+    queue->read_offset = 0;
+    queue->spill_front = queue->spill_back = nullptr;
+    queue_cursors_follow(queue);
+
+    queue_relayout_end(queue, false);
+    return cleared;
 }
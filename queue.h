@@ -8,6 +8,9 @@
 #include <pthread.h>
 #include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 #include "c23_compat.h"
 
@@ -15,45 +18,427 @@
 #define QUEUE_SIZE_ALIGN(s, t) ((s + sizeof(t) - 1) & ~(sizeof(t) - 1))
 
 typedef enum {
+    /**
+     * Drop the incoming item
+     */
     QUEUE_OVERFLOW_SKIP = 0,
+    /**
+     * Grow the buffer, up to the maximal capacity if there is one
+     */
     QUEUE_OVERFLOW_RESIZE = 1,
+    /**
+     * Drop the oldest items until the incoming one fits
+     */
     QUEUE_OVERFLOW_LOOP_REPLACE = 2
 } queue_overflow_behavior_t;
 
-__attribute__((aligned(sizeof(ssize_t))))
+typedef enum {
+    /**
+     * Any number of producers and consumers, each side is serialized with its own mutex
+     */
+    QUEUE_CONCURRENCY_LOCKED = 0,
+    /**
+     * Exactly one producer thread and one consumer thread, no mutex on the hot path
+     */
+    QUEUE_CONCURRENCY_SPSC = 1
+} queue_concurrency_t;
+
+typedef enum {
+    /**
+     * The buffer is allocated on the heap, records that don't fit until its end start over from its beginning
+     */
+    QUEUE_BACKING_HEAP = 0,
+    /**
+     * The buffer is mapped twice back-to-back, so every record is contiguous regardless of its position.
+     * The capacity is rounded up to the page size.
+     */
+    QUEUE_BACKING_MIRRORED = 1,
+    /**
+     * The buffer is a chain of fixed-size segments, the queue grows by linking new segments and never moves
+     * the queued items. The capacity is only a limit for the total size of the queued items.
+     */
+    QUEUE_BACKING_SEGMENTED = 2,
+    /**
+     * The buffer is a file mapped into memory along with the positions of the queue, so that the queued items
+     * outlive the process and a queue opened on the same file later picks them up. Laid out as the heap otherwise.
+     */
+    QUEUE_BACKING_FILE = 3
+} queue_backing_t;
+
+#define QUEUE_DEFAULT_SEGMENT_SIZE (64 * 1024)
+/**
+ * How large the spill file may grow by default, the address space for it is reserved up front
+ */
+#define QUEUE_DEFAULT_SPILL_FILE_SIZE (4LL * 1024 * 1024 * 1024)
+
+#define QUEUE_CACHE_LINE_SIZE (64)
+
+/**
+ * Back the buffer and the segments with huge pages: explicit ones if the system has reserved them,
+ * transparent ones otherwise. The capacity of a heap or mirrored buffer and the segment size
+ * are rounded up to QUEUE_HUGE_PAGE_SIZE.
+ */
+#define QUEUE_MEMORY_HUGE_PAGES (1u << 0)
+/**
+ * Fault the memory in as it's allocated instead of on the producer's first pass through it.
+ * A segmented queue allocates its segments up to the initial capacity right away.
+ */
+#define QUEUE_MEMORY_PREFAULT (1u << 1)
+/**
+ * Lock the memory so that it's never swapped out, which faults it in as well.
+ * It counts against RLIMIT_MEMLOCK, the allocations over the limit fail.
+ */
+#define QUEUE_MEMORY_LOCK (1u << 2)
+/**
+ * Prefer the NUMA node of the thread that allocates the memory, which is the producer for everything
+ * allocated after queue_init
+ */
+#define QUEUE_MEMORY_LOCAL (1u << 3)
+
+#define QUEUE_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/**
+ * Every record in the queue buffer starts with this header and is followed by exactly size bytes of payload,
+ * the whole record is then padded up to the header's alignment.
+ */
 typedef struct {
+    /**
+     * The size of the payload in bytes
+     */
+    uint32_t size;
+    uint32_t flags;
+    /**
+     * When the item was received, in nanoseconds of CLOCK_MONOTONIC
+     */
+    int64_t timestamp;
+} queue_record_header_t;
+
+/**
+ * The record only fills the space up to the end of the buffer and has to be skipped
+ */
+#define QUEUE_RECORD_PADDING (1u << 0)
+
+#define QUEUE_RECORD_SIZE(payload_size) \
+    ((ssize_t)QUEUE_SIZE_ALIGN(sizeof(queue_record_header_t) + (payload_size), queue_record_header_t))
+
+typedef struct queue_segment {
+    /**
+     * The next segment in the chain or in the list of free segments
+     */
+    struct queue_segment *_Atomic next;
+    /**
+     * The position of the segment's first byte in the queue
+     */
+    ssize_t position;
+    /**
+     * The size of the segment's data in bytes
+     */
     ssize_t size;
-    ssize_t offset;
-    bool continued;
-} queue_item_header_t;
+    /**
+     * The segment's data, right after the segment itself or in the spill file
+     */
+    char *data;
+    /**
+     * The timestamp of the first record that starts in the segment, set before the segment is linked
+     */
+    int64_t first_timestamp;
+    /**
+     * Set while the segment's data is left to the spill file, owned by the consumer
+     */
+    bool spilled;
+    /**
+     * Set if the segment's data is mapped on its own according to the memory flags
+     */
+    bool mapped;
+} queue_segment_t;
 
-#define QUEUE_ITEM_SIZE (2048)
-#define QUEUE_ITEM_BUFFER_SIZE (QUEUE_ITEM_SIZE - (ssize_t)sizeof(queue_item_header_t))
+/**
+ * Where a record is in the queue, taken by the producer with queue_reserved_mark
+ */
+typedef struct {
+    /**
+     * The position of the record, negative if the record is not in the queue
+     */
+    ssize_t position;
+    /**
+     * The segment the record is in, nullptr unless the queue is segmented
+     */
+    queue_segment_t *segment;
+    /**
+     * How many records were committed before the record
+     */
+    uint64_t sequence;
+} queue_mark_t;
+
+typedef struct {
+    ssize_t initial_capacity;
+    queue_overflow_behavior_t overflow_behavior;
+    queue_concurrency_t concurrency;
+    queue_backing_t backing;
+    /**
+     * The limit for QUEUE_OVERFLOW_RESIZE in bytes, 0 for none
+     */
+    ssize_t max_capacity;
+    /**
+     * The capacity in bytes the buffer is shrunk back toward after having grown, 0 to never shrink automatically
+     */
+    ssize_t shrink_target;
+    /**
+     * The occupancy in percents of the capacity below which the buffer is considered oversized,
+     * has to be below 50 so that a halved buffer is not full right away
+     */
+    int shrink_low_water_percent;
+    /**
+     * How long the occupancy has to stay below the low-water mark before each shrinking step, in milliseconds
+     */
+    int64_t shrink_period_ms;
+    /**
+     * The size of a segment for QUEUE_BACKING_SEGMENTED in bytes, 0 for QUEUE_DEFAULT_SEGMENT_SIZE.
+     * Items larger than a segment get a segment of their own.
+     */
+    ssize_t segment_size;
+    /**
+     * The directory to create the spill file of QUEUE_BACKING_SEGMENTED in, nullptr for none.
+     * With a spill file the segments live in its mapping, and queue_spill leaves the older ones to the disk.
+     */
+    const char *spill_directory;
+    /**
+     * How many bytes of queued items may stay in RAM before queue_spill leaves the older segments to the disk
+     */
+    ssize_t spill_threshold;
+    /**
+     * The largest size of the spill file in bytes, 0 for QUEUE_DEFAULT_SPILL_FILE_SIZE.
+     * The segments that don't fit into it stay in RAM.
+     */
+    ssize_t spill_file_size;
+    /**
+     * QUEUE_MEMORY_* flags for the buffer and the segments, 0 for plain heap memory.
+     * They don't apply to the segments in the spill file.
+     */
+    uint32_t memory_flags;
+    /**
+     * The file of QUEUE_BACKING_FILE, must stay valid as long as the queue. The items an earlier queue has left
+     * in it are picked up, along with its capacity, as long as they were queued since the last boot:
+     * their timestamps are of CLOCK_MONOTONIC. Otherwise the file is started anew.
+     */
+    const char *file_path;
+} queue_config_t;
 
 typedef struct {
-    queue_item_header_t header;
-    char buffer[QUEUE_ITEM_BUFFER_SIZE];
-} queue_item_t;
+    /**
+     * Items dropped according to the overflow behavior, either incoming or evicted ones
+     */
+    uint64_t dropped_items;
+    uint64_t dropped_bytes;
+    /**
+     * Times the buffer was grown according to the overflow behavior
+     */
+    uint64_t resizes;
+    /**
+     * Times the buffer was shrunk back toward the shrink target
+     */
+    uint64_t shrinks;
+    /**
+     * The occupancy: the queued records, the bytes they take in the buffer including their headers and padding,
+     * and the buffer's capacity. Only exact when read by the consumer.
+     */
+    uint64_t queued_items;
+    uint64_t used_bytes;
+    uint64_t capacity;
+} queue_stats_t;
+
+/**
+ * The read cursor of one of the consumers sharing a queue, attached with queue_cursor_attach.
+ * Every consumer reads the whole queue on its own, a record is only gone once all of them are past it.
+ */
+typedef struct queue_cursor {
+    /**
+     * The next cursor of the queue
+     */
+    struct queue_cursor *next;
+    /**
+     * The position of the record the cursor is at, which may also be padding or the end of the queue,
+     * and the segment it's in
+     */
+    ssize_t position;
+    const queue_segment_t *segment;
+    /**
+     * How much of the record's payload has already been released through the cursor
+     */
+    ssize_t read_offset;
+    /**
+     * How many records the cursor is past, the queue counts the records the slowest cursor is past as consumed
+     */
+    uint64_t sequence;
+    /**
+     * How far in bytes the cursor may fall behind the cursor furthest ahead, 0 for no limit
+     */
+    ssize_t max_lag;
+    /**
+     * Set once the cursor has fallen further behind than max_lag. It holds nothing back from then on,
+     * and can only be detached.
+     */
+    bool lapsed;
+} queue_cursor_t;
+
+#define QUEUE_RESERVED_SKIPPED (-2)
 
 typedef struct {
     queue_overflow_behavior_t overflow_behavior;
+    queue_concurrency_t concurrency;
+    queue_backing_t backing;
+    ssize_t max_capacity;
+    ssize_t shrink_target;
+    int shrink_low_water_percent;
+    int64_t shrink_period_ms;
+    ssize_t segment_size;
+    uint32_t memory_flags;
 
     pthread_mutex_t pop_lock;
     pthread_mutex_t push_lock;
 
     /**
-     * The start of the queue in chunks
+     * The size of the queue buffer in bytes
      */
-    _Atomic ssize_t start;
+    _Atomic ssize_t capacity;
+    /**
+     * The position that maps to the first byte of the buffer
+     */
+    ssize_t origin;
+    char *buffer;
     /**
-     * The end of the queue in chunks
+     * Drained segments ready to be reused, pushed by the consumer and popped by the producer
      */
+    queue_segment_t *_Atomic free_segments;
+    _Atomic ssize_t free_segment_count;
+    /**
+     * Set while the buffer is being resized, makes the SPSC consumer fall back to pop_lock
+     */
+    atomic_bool relayout;
+    /**
+     * Whether the SPSC relayout makes the consumer's thread fence with membarrier(), so that the consumer gets by
+     * with a compiler barrier. Otherwise both sides fence on their own.
+     */
+    bool membarrier;
+    /**
+     * The unlinked spill file and its mapping, -1 and nullptr if there is none
+     */
+    int spill_fd;
+    char *spill_map;
+    ssize_t spill_map_size;
+    ssize_t spill_threshold;
+    /**
+     * How much of the spill file has been handed out to segments, grown by the producer
+     */
+    ssize_t spill_file_size;
+    /**
+     * The positions kept in the file of QUEUE_BACKING_FILE, nullptr for the other backings
+     */
+    struct queue_file_header *file_header;
+    const char *file_path;
+
+    /**
+     * The end of the queue in bytes, written by the producer only
+     *
+     * Both start and end only ever grow, the position of a byte in the buffer is (position - origin) % capacity.
+     */
+    __attribute__((aligned(QUEUE_CACHE_LINE_SIZE)))
     _Atomic ssize_t end;
     /**
-     * The size of the queue in chunks
+     * The producer's last seen value of start
+     */
+    ssize_t start_cache;
+    /**
+     * How many records have been committed, written by the producer only
+     */
+    _Atomic uint64_t committed_items;
+    /**
+     * The segment the producer writes to
      */
-    _Atomic ssize_t size;
-    queue_item_t *buffer;
+    queue_segment_t *tail_segment;
+    /**
+     * The position of the record handed out by queue_reserve, -1 or QUEUE_RESERVED_SKIPPED
+     */
+    ssize_t reserved;
+    queue_record_header_t *reserved_header;
+    /**
+     * The segment the reserved record starts, linked to the chain once the record is committed
+     */
+    queue_segment_t *reserved_segment;
+    /**
+     * The payload size requested by queue_reserve
+     */
+    ssize_t reserved_size;
+    /**
+     * Where the items that are going to be dropped are received to
+     */
+    char *skip_buffer;
+    ssize_t skip_buffer_size;
+    _Atomic uint64_t dropped_items;
+    _Atomic uint64_t dropped_bytes;
+    _Atomic uint64_t resizes;
+    _Atomic uint64_t shrinks;
+    /**
+     * When the occupancy has dropped below the shrink low-water mark in milliseconds, or 0
+     */
+    int64_t low_water_since;
+
+    /**
+     * The start of the queue in bytes, written by the consumer only
+     */
+    __attribute__((aligned(QUEUE_CACHE_LINE_SIZE)))
+    _Atomic ssize_t start;
+    /**
+     * The consumer's last seen value of end
+     */
+    ssize_t end_cache;
+    /**
+     * The segment the consumer reads from
+     */
+    queue_segment_t *head_segment;
+    /**
+     * How much of the first record's payload has already been popped
+     */
+    ssize_t read_offset;
+    /**
+     * How many records have been consumed, skipped or evicted, written by the consumer or under a relayout
+     */
+    _Atomic uint64_t consumed_items;
+    /**
+     * The cursors of the consumers sharing the queue. While there are any, the queue is read only through them,
+     * and the start follows the slowest one.
+     */
+    queue_cursor_t *cursors;
+    /**
+     * Set while the SPSC consumer is touching the buffer
+     */
+    atomic_bool consumer_busy;
+    /**
+     * The bytes of the segments left to the spill file
+     */
+    ssize_t spilled_bytes;
+    /**
+     * The first segment past the read-ahead window, and the first one that hasn't been spilled after it.
+     * Only the segments in between are spilled. The positions tell whether the segments are still queued.
+     */
+    queue_segment_t *spill_front;
+    ssize_t spill_front_position;
+    queue_segment_t *spill_back;
+    ssize_t spill_back_position;
+
+    /**
+     * Bumped to wake up the consumer blocked in queue_wait_nonempty, used as a futex
+     */
+    __attribute__((aligned(QUEUE_CACHE_LINE_SIZE)))
+    _Atomic uint32_t wake_sequence;
+    /**
+     * Set while the consumer is blocked in queue_wait_nonempty
+     */
+    atomic_bool consumer_waiting;
+    /**
+     * Set by queue_wake so that the wake-up isn't lost if the consumer is not blocked yet
+     */
+    atomic_bool wake_pending;
 } queue_t;
 
 /**
@@ -66,6 +451,15 @@ typedef struct {
  */
 bool queue_init(queue_t *queue, ssize_t initial_capacity, queue_overflow_behavior_t overflow_behavior);
 
+/**
+ * Initialize the queue structure with the given configuration and allocate a queue buffer.
+ *
+ * @param [in] queue a pointer to the queue structure
+ * @param [in] config a pointer to the queue configuration
+ * @returns true if succeeded, false if failed
+ */
+bool queue_init_config(queue_t *queue, const queue_config_t *config);
+
 /**
  * Wait for the threads to finish and deallocate the queue buffer.
  *
@@ -82,9 +476,28 @@ void queue_destroy(queue_t *queue);
  */
 bool queue_is_empty(const queue_t *queue);
 
+/**
+ * Block until the queue contains an element or the deadline passes.
+ *
+ * @note The producer only makes a system call to wake the consumer up if the consumer is actually blocked.
+ * @param [in] queue a pointer to the queue
+ * @param [in] deadline the absolute deadline in nanoseconds of CLOCK_MONOTONIC, negative to wait indefinitely
+ * @returns true if the queue is not empty, false if the deadline has passed or queue_wake was called
+ */
+bool queue_wait_nonempty(queue_t *queue, int64_t deadline);
+
+/**
+ * Wake up the consumer blocked in queue_wait_nonempty, even if the queue is still empty.
+ * If the consumer is not blocked, its next queue_wait_nonempty returns immediately.
+ *
+ * @param [in] queue a pointer to the queue
+ */
+void queue_wake(queue_t *queue);
+
 /**
  * Get the space available in the queue.
  *
+ * @note Every record also takes QUEUE_RECORD_SIZE(0) bytes of the buffer for its header and alignment.
  * @param [in] queue a pointer to the queue
  * @returns Amount of free space in the queue in bytes
  */
@@ -101,9 +514,10 @@ ssize_t queue_size(const queue_t *queue);
 /**
  * Extend or shrink the queue buffer while keeping the queue items in tact.
  *
+ * @note In the SPSC mode this function must be called from the producer thread.
  * @param [in] queue a pointer to the queue
  * @param [in] new_capacity the new capacity of the queue buffer in bytes
- * @returns true if succeeded, false if failed
+ * @returns true if succeeded, false if failed or the items don't fit into the new capacity
  */
 bool queue_resize(queue_t *queue, ssize_t new_capacity);
 
@@ -113,15 +527,85 @@ bool queue_resize(queue_t *queue, ssize_t new_capacity);
  * @param [in] queue a pointer to the queue
  * @param [in] size the source buffer's size in bytes
  * @param [in] buffer the source buffer
- * @returns true if succeeded, false if failed
+ * @param [in] timestamp when the item was received, in nanoseconds of CLOCK_MONOTONIC
+ * @returns true if succeeded or the item was dropped according to the overflow behavior, false if failed
+ */
+NODISCARD bool queue_push(queue_t *queue, ssize_t size, const char *buffer, int64_t timestamp);
+
+/**
+ * Reserves a contiguous span for a new item at the end of the queue, so that the data can be written straight
+ * into the queue buffer. The item becomes visible to the consumer only after queue_commit.
+ *
+ * @note Every successful call must be followed by queue_commit. In the locked mode push_lock is held in between.
+ * @param [in] queue a pointer to the queue
+ * @param [in] max_size the maximal size of the item in bytes
+ * @returns A pointer to the span of max_size bytes, or nullptr if failed. If the item is going to be dropped
+ * according to the overflow behavior, the span is a scratch buffer outside of the queue.
+ */
+NODISCARD char *queue_reserve(queue_t *queue, ssize_t max_size);
+
+/**
+ * Adds the item reserved by queue_reserve to the end of the queue.
+ *
+ * @param [in] queue a pointer to the queue
+ * @param [in] size the actual size of the item in bytes, 0 to cancel the reservation
+ * @param [in] timestamp when the item was received, in nanoseconds of CLOCK_MONOTONIC
+ * @returns true if succeeded, false if failed (the reservation is cancelled in that case)
+ */
+bool queue_commit(queue_t *queue, ssize_t size, int64_t timestamp);
+
+/**
+ * Gets the mark of the record reserved by queue_reserve, for queue_skip_to.
+ *
+ * @note Must be called by the producer in between queue_reserve and queue_commit
+ * @param [in] queue a pointer to the queue
+ * @returns The mark, its position is negative if the record is going to be dropped
+ */
+queue_mark_t queue_reserved_mark(const queue_t *queue);
+
+/**
+ * Drops everything in front of the given byte of a queued record, by moving the start of the queue there
+ * rather than going through the records in between.
+ *
+ * @note Must be called by the consumer, not in between a peek and queue_release
+ * @param [in] queue a pointer to the queue
+ * @param [in] mark the record's mark
+ * @param [in] offset the offset of the byte in the record's payload
+ * @returns true if succeeded, false if the record is not in the queue anymore or the byte is already gone
+ */
+bool queue_skip_to(queue_t *queue, const queue_mark_t *mark, ssize_t offset);
+
+/**
+ * Gets the counters of the overflow handling and the occupancy.
+ *
+ * @param [in] queue a pointer to the queue
+ * @param [out] stats the counters
+ */
+void queue_get_stats(const queue_t *queue, queue_stats_t *stats);
+
+/**
+ * Keeps a value of the queue's owner in the file of QUEUE_BACKING_FILE, for whoever picks the items up later.
+ *
+ * @note Must be called by the producer
+ * @param [in] queue a pointer to the queue
+ * @param [in] tag the value, it's 0 in a new file
+ * @returns true if succeeded, false if the queue has no file
  */
-NODISCARD bool queue_push(queue_t *queue, ssize_t size, const char *buffer);
+bool queue_set_file_tag(queue_t *queue, uint64_t tag);
+
+/**
+ * Gets the value kept in the file of QUEUE_BACKING_FILE, by this queue or by the earlier one that left the items.
+ *
+ * @param [in] queue a pointer to the queue
+ * @returns The value, 0 if it was never set or the queue has no file
+ */
+uint64_t queue_file_tag(const queue_t *queue);
 
 /**
  * Gets the size of the first element in the queue.
  *
  * @param [in] queue a pointer to the queue
- * @returns A negative number if the queue is empty, or the first item's size.
+ * @returns A negative number if the queue is empty, or the size of the first item's part that hasn't been popped yet.
  */
 ssize_t queue_peek_size(queue_t *queue);
 
@@ -133,16 +617,129 @@ ssize_t queue_peek_size(queue_t *queue);
  * @param [out] buffer the target buffer
  * @param [out] written A positive number or zero that indicates the amount of written bytes,
  * or a negative number that indicates the amount of bytes that haven't been written
- * if the buffer is smaller than the data
+ * if the buffer is smaller than the data. In the latter case the rest of the item stays in the queue
+ * and is returned by the next call.
  * @returns true if succeeded, false if failed
  */
 NODISCARD bool queue_pop(queue_t *queue, ssize_t size, char *buffer, ssize_t *written);
 
+/**
+ * Gets the part of the first queue item that hasn't been popped yet, without copying it out of the queue buffer.
+ *
+ * @note Every successful call must be followed by queue_release. In the locked mode pop_lock is held in between,
+ * in the SPSC mode the buffer can't be resized in between.
+ * @param [in] queue a pointer to the queue
+ * @param [out] size the size of the span in bytes
+ * @param [out] timestamp the item's timestamp, may be nullptr
+ * @returns A pointer to the span, or nullptr if the queue is empty
+ */
+NODISCARD const char *queue_peek_span(queue_t *queue, ssize_t *size, int64_t *timestamp);
+
+/**
+ * Gets the parts of the first queue items that haven't been popped yet, up to the first item timestamped later
+ * than the given time, without copying them out of the queue buffer. The spans can be passed to writev as is.
+ *
+ * @note Every call returning a positive number must be followed by queue_release, as with queue_peek_span.
+ * @param [in] queue a pointer to the queue
+ * @param [in] until the latest timestamp of the items to include
+ * @param [out] iov the spans, one per item
+ * @param [in] max_iov the maximum amount of spans
+ * @param [out] first_timestamp the timestamp of the first item included, may be nullptr
+ * @param [out] next_timestamp the timestamp of the first item left out, or -1 if there's none, may be nullptr
+ * @returns The amount of spans, or -1 if failed
+ */
+NODISCARD ssize_t queue_peek_spans(queue_t *queue, int64_t until, struct iovec *iov, size_t max_iov,
+                                   int64_t *first_timestamp, int64_t *next_timestamp);
+
+/**
+ * Removes the first bytes of the spans returned by queue_peek_span or queue_peek_spans, and the items themselves
+ * once they are fully consumed.
+ *
+ * @param [in] queue a pointer to the queue
+ * @param [in] size the amount of bytes to remove, 0 to keep the items as they are
+ */
+void queue_release(queue_t *queue, ssize_t size);
+
+/**
+ * Adds a consumer to the queue, reading it independently of the others from the start of the queue.
+ * From now on the queue must be read only through its cursors.
+ *
+ * @note Must be called by the consumer. In the SPSC mode all the cursors are moved by the consumer thread,
+ * in the locked mode each cursor may be moved by a thread of its own.
+ * @param [in] queue a pointer to the queue
+ * @param [out] cursor the cursor, must stay where it is until it's detached
+ * @param [in] max_lag how far in bytes the cursor may fall behind the cursor furthest ahead, 0 for no limit
+ * @returns true if succeeded, false if failed
+ */
+bool queue_cursor_attach(queue_t *queue, queue_cursor_t *cursor, ssize_t max_lag);
+
+/**
+ * Removes a consumer from the queue, the records only it was holding back are gone.
+ *
+ * @note Must be called by the consumer, not in between a peek and queue_cursor_release
+ * @param [in] queue a pointer to the queue
+ * @param [in] cursor the cursor
+ */
+void queue_cursor_detach(queue_t *queue, queue_cursor_t *cursor);
+
+/**
+ * Gets the spans of the items at the cursor up to the first item timestamped later than the given time,
+ * as queue_peek_spans does for the start of the queue.
+ *
+ * @note Every call returning a positive number must be followed by queue_cursor_release
+ * @param [in] queue a pointer to the queue
+ * @param [in] cursor the cursor
+ * @param [in] until the latest timestamp of the items to include
+ * @param [out] iov the spans, one per item
+ * @param [in] max_iov the maximum amount of spans
+ * @param [out] first_timestamp the timestamp of the first item included, may be nullptr
+ * @param [out] next_timestamp the timestamp of the first item left out, or -1 if there's none, may be nullptr
+ * @returns The amount of spans, or -1 if failed or the cursor has lapsed
+ */
+NODISCARD ssize_t queue_cursor_peek_spans(queue_t *queue, queue_cursor_t *cursor, int64_t until, struct iovec *iov,
+                                          size_t max_iov, int64_t *first_timestamp, int64_t *next_timestamp);
+
+/**
+ * Moves the cursor past the first bytes of the spans returned by queue_cursor_peek_spans, and gives the records
+ * every cursor is past back to the producer. A cursor that has fallen too far behind lapses meanwhile.
+ *
+ * @param [in] queue a pointer to the queue
+ * @param [in] cursor the cursor
+ * @param [in] size the amount of bytes to move past, 0 to stay where it is
+ */
+void queue_cursor_release(queue_t *queue, queue_cursor_t *cursor, ssize_t size);
+
+/**
+ * Moves the cursor forward to the given byte of a queued record, as queue_skip_to does for the start of the queue.
+ *
+ * @note Must be called by the consumer, not in between a peek and queue_cursor_release
+ * @param [in] queue a pointer to the queue
+ * @param [in] cursor the cursor
+ * @param [in] mark the record's mark
+ * @param [in] offset the offset of the byte in the record's payload
+ * @returns true if succeeded, false if the cursor has lapsed, the record is not in the queue anymore
+ * or the cursor is past the byte
+ */
+bool queue_cursor_skip_to(queue_t *queue, queue_cursor_t *cursor, const queue_mark_t *mark, ssize_t offset);
+
+/**
+ * Leaves the older segments of the queue to the spill file while the items kept in RAM exceed the spill threshold,
+ * and has the kernel read back the segments that are going to be needed soon. The head and tail segments always
+ * stay in RAM. Does nothing if the queue has no spill file.
+ *
+ * @note Must be called by the consumer, not in between a peek and queue_release
+ * @param [in] queue a pointer to the queue
+ * @param [in] prefetch_until the segments whose first item is timestamped no later than this are read back
+ */
+void queue_spill(queue_t *queue, int64_t prefetch_until);
+
 /**
  * Removes all the items from the queue
  *
+ * @note In the SPSC mode this function must be called from the producer thread.
  * @param [in] queue a pointer to the queue
+ * @returns How many items were removed, they aren't counted as dropped
  */
-void queue_clear(queue_t *queue);
+uint64_t queue_clear(queue_t *queue);
 
 #endif //EMERGENCY_DELAY_QUEUE_H
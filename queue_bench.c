@@ -0,0 +1,600 @@
+//
+// Throughput and latency of queue_push and queue_pop or the cursor release, one JSON object per line for each case
+//
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "queue.h"
+#include "session.h"
+#include "edelay_time.h"
+#include "c23_compat.h"
+
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+#define MAX(x, y) (((x) > (y)) ? (x) : (y))
+#define COUNT_OF(a) (sizeof(a) / sizeof((a)[0]))
+
+#define BENCH_DEFAULT_OPS 200000
+/**
+ * How many records fit into the buffer of the steady and wrapping cases
+ */
+#define BENCH_CAPACITY_RECORDS 64
+#define BENCH_MIN_CAPACITY (256 * 1024)
+/**
+ * The buffer the resizing cases start with, and how much they queue before draining it
+ */
+#define BENCH_RESIZE_INITIAL_CAPACITY (4 * 1024)
+#define BENCH_RESIZE_ROUND_BYTES (8 * 1024 * 1024)
+/**
+ * How full the buffer of the wrapping cases is kept, in percents
+ */
+#define BENCH_WRAP_FILL_PERCENT 75
+/**
+ * How many records a cursor release takes at most, and how many the single-threaded cases queue before releasing them
+ */
+#define BENCH_BATCH_RECORDS 8
+
+typedef enum {
+    /**
+     * The queue starts empty and is bounded, a single-threaded run never holds more than one record in it
+     */
+    BENCH_FILL_STEADY = 0,
+    /**
+     * The queue is kept mostly full, the records keep wrapping around the end of the buffer
+     */
+    BENCH_FILL_WRAP = 1,
+    /**
+     * The queue starts small and grows with QUEUE_OVERFLOW_RESIZE while a round of records piles up
+     */
+    BENCH_FILL_RESIZE = 2
+} bench_fill_t;
+
+typedef enum {
+    /**
+     * A record at a time with queue_pop
+     */
+    BENCH_POP_ONE = 0,
+    /**
+     * Everything that is due at once through a cursor, as the sessions release it
+     */
+    BENCH_POP_DUE = 1
+} bench_pop_t;
+
+typedef struct {
+    queue_backing_t backing;
+    queue_concurrency_t concurrency;
+    bench_fill_t fill;
+    bench_pop_t pop;
+    /**
+     * 1 to push and pop on the same thread, 2 for a producer and a consumer thread
+     */
+    int threads;
+    ssize_t size;
+    size_t ops;
+} bench_case_t;
+
+/**
+ * Per-operation latencies in nanoseconds
+ */
+typedef struct {
+    int64_t *values;
+    size_t count;
+} bench_samples_t;
+
+typedef struct {
+    const bench_case_t *bench_case;
+    queue_t *queue;
+    bench_samples_t push;
+    bench_samples_t pop;
+    /**
+     * From the push to the pop of the same record, threaded cases only
+     */
+    bench_samples_t transit;
+    /**
+     * The cursor of the cases releasing everything that is due
+     */
+    queue_cursor_t cursor;
+    int64_t elapsed;
+    uint64_t resizes;
+    atomic_bool failed;
+} bench_run_t;
+
+static const char *const backing_names[] = {"heap", "mirrored", "segmented"};
+static const char *const concurrency_names[] = {"locked", "spsc"};
+static const char *const fill_names[] = {"steady", "wrap", "resize"};
+static const char *const pop_names[] = {"one", "due"};
+static const ssize_t default_sizes[] = {
+    16, 64, 256, 1024, SESSION_MAX_PACKET_SIZE, 4 * SESSION_MAX_PACKET_SIZE, 16 * SESSION_MAX_PACKET_SIZE
+};
+
+static int parse_name(const char *const *names, const size_t count, const char *name) {
+    for (size_t i = 0; i < count; i++)
+        if (strcmp(names[i], name) == 0)
+            return (int) i;
+    return -1;
+}
+
+static int compare_int64(const void *a, const void *b) {
+    const int64_t x = *(const int64_t *) a;
+    const int64_t y = *(const int64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static bool samples_init(bench_samples_t *samples, const size_t capacity) {
+    samples->count = 0;
+    samples->values = malloc(MAX(capacity, 1) * sizeof(*samples->values));
+    return samples->values != nullptr;
+}
+
+static inline void samples_add(bench_samples_t *samples, const int64_t value) {
+    samples->values[samples->count++] = value;
+}
+
+/**
+ * Print the percentiles of the samples as a JSON object member, sorting the samples.
+ *
+ * @param [in] name the member's name
+ * @param [in] samples the samples
+ */
+static void samples_print(const char *name, bench_samples_t *samples) {
+    if (samples->count == 0)
+        return;
+
+    qsort(samples->values, samples->count, sizeof(*samples->values), compare_int64);
+    static const struct {
+        const char *name;
+        double quantile;
+    } percentiles[] = {{"p50", 0.5}, {"p90", 0.9}, {"p99", 0.99}, {"p999", 0.999}, {"p9999", 0.9999}};
+
+    printf(",\"%s_ns\":{", name);
+    for (size_t i = 0; i < COUNT_OF(percentiles); i++) {
+        const size_t index = (size_t) (percentiles[i].quantile * (double) (samples->count - 1));
+        printf("\"%s\":%" PRId64 ",", percentiles[i].name, samples->values[index]);
+    }
+    printf("\"max\":%" PRId64 "}", samples->values[samples->count - 1]);
+}
+
+static ssize_t bench_capacity(const bench_case_t *bench_case) {
+    if (bench_case->fill == BENCH_FILL_RESIZE)
+        return BENCH_RESIZE_INITIAL_CAPACITY;
+    return MAX(BENCH_MIN_CAPACITY, BENCH_CAPACITY_RECORDS * QUEUE_RECORD_SIZE(bench_case->size));
+}
+
+static bool bench_queue_init(queue_t *queue, const bench_case_t *bench_case) {
+    const ssize_t capacity = bench_capacity(bench_case);
+    const queue_config_t config = {
+        .initial_capacity = capacity,
+        .overflow_behavior = QUEUE_OVERFLOW_RESIZE,
+        .concurrency = bench_case->concurrency,
+        .backing = bench_case->backing,
+        // The steady and wrapping cases block the producer on a full buffer rather than growing it
+        .max_capacity = bench_case->fill == BENCH_FILL_RESIZE ? 0 : capacity,
+        .segment_size = bench_case->backing == QUEUE_BACKING_SEGMENTED
+                            ? MAX(QUEUE_DEFAULT_SEGMENT_SIZE, 4 * QUEUE_RECORD_SIZE(bench_case->size))
+                            : 0
+    };
+    return queue_init_config(queue, &config);
+}
+
+/**
+ * Attach the cursor the cases releasing everything that is due read the queue through.
+ *
+ * @param [in] run the run
+ * @returns true if succeeded, false if failed
+ */
+static bool bench_attach(bench_run_t *run) {
+    return run->bench_case->pop != BENCH_POP_DUE || queue_cursor_attach(run->queue, &run->cursor, 0);
+}
+
+/**
+ * Fill the wrapping cases' queue up to BENCH_WRAP_FILL_PERCENT of its capacity.
+ *
+ * @param [in] run the run
+ * @param [in] buffer a record's worth of data
+ * @returns true if succeeded, false if failed
+ */
+static bool bench_prefill(bench_run_t *run, const char *buffer) {
+    if (run->bench_case->fill != BENCH_FILL_WRAP)
+        return true;
+
+    const ssize_t target = queue_size(run->queue) * BENCH_WRAP_FILL_PERCENT / 100;
+    for (ssize_t filled = 0; filled + QUEUE_RECORD_SIZE(run->bench_case->size) <= target;
+         filled += QUEUE_RECORD_SIZE(run->bench_case->size))
+        if (!queue_push(run->queue, run->bench_case->size, buffer, 0))
+            return false;
+    return true;
+}
+
+/**
+ * How many records are pushed before the queue is drained, so that the resizing cases grow the buffer
+ * and the cursor release has a batch to take
+ */
+static size_t bench_round_records(const bench_case_t *bench_case) {
+    if (bench_case->fill != BENCH_FILL_RESIZE)
+        return bench_case->pop == BENCH_POP_DUE ? BENCH_BATCH_RECORDS : 1;
+    return MAX(BENCH_RESIZE_ROUND_BYTES / QUEUE_RECORD_SIZE(bench_case->size), 1);
+}
+
+/**
+ * Release a batch of due records through the cursor, zero-copy, timing the peek and the release as a whole.
+ *
+ * @param [in] run the run
+ * @param [in] max_records how many records to release at most
+ * @param [in] until the latest timestamp of the records to release
+ * @param [in] transit whether to sample the time from the push of each record
+ * @returns The amount of records released, or -1 if failed
+ */
+static ssize_t bench_pop_due(bench_run_t *run, const size_t max_records, const int64_t until, const bool transit) {
+    const ssize_t size = run->bench_case->size;
+    struct iovec iov[BENCH_BATCH_RECORDS];
+    int64_t pushed[BENCH_BATCH_RECORDS];
+    const int64_t before = edelay_now();
+    const ssize_t count = queue_cursor_peek_spans(run->queue, &run->cursor, until, iov,
+                                                  MIN(max_records, BENCH_BATCH_RECORDS), nullptr, nullptr);
+    if (count <= 0)
+        return count;
+
+    ssize_t released = 0;
+    bool whole = true;
+    for (ssize_t i = 0; i < count; i++) {
+        whole = whole && (ssize_t) iov[i].iov_len == size;
+        // The spans are in the queue buffer, the push time has to be read before they're released
+        memcpy(&pushed[i], iov[i].iov_base, sizeof(pushed[i]));
+        released += (ssize_t) iov[i].iov_len;
+    }
+    queue_cursor_release(run->queue, &run->cursor, released);
+    const int64_t after = edelay_now();
+    samples_add(&run->pop, after - before);
+
+    // The prefilled records carry no push time
+    for (ssize_t i = 0; transit && i < count; i++)
+        if (pushed[i] != 0)
+            samples_add(&run->transit, after - pushed[i]);
+    return whole ? count : -1;
+}
+
+static bool bench_pop_one(bench_run_t *run, char *buffer, bench_samples_t *samples) {
+    ssize_t written;
+    const int64_t before = edelay_now();
+    if (!queue_pop(run->queue, run->bench_case->size, buffer, &written))
+        return false;
+    samples_add(samples, edelay_now() - before);
+    return written == run->bench_case->size;
+}
+
+static void bench_single(bench_run_t *run) {
+    const bench_case_t *bench_case = run->bench_case;
+    char *buffer = calloc(1, bench_case->size);
+    if (buffer == nullptr || !bench_prefill(run, buffer))
+        goto fail;
+
+    const size_t round = bench_round_records(bench_case);
+    const int64_t start = edelay_now();
+    for (size_t done = 0; done < bench_case->ops;) {
+        const size_t count = MIN(round, bench_case->ops - done);
+        for (size_t i = 0; i < count; i++) {
+            const int64_t before = edelay_now();
+            if (!queue_push(run->queue, bench_case->size, buffer, before))
+                goto fail;
+            samples_add(&run->push, edelay_now() - before);
+        }
+        if (bench_case->pop == BENCH_POP_DUE) {
+            for (size_t popped = 0; popped < count;) {
+                const ssize_t batch = bench_pop_due(run, count - popped, INT64_MAX, false);
+                if (batch <= 0)
+                    goto fail;
+                popped += batch;
+            }
+        } else {
+            for (size_t i = 0; i < count; i++)
+                if (!bench_pop_one(run, buffer, &run->pop))
+                    goto fail;
+        }
+        done += count;
+
+        if (bench_case->fill == BENCH_FILL_RESIZE && done < bench_case->ops) {
+            // Back to the small buffer, so that the next round grows it again
+            queue_stats_t stats;
+            queue_get_stats(run->queue, &stats);
+            run->resizes += stats.resizes;
+            queue_destroy(run->queue);
+            if (!bench_queue_init(run->queue, bench_case))
+                goto fail;
+            if (!bench_attach(run)) {
+                queue_destroy(run->queue);
+                goto fail;
+            }
+        }
+    }
+    run->elapsed = edelay_now() - start;
+
+    free(buffer);
+    return;
+
+fail:
+    atomic_store(&run->failed, true);
+    free(buffer);
+}
+
+static void *bench_producer(void *arg) {
+    bench_run_t *run = arg;
+    const bench_case_t *bench_case = run->bench_case;
+    char *buffer = calloc(1, bench_case->size);
+    if (buffer == nullptr)
+        goto fail;
+
+    for (size_t i = 0; i < bench_case->ops && !atomic_load_explicit(&run->failed, memory_order_relaxed);) {
+        const int64_t before = edelay_now();
+        // The consumer reads the push time back out of the record
+        memcpy(buffer, &before, sizeof(before));
+        if (!queue_push(run->queue, bench_case->size, buffer, before)) {
+            // The buffer is at its limit, let the consumer run in case they share a CPU
+            sched_yield();
+            continue;
+        }
+        samples_add(&run->push, edelay_now() - before);
+        i++;
+    }
+
+    free(buffer);
+    return nullptr;
+
+fail:
+    atomic_store(&run->failed, true);
+    return nullptr;
+}
+
+static void bench_consumer(bench_run_t *run) {
+    const bench_case_t *bench_case = run->bench_case;
+    char *buffer = calloc(1, bench_case->size);
+    if (buffer == nullptr)
+        goto fail;
+
+    for (size_t i = 0; i < bench_case->ops && !atomic_load_explicit(&run->failed, memory_order_relaxed);) {
+        if (bench_case->pop == BENCH_POP_DUE) {
+            // Every record pushed so far is due
+            const ssize_t count = bench_pop_due(run, bench_case->ops - i, edelay_now(), true);
+            if (count == -1)
+                goto fail;
+            if (count == 0) {
+                sched_yield();
+                continue;
+            }
+            i += count;
+            continue;
+        }
+
+        ssize_t written;
+        const int64_t before = edelay_now();
+        if (!queue_pop(run->queue, bench_case->size, buffer, &written)) {
+            sched_yield();
+            continue;
+        }
+        const int64_t after = edelay_now();
+        if (written != bench_case->size)
+            goto fail;
+
+        int64_t pushed;
+        memcpy(&pushed, buffer, sizeof(pushed));
+        samples_add(&run->pop, after - before);
+        // The prefilled records carry no push time
+        if (pushed != 0)
+            samples_add(&run->transit, after - pushed);
+        i++;
+    }
+
+    free(buffer);
+    return;
+
+fail:
+    atomic_store(&run->failed, true);
+    free(buffer);
+}
+
+static void bench_threaded(bench_run_t *run) {
+    char *buffer = calloc(1, run->bench_case->size);
+    const bool prefilled = buffer != nullptr && bench_prefill(run, buffer);
+    free(buffer);
+    if (!prefilled) {
+        atomic_store(&run->failed, true);
+        return;
+    }
+
+    pthread_t producer;
+    const int64_t start = edelay_now();
+    if ((errno = pthread_create(&producer, nullptr, bench_producer, run)) != 0) {
+        atomic_store(&run->failed, true);
+        return;
+    }
+    bench_consumer(run);
+    pthread_join(producer, nullptr);
+    run->elapsed = edelay_now() - start;
+}
+
+/**
+ * Run a case and print its results.
+ *
+ * @param [in] bench_case the case
+ * @returns true if succeeded, false if failed
+ */
+static bool bench_run(const bench_case_t *bench_case) {
+    queue_t queue;
+    bench_run_t run = {
+        .bench_case = bench_case,
+        .queue = &queue
+    };
+    atomic_init(&run.failed, false);
+
+    bool success = false;
+    if (!samples_init(&run.push, bench_case->ops) || !samples_init(&run.pop, bench_case->ops)
+        || !samples_init(&run.transit, bench_case->ops))
+        goto fail_samples;
+    if (!bench_queue_init(&queue, bench_case))
+        goto fail_samples;
+    if (!bench_attach(&run)) {
+        queue_destroy(&queue);
+        goto fail_samples;
+    }
+
+    if (bench_case->threads == 1)
+        bench_single(&run);
+    else
+        bench_threaded(&run);
+
+    queue_stats_t stats;
+    queue_get_stats(&queue, &stats);
+    run.resizes += stats.resizes;
+    queue_destroy(&queue);
+
+    if (atomic_load(&run.failed))
+        goto fail_samples;
+
+    const double seconds = (double) run.elapsed / EDELAY_NS_PER_S;
+    printf("{\"backing\":\"%s\",\"concurrency\":\"%s\",\"threads\":%d,\"fill\":\"%s\",\"pop\":\"%s\","
+           "\"size\":%zd,"
+           "\"ops\":%zu,\"seconds\":%.6f,\"ops_per_s\":%.0f,\"mb_per_s\":%.1f,\"resizes\":%" PRIu64,
+           backing_names[bench_case->backing], concurrency_names[bench_case->concurrency], bench_case->threads,
+           fill_names[bench_case->fill], pop_names[bench_case->pop], bench_case->size, bench_case->ops, seconds,
+           (double) bench_case->ops / seconds, (double) bench_case->ops * (double) bench_case->size / seconds / 1e6,
+           run.resizes);
+    samples_print("push", &run.push);
+    samples_print("pop", &run.pop);
+    samples_print("transit", &run.transit);
+    printf("}\n");
+    fflush(stdout);
+    success = true;
+
+fail_samples:
+    free(run.push.values);
+    free(run.pop.values);
+    free(run.transit.values);
+    return success;
+}
+
+static void print_usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-n ops] [-s size] [-b backing] [-c concurrency] [-t threads] [-f fill] [-p pop]\n"
+            "\t-n, --ops\t\tOperations per case (default: %d)\n"
+            "\t-s, --size\t\tOnly this message size in bytes (default: 16 to %d)\n"
+            "\t-b, --backing\t\tOnly heap, mirrored or segmented\n"
+            "\t-c, --concurrency\tOnly locked or spsc\n"
+            "\t-t, --threads\t\tOnly 1 (push and pop on one thread) or 2 (producer and consumer)\n"
+            "\t-f, --fill\t\tOnly steady, wrap or resize\n"
+            "\t-p, --pop\t\tOnly one (queue_pop) or due (a cursor release, up to %d records at once)\n"
+            "\t-h, --help\t\tShow this help message\n",
+            name, BENCH_DEFAULT_OPS, 16 * SESSION_MAX_PACKET_SIZE, BENCH_BATCH_RECORDS);
+}
+
+int main(const int argc, char **argv) {
+    static const struct option long_options[] = {
+        {"ops", required_argument, nullptr, 'n'},
+        {"size", required_argument, nullptr, 's'},
+        {"backing", required_argument, nullptr, 'b'},
+        {"concurrency", required_argument, nullptr, 'c'},
+        {"threads", required_argument, nullptr, 't'},
+        {"fill", required_argument, nullptr, 'f'},
+        {"pop", required_argument, nullptr, 'p'},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0}
+    };
+
+    size_t ops = BENCH_DEFAULT_OPS;
+    ssize_t size = 0;
+    int backing = -1;
+    int concurrency = -1;
+    int threads = 0;
+    int fill = -1;
+    int pop = -1;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "n:s:b:c:t:f:p:h", long_options, nullptr)) != -1) {
+        switch (opt) {
+            case 'n':
+                ops = strtoull(optarg, nullptr, 10);
+                break;
+            case 's':
+                size = strtoll(optarg, nullptr, 10);
+                if (size < (ssize_t) sizeof(int64_t)) {
+                    fprintf(stderr, "The message size must be at least %zu bytes\n", sizeof(int64_t));
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'b':
+                backing = parse_name(backing_names, COUNT_OF(backing_names), optarg);
+                break;
+            case 'c':
+                concurrency = parse_name(concurrency_names, COUNT_OF(concurrency_names), optarg);
+                break;
+            case 't':
+                threads = (int) strtol(optarg, nullptr, 10);
+                break;
+            case 'f':
+                fill = parse_name(fill_names, COUNT_OF(fill_names), optarg);
+                break;
+            case 'p':
+                pop = parse_name(pop_names, COUNT_OF(pop_names), optarg);
+                break;
+            case 'h':
+                print_usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        if ((opt == 'b' && backing == -1) || (opt == 'c' && concurrency == -1) || (opt == 'f' && fill == -1)
+            || (opt == 'p' && pop == -1)
+            || (opt == 't' && threads != 1 && threads != 2) || (opt == 'n' && ops == 0)) {
+            fprintf(stderr, "Invalid value for -%c: %s\n", opt, optarg);
+            return EXIT_FAILURE;
+        }
+    }
+
+    int status = EXIT_SUCCESS;
+    for (size_t b = 0; b < COUNT_OF(backing_names); b++) {
+        if (backing != -1 && (int) b != backing)
+            continue;
+        for (size_t c = 0; c < COUNT_OF(concurrency_names); c++) {
+            if (concurrency != -1 && (int) c != concurrency)
+                continue;
+            for (int t = 1; t <= 2; t++) {
+                if (threads != 0 && t != threads)
+                    continue;
+                for (size_t f = 0; f < COUNT_OF(fill_names); f++) {
+                    if (fill != -1 && (int) f != fill)
+                        continue;
+                    for (size_t o = 0; o < COUNT_OF(pop_names); o++) {
+                        if (pop != -1 && (int) o != pop)
+                            continue;
+                        for (size_t s = 0; s < COUNT_OF(default_sizes); s++) {
+                            if (size != 0 && s > 0)
+                                break;
+                            const bench_case_t bench_case = {
+                                .backing = (queue_backing_t) b,
+                                .concurrency = (queue_concurrency_t) c,
+                                .fill = (bench_fill_t) f,
+                                .pop = (bench_pop_t) o,
+                                .threads = t,
+                                .size = size != 0 ? size : default_sizes[s],
+                                .ops = ops
+                            };
+                            if (!bench_run(&bench_case)) {
+                                fprintf(stderr, "Failed to run %s/%s/%d/%s/%s/%zd\n", backing_names[b],
+                                        concurrency_names[c], t, fill_names[f], pop_names[o], bench_case.size);
+                                status = EXIT_FAILURE;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    return status;
+}
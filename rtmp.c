@@ -0,0 +1,347 @@
+//
+// An incremental parser of the broadcaster's RTMP chunk stream, indexing where the queued stream can be cut
+//
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "rtmp.h"
+#include "c23_compat.h"
+
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+
+#define RTMP_INITIAL_BOUNDARIES 256
+#define RTMP_TIMESTAMP_EXTENDED 0xFFFFFF
+
+static uint32_t rtmp_read_be24(const uint8_t *p) {
+    return (uint32_t) p[0] << 16 | (uint32_t) p[1] << 8 | p[2];
+}
+
+static uint32_t rtmp_read_be32(const uint8_t *p) {
+    return (uint32_t) p[0] << 24 | rtmp_read_be24(p + 1);
+}
+
+bool rtmp_parser_init(rtmp_parser_t *parser) {
+    if (parser == nullptr)
+        return false;
+
+    bzero(parser, sizeof(*parser));
+    parser->state = RTMP_STATE_HANDSHAKE;
+    parser->skip = 1 + 2 * RTMP_HANDSHAKE_SIZE;
+    parser->chunk_size = RTMP_DEFAULT_CHUNK_SIZE;
+    parser->keyframe_sequence = -1;
+
+    parser->boundaries = calloc(RTMP_INITIAL_BOUNDARIES, sizeof(*parser->boundaries));
+    if (parser->boundaries == nullptr)
+        return false;
+    parser->boundary_capacity = RTMP_INITIAL_BOUNDARIES;
+
+    return true;
+}
+
+void rtmp_parser_destroy(rtmp_parser_t *parser) {
+    if (parser == nullptr)
+        return;
+
+    free(parser->boundaries);
+    parser->boundaries = nullptr;
+    parser->boundary_capacity = parser->boundary_count = 0;
+}
+
+static void rtmp_parser_invalidate(rtmp_parser_t *parser) {
+    parser->state = RTMP_STATE_INVALID;
+    parser->boundary_count = 0;
+    parser->keyframe_sequence = -1;
+}
+
+/**
+ * Record a boundary at the start of the chunk header that has just been parsed.
+ *
+ * @param [in] parser a pointer to the parser
+ * @returns true if succeeded, false if failed
+ */
+static bool rtmp_parser_add_boundary(rtmp_parser_t *parser) {
+    if (parser->boundary_count == parser->boundary_capacity) {
+        const size_t new_capacity = parser->boundary_capacity * 2;
+        rtmp_boundary_t *boundaries = calloc(new_capacity, sizeof(*boundaries));
+        if (boundaries == nullptr)
+            return false;
+
+        const size_t head_count = MIN(parser->boundary_capacity - parser->boundary_head, parser->boundary_count);
+        memcpy(boundaries, parser->boundaries + parser->boundary_head, head_count * sizeof(*boundaries));
+        memcpy(boundaries + head_count, parser->boundaries,
+               (parser->boundary_count - head_count) * sizeof(*boundaries));
+        free(parser->boundaries);
+        parser->boundaries = boundaries;
+        parser->boundary_capacity = new_capacity;
+        parser->boundary_head = 0;
+    }
+
+    const int64_t sequence = parser->head_sequence + (int64_t) parser->boundary_count;
+    const rtmp_boundary_t *previous = rtmp_parser_boundary(parser, sequence - 1);
+    parser->boundaries[(parser->boundary_head + parser->boundary_count) % parser->boundary_capacity] =
+            (rtmp_boundary_t) {
+                .mark = parser->header_mark,
+                .offset = parser->header_offset,
+                .stream_offset = parser->header_stream_offset,
+                .control_count = parser->control_count,
+                .settled_sequence = previous != nullptr && previous->control_count == parser->control_count
+                                        ? previous->settled_sequence
+                                        : sequence,
+                .keyframe = false
+            };
+    parser->boundary_count++;
+    return true;
+}
+
+static rtmp_chunk_stream_t *rtmp_parser_find_stream(rtmp_parser_t *parser, const uint32_t id) {
+    for (uint32_t i = 0; i < parser->stream_count; i++) {
+        if (parser->streams[i].id == id)
+            return &parser->streams[i];
+    }
+
+    return nullptr;
+}
+
+static uint32_t rtmp_chunk_stream_id(const uint8_t *header) {
+    switch (header[0] & 0x3f) {
+        case 0:
+            return 64 + header[1];
+        case 1:
+            return 64 + header[1] + ((uint32_t) header[2] << 8);
+        default:
+            return header[0] & 0x3f;
+    }
+}
+
+static uint32_t rtmp_basic_header_size(const uint8_t *header) {
+    switch (header[0] & 0x3f) {
+        case 0:
+            return 2;
+        case 1:
+            return 3;
+        default:
+            return 1;
+    }
+}
+
+/**
+ * Get the size of the chunk header, as far as the bytes collected so far tell.
+ *
+ * @param [in] parser a pointer to the parser
+ * @returns The size in bytes, it may grow once more bytes are collected
+ */
+static uint32_t rtmp_parser_header_size(rtmp_parser_t *parser) {
+    static const uint32_t message_header_sizes[] = {11, 7, 3, 0};
+
+    const uint8_t *header = parser->header;
+    const uint32_t format = header[0] >> 6;
+    const uint32_t basic_size = rtmp_basic_header_size(header);
+    // The chunk stream id has to be known before anything else
+    if (parser->header_size < basic_size)
+        return basic_size;
+
+    const uint32_t size = basic_size + message_header_sizes[format];
+    if (parser->header_size < size)
+        return size;
+
+    if (format < 3)
+        return size + (rtmp_read_be24(header + basic_size) == RTMP_TIMESTAMP_EXTENDED ? 4 : 0);
+
+    const rtmp_chunk_stream_t *stream = rtmp_parser_find_stream(parser, rtmp_chunk_stream_id(header));
+    return size + (stream != nullptr && stream->extended_timestamp ? 4 : 0);
+}
+
+/**
+ * Handle the chunk header that has been collected, and get ready to skip the chunk's payload.
+ *
+ * @param [in] parser a pointer to the parser
+ */
+static void rtmp_parser_chunk(rtmp_parser_t *parser) {
+    const uint8_t *header = parser->header;
+    const uint32_t format = header[0] >> 6;
+    const uint32_t id = rtmp_chunk_stream_id(header);
+    const uint8_t *message_header = header + rtmp_basic_header_size(header);
+
+    rtmp_chunk_stream_t *stream = rtmp_parser_find_stream(parser, id);
+    if (stream == nullptr) {
+        // A chunk stream starts with a header that tells the message length
+        if (parser->stream_count == RTMP_MAX_CHUNK_STREAMS || format >= 2) {
+            rtmp_parser_invalidate(parser);
+            return;
+        }
+        stream = &parser->streams[parser->stream_count++];
+        bzero(stream, sizeof(*stream));
+        stream->id = id;
+    }
+
+    if (format < 3)
+        stream->extended_timestamp = rtmp_read_be24(message_header) == RTMP_TIMESTAMP_EXTENDED;
+    if (format < 2) {
+        if (stream->remaining != 0) {
+            rtmp_parser_invalidate(parser);
+            return;
+        }
+        stream->length = rtmp_read_be24(message_header + 3);
+        stream->type = message_header[6];
+    }
+
+    parser->payload_seen = UINT32_MAX;
+    if (stream->remaining == 0) {
+        // Nothing else is in the middle of a message, so the stream can be cut right in front of this one, unless
+        // its header leaves out what the previous message of its chunk stream had, that message may be cut away
+        parser->message_indexed = parser->in_flight == 0 && format == 0;
+        if (parser->message_indexed && !rtmp_parser_add_boundary(parser)) {
+            rtmp_parser_invalidate(parser);
+            return;
+        }
+        if (stream->type != RTMP_MESSAGE_AUDIO && stream->type != RTMP_MESSAGE_VIDEO)
+            parser->control_count++;
+        stream->remaining = stream->length;
+        if (stream->remaining > 0)
+            parser->in_flight++;
+        if (stream->type == RTMP_MESSAGE_VIDEO || stream->type == RTMP_MESSAGE_SET_CHUNK_SIZE)
+            parser->payload_seen = 0;
+    }
+
+    parser->current = stream;
+    parser->skip = MIN(parser->chunk_size, stream->remaining);
+    parser->header_size = 0;
+    parser->state = parser->skip > 0 ? RTMP_STATE_PAYLOAD : RTMP_STATE_HEADER;
+}
+
+/**
+ * Look into the first bytes of a message's payload: the frame type of a video message, the new chunk size
+ * of a Set Chunk Size message.
+ *
+ * @param [in] parser a pointer to the parser
+ * @param [in] data the bytes of the payload
+ * @param [in] size the amount of bytes
+ */
+static void rtmp_parser_look_into(rtmp_parser_t *parser, const uint8_t *data, const size_t size) {
+    const rtmp_chunk_stream_t *stream = parser->current;
+    for (size_t i = 0; i < size && parser->payload_seen < sizeof(parser->set_chunk_size); i++) {
+        // The frame type is in the same bits of the legacy and the enhanced video tags
+        if (stream->type == RTMP_MESSAGE_VIDEO && parser->payload_seen == 0 && parser->message_indexed
+            && ((data[i] >> 4) & 0x7) == RTMP_VIDEO_FRAME_KEY) {
+            parser->keyframe_sequence = parser->head_sequence + (int64_t) parser->boundary_count - 1;
+            parser->boundaries[(parser->boundary_head + parser->boundary_count - 1) % parser->boundary_capacity]
+                    .keyframe = true;
+        }
+        if (stream->type == RTMP_MESSAGE_SET_CHUNK_SIZE)
+            parser->set_chunk_size[parser->payload_seen] = data[i];
+        parser->payload_seen++;
+    }
+
+    if (stream->type == RTMP_MESSAGE_VIDEO && parser->payload_seen > 0) {
+        parser->payload_seen = UINT32_MAX;
+    } else if (stream->type == RTMP_MESSAGE_SET_CHUNK_SIZE
+               && parser->payload_seen == sizeof(parser->set_chunk_size)) {
+        // Applies to the chunks after this one
+        const uint32_t chunk_size = rtmp_read_be32(parser->set_chunk_size) & 0x7fffffff;
+        if (chunk_size == 0) {
+            rtmp_parser_invalidate(parser);
+            return;
+        }
+        parser->chunk_size = chunk_size;
+        parser->payload_seen = UINT32_MAX;
+    }
+}
+
+void rtmp_parser_feed(rtmp_parser_t *parser, const uint8_t *data, const size_t size, const queue_mark_t *mark) {
+    if (parser->state == RTMP_STATE_INVALID)
+        return;
+    // A dropped piece leaves the rest of the stream unparseable
+    if (mark->position < 0) {
+        rtmp_parser_invalidate(parser);
+        return;
+    }
+
+    size_t i = 0;
+    while (i < size && parser->state != RTMP_STATE_INVALID) {
+        switch (parser->state) {
+            case RTMP_STATE_HANDSHAKE: {
+                // C0 is the protocol version, plain RTMP is 3
+                if (parser->stream_offset + i == 0 && data[i] != 3) {
+                    parser->not_rtmp = true;
+                    rtmp_parser_invalidate(parser);
+                    break;
+                }
+                const uint32_t skipped = MIN(parser->skip, size - i);
+                i += skipped;
+                parser->skip -= skipped;
+                if (parser->skip == 0)
+                    parser->state = RTMP_STATE_HEADER;
+                break;
+            }
+            case RTMP_STATE_HEADER:
+                if (parser->header_size == 0) {
+                    parser->header_mark = *mark;
+                    parser->header_offset = (ssize_t) i;
+                    parser->header_stream_offset = parser->stream_offset + i;
+                }
+                parser->header[parser->header_size++] = data[i++];
+                if (parser->header_size == rtmp_parser_header_size(parser))
+                    rtmp_parser_chunk(parser);
+                break;
+            case RTMP_STATE_PAYLOAD: {
+                const uint32_t skipped = MIN(parser->skip, size - i);
+                if (parser->payload_seen < sizeof(parser->set_chunk_size))
+                    rtmp_parser_look_into(parser, data + i, skipped);
+                i += skipped;
+                parser->skip -= skipped;
+                parser->current->remaining -= skipped;
+                if (parser->skip == 0) {
+                    if (parser->current->remaining == 0)
+                        parser->in_flight--;
+                    parser->state = RTMP_STATE_HEADER;
+                }
+                break;
+            }
+            case RTMP_STATE_INVALID:
+                break;
+        }
+    }
+
+    parser->stream_offset += size;
+}
+
+void rtmp_parser_prune(rtmp_parser_t *parser, const uint64_t stream_offset) {
+    while (parser->boundary_count > 0 && parser->boundaries[parser->boundary_head].stream_offset < stream_offset) {
+        parser->boundary_head = (parser->boundary_head + 1) % parser->boundary_capacity;
+        parser->boundary_count--;
+        parser->head_sequence++;
+    }
+
+    if (parser->keyframe_sequence < parser->head_sequence)
+        parser->keyframe_sequence = -1;
+}
+
+const rtmp_boundary_t *rtmp_parser_next_boundary(const rtmp_parser_t *parser, const uint64_t stream_offset) {
+    // The boundaries are in the order of the stream, the ones before the point are bisected away
+    size_t low = 0;
+    size_t high = parser->boundary_count;
+    while (low < high) {
+        const size_t middle = low + (high - low) / 2;
+        if (parser->boundaries[(parser->boundary_head + middle) % parser->boundary_capacity].stream_offset
+            < stream_offset)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    return low < parser->boundary_count
+           ? &parser->boundaries[(parser->boundary_head + low) % parser->boundary_capacity] : nullptr;
+}
+
+const rtmp_boundary_t *rtmp_parser_boundary(const rtmp_parser_t *parser, const int64_t sequence) {
+    if (sequence < parser->head_sequence || sequence >= parser->head_sequence + (int64_t) parser->boundary_count)
+        return nullptr;
+
+    return &parser->boundaries[(parser->boundary_head + (sequence - parser->head_sequence))
+                               % parser->boundary_capacity];
+}
+
+const rtmp_boundary_t *rtmp_parser_last_keyframe(const rtmp_parser_t *parser) {
+    return rtmp_parser_boundary(parser, parser->keyframe_sequence);
+}
@@ -0,0 +1,214 @@
+//
+// An incremental parser of the broadcaster's RTMP chunk stream, indexing where the queued stream can be cut
+//
+
+#ifndef EMERGENCY_DELAY_RTMP_H
+#define EMERGENCY_DELAY_RTMP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "queue.h"
+#include "c23_compat.h"
+
+/**
+ * C1 and C2 are this long, C0 is a single byte
+ */
+#define RTMP_HANDSHAKE_SIZE 1536
+#define RTMP_DEFAULT_CHUNK_SIZE 128
+/**
+ * How many chunk streams are tracked at once, a broadcaster uses a handful of them
+ */
+#define RTMP_MAX_CHUNK_STREAMS 16
+/**
+ * The longest chunk header: 3 bytes of the basic header, 11 of the message header and the extended timestamp
+ */
+#define RTMP_MAX_CHUNK_HEADER_SIZE 18
+
+#define RTMP_MESSAGE_SET_CHUNK_SIZE 1
+#define RTMP_MESSAGE_AUDIO 8
+#define RTMP_MESSAGE_VIDEO 9
+#define RTMP_VIDEO_FRAME_KEY 1
+
+/**
+ * A point in the stream where no message is in the middle of being sent, so that the stream can be cut there.
+ * It's always in front of a type 0 header, the only one that doesn't go on from the headers before it, which
+ * a cut may have dropped.
+ */
+typedef struct {
+    /**
+     * The record the boundary is in, and its offset in the record's payload
+     */
+    queue_mark_t mark;
+    ssize_t offset;
+    /**
+     * How many bytes of the stream come before the boundary
+     */
+    uint64_t stream_offset;
+    /**
+     * How many messages other than audio and video have started before the boundary. Those are never dropped:
+     * the downstream server needs its commands, metadata and chunk size changes.
+     */
+    uint64_t control_count;
+    /**
+     * The sequence number of the first boundary with the same control_count
+     */
+    int64_t settled_sequence;
+    /**
+     * Whether a video key frame starts at the boundary
+     */
+    bool keyframe;
+} rtmp_boundary_t;
+
+typedef struct {
+    uint32_t id;
+    uint32_t length;
+    /**
+     * How many bytes of the current message are still to come, 0 between messages
+     */
+    uint32_t remaining;
+    uint8_t type;
+    /**
+     * Whether the last full header had an extended timestamp, which type 3 headers then repeat
+     */
+    bool extended_timestamp;
+} rtmp_chunk_stream_t;
+
+typedef enum {
+    RTMP_STATE_HANDSHAKE = 0,
+    RTMP_STATE_HEADER = 1,
+    RTMP_STATE_PAYLOAD = 2,
+    /**
+     * Not an RTMP stream, or a part of it is missing, nothing is indexed anymore
+     */
+    RTMP_STATE_INVALID = 3
+} rtmp_state_t;
+
+typedef struct {
+    rtmp_state_t state;
+    /**
+     * Set if the stream doesn't even start with C0, as opposed to an RTMP stream that has lost a piece
+     */
+    bool not_rtmp;
+    /**
+     * How many bytes have been parsed so far
+     */
+    uint64_t stream_offset;
+    /**
+     * How many bytes of the handshake or of the chunk's payload are still to be skipped
+     */
+    uint32_t skip;
+    uint32_t chunk_size;
+
+    /**
+     * The chunk header collected so far, it may come in several pieces
+     */
+    uint8_t header[RTMP_MAX_CHUNK_HEADER_SIZE];
+    uint32_t header_size;
+    /**
+     * Where the chunk header starts, in case a boundary has to be recorded there
+     */
+    queue_mark_t header_mark;
+    ssize_t header_offset;
+    uint64_t header_stream_offset;
+
+    rtmp_chunk_stream_t streams[RTMP_MAX_CHUNK_STREAMS];
+    uint32_t stream_count;
+    /**
+     * The chunk stream the payload being skipped belongs to
+     */
+    rtmp_chunk_stream_t *current;
+    /**
+     * How many chunk streams are in the middle of a message
+     */
+    uint32_t in_flight;
+    /**
+     * How many bytes of the current message's payload have been looked into, UINT32_MAX if no more are needed
+     */
+    uint32_t payload_seen;
+    /**
+     * Whether the current message starts at the last boundary
+     */
+    bool message_indexed;
+    uint8_t set_chunk_size[4];
+    /**
+     * How many messages other than audio and video have started so far
+     */
+    uint64_t control_count;
+
+    /**
+     * The boundaries that are still queued, a ring
+     */
+    rtmp_boundary_t *boundaries;
+    size_t boundary_capacity;
+    size_t boundary_head;
+    size_t boundary_count;
+    /**
+     * The sequence number of the first boundary, and of the last one with a key frame, or -1 if there's none
+     */
+    int64_t head_sequence;
+    int64_t keyframe_sequence;
+} rtmp_parser_t;
+
+/**
+ * Initialize the parser for a stream that starts with the client's side of the handshake.
+ *
+ * @param [out] parser a pointer to the parser
+ * @returns true if succeeded, false if failed
+ */
+NODISCARD bool rtmp_parser_init(rtmp_parser_t *parser);
+
+/**
+ * Free the index.
+ *
+ * @param [in] parser a pointer to the parser
+ */
+void rtmp_parser_destroy(rtmp_parser_t *parser);
+
+/**
+ * Parse the next piece of the stream. Only the chunk headers and the first bytes of some messages are looked into,
+ * the rest of the payload is skipped over.
+ *
+ * @param [in] parser a pointer to the parser
+ * @param [in] data the piece of the stream, the payload of a queued record
+ * @param [in] size the size of the piece in bytes
+ * @param [in] mark the mark of the record, a negative position gives up the indexing
+ */
+void rtmp_parser_feed(rtmp_parser_t *parser, const uint8_t *data, size_t size, const queue_mark_t *mark);
+
+/**
+ * Forget the boundaries before the given point of the stream.
+ *
+ * @param [in] parser a pointer to the parser
+ * @param [in] stream_offset how many bytes of the stream have left the queue
+ */
+void rtmp_parser_prune(rtmp_parser_t *parser, uint64_t stream_offset);
+
+/**
+ * Get the first queued boundary at or after the given point of the stream.
+ *
+ * @param [in] parser a pointer to the parser
+ * @param [in] stream_offset how many bytes of the stream come before the point
+ * @returns A pointer to the boundary, or nullptr if there's none
+ */
+const rtmp_boundary_t *rtmp_parser_next_boundary(const rtmp_parser_t *parser, uint64_t stream_offset);
+
+/**
+ * Get a queued boundary by its sequence number.
+ *
+ * @param [in] parser a pointer to the parser
+ * @param [in] sequence the sequence number
+ * @returns A pointer to the boundary, or nullptr if it's not queued anymore
+ */
+const rtmp_boundary_t *rtmp_parser_boundary(const rtmp_parser_t *parser, int64_t sequence);
+
+/**
+ * Get the last boundary a key frame starts at.
+ *
+ * @param [in] parser a pointer to the parser
+ * @returns A pointer to the boundary, or nullptr if there's none
+ */
+const rtmp_boundary_t *rtmp_parser_last_keyframe(const rtmp_parser_t *parser);
+
+#endif //EMERGENCY_DELAY_RTMP_H
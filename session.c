@@ -0,0 +1,969 @@
+//
+// A single delayed stream: the broadcaster's connection, its queue and the connection to the destination server
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+
+#include "session.h"
+#include "edelay_time.h"
+#include "c23_compat.h"
+
+/**
+ * Start connecting to the upstream server, and make the socket bound the amount of unsent data.
+ *
+ * @param [in] upstream the resolved upstream server
+ * @returns The non-blocking socket, writable once connected, or -1 if failed
+ */
+static int session_upstream_connect(const struct addrinfo *upstream) {
+    int upstream_fd = -1;
+    for (const struct addrinfo *p = upstream; p != nullptr; p = p->ai_next) {
+        upstream_fd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, p->ai_protocol);
+        if (upstream_fd == -1)
+            continue;
+
+        if (connect(upstream_fd, p->ai_addr, p->ai_addrlen) == 0 || errno == EINPROGRESS)
+            break;
+
+        close(upstream_fd);
+        upstream_fd = -1;
+    }
+
+    if (upstream_fd == -1) {
+        perror("upstream connect");
+        return -1;
+    }
+
+    const int yes = 1;
+    if (setsockopt(upstream_fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)) == -1)
+        perror("setsockopt upstream tcp nodelay");
+
+    // Without the bound the effective delay grows by whatever the kernel has buffered
+    const int lowat = SESSION_UPSTREAM_NOTSENT_LOWAT;
+    if (setsockopt(upstream_fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat)) == -1)
+        perror("setsockopt upstream notsent lowat");
+
+    return upstream_fd;
+}
+
+static bool session_epoll_add(const session_t *session, const int fd, const uint32_t events,
+                              const session_source_t *source) {
+    struct epoll_event event = {
+        .events = events,
+        .data.ptr = (void *) source
+    };
+    if (epoll_ctl(session->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        perror("epoll_ctl add");
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Change the events a descriptor is registered for, unless it's registered for them already.
+ *
+ * @param [in] session a pointer to the session
+ * @param [in] fd the descriptor
+ * @param [in,out] registered the events the descriptor is registered for
+ * @param [in] events the events to wait for, hang-ups and errors are reported regardless
+ * @param [in] source what the events refer to
+ * @returns true if succeeded, false if failed
+ */
+static bool session_epoll_watch(const session_t *session, const int fd, uint32_t *registered, const uint32_t events,
+                                const session_source_t *source) {
+    if (*registered == events)
+        return true;
+
+    struct epoll_event event = {
+        .events = events,
+        .data.ptr = (void *) source
+    };
+    if (epoll_ctl(session->epoll_fd, EPOLL_CTL_MOD, fd, &event) == -1) {
+        perror("epoll_ctl mod");
+        return false;
+    }
+
+    *registered = events;
+    return true;
+}
+
+/**
+ * Register an upstream for its replies, unless the broadcaster hasn't taken the last ones yet,
+ * and for becoming writable while it's blocked.
+ *
+ * @param [in] session a pointer to the session
+ * @param [in] upstream the upstream
+ * @returns true if succeeded, false if failed
+ */
+static bool session_upstream_watch(const session_t *session, session_upstream_t *upstream) {
+    if (upstream->fd == -1)
+        return true;
+
+    // Nothing comes back from stdout
+    uint32_t events = upstream->blocked ? EPOLLOUT : 0;
+    if (upstream->owns_fd && (upstream->source.upstream != 0 || session->reply_end == 0))
+        events |= EPOLLIN;
+    return session_epoll_watch(session, upstream->fd, &upstream->events, events, &upstream->source);
+}
+
+/**
+ * Register the broadcaster's socket for the stream, and for becoming writable while a reply is waiting for it.
+ *
+ * @param [in] session a pointer to the session
+ * @returns true if succeeded, false if failed
+ */
+static bool session_client_watch(session_t *session) {
+    if (session->client_fd == -1)
+        return true;
+
+    const uint32_t events = EPOLLIN | EPOLLRDHUP | (session->reply_end > 0 ? EPOLLOUT : 0);
+    return session_epoll_watch(session, session->client_fd, &session->client_events, events,
+                               &session->client_source);
+}
+
+/**
+ * Wait for an upstream to become writable, or stop waiting.
+ *
+ * @param [in] session a pointer to the session
+ * @param [in] upstream the upstream
+ * @param [in] blocked whether the upstream can't take any more data
+ * @returns true if succeeded, false if failed
+ */
+static bool session_set_upstream_blocked(const session_t *session, session_upstream_t *upstream, const bool blocked) {
+    upstream->blocked = blocked;
+    return session_upstream_watch(session, upstream);
+}
+
+/**
+ * Pass on as much of the waiting reply as the broadcaster takes.
+ *
+ * @param [in] session a pointer to the session
+ * @returns true if succeeded, false if failed
+ */
+static bool session_reply_flush(session_t *session) {
+    while (session->client_fd != -1 && session->reply_start < session->reply_end) {
+        const ssize_t sent = send(session->client_fd, session->reply + session->reply_start,
+                                  session->reply_end - session->reply_start, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                break;
+            // The broadcaster is going away, its side of the session finds out when it's read from
+            perror("reply send");
+            session->reply_start = session->reply_end;
+            break;
+        }
+        session->reply_start += sent;
+    }
+    if (session->client_fd == -1 || session->reply_start == session->reply_end)
+        session->reply_start = session->reply_end = 0;
+
+    // The first upstream is read again once the broadcaster has taken the whole reply
+    return session_client_watch(session) && session_upstream_watch(session, &session->upstreams[0]);
+}
+
+/**
+ * Close the broadcaster's socket, the rest of the stream is still released.
+ *
+ * @param [in] session a pointer to the session
+ * @returns true if succeeded, false if failed
+ */
+static bool session_client_close(session_t *session) {
+    close(session->client_fd);
+    session->client_fd = -1;
+    // The replies have nowhere to go anymore, the upstream's are read and dropped from now on
+    return session_reply_flush(session);
+}
+
+/**
+ * Let go of an upstream, the stream goes on to the others.
+ *
+ * @param [in] session a pointer to the session
+ * @param [in] upstream the upstream
+ */
+static void session_upstream_close(session_t *session, session_upstream_t *upstream) {
+    if (upstream->fd == -1)
+        return;
+
+    // Closing the descriptor removes it from epoll
+    if (upstream->owns_fd)
+        close(upstream->fd);
+    upstream->fd = -1;
+    session->upstreams_open--;
+
+    // Whatever only this upstream was holding back is given back to the broadcaster
+    if (!session->splice)
+        queue_cursor_detach(&session->queue, &upstream->cursor);
+}
+
+/**
+ * Read what an upstream has replied. The first upstream's replies go back to the broadcaster right away,
+ * the others' are dropped, the broadcaster only talks to one server.
+ *
+ * @param [in] session a pointer to the session
+ * @param [in] upstream the upstream
+ * @returns true if the session goes on, false if it's over
+ */
+static bool session_upstream_reply(session_t *session, session_upstream_t *upstream) {
+    for (int i = 0; i < SESSION_MAX_RECEIVES && upstream->fd != -1; i++) {
+        const bool relayed = upstream->source.upstream == 0 && session->client_fd != -1;
+        // Read again once the broadcaster has taken the last reply
+        if (relayed && session->reply_end > 0)
+            break;
+
+        char dropped[SESSION_MAX_PACKET_SIZE];
+        char *reply = relayed ? session->reply : dropped;
+        const ssize_t received = recv(upstream->fd, reply, SESSION_MAX_PACKET_SIZE, 0);
+        if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            break;
+        if (received <= 0) {
+            if (received == -1)
+                perror("upstream recv");
+            else
+                fprintf(stderr, "upstream %d closed the connection\n", upstream->source.upstream);
+            // The stream goes on to the rest of them
+            session_upstream_close(session, upstream);
+            return session->upstreams_open > 0;
+        }
+
+        if (relayed) {
+            session->reply_end = received;
+            if (!session_reply_flush(session))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Arm the release timer, at the deadline moved up to the release quantum, or disarm it if the deadline is negative.
+ *
+ * @param [in] session a pointer to the session
+ * @param [in] deadline the absolute deadline in nanoseconds of CLOCK_MONOTONIC
+ * @returns true if succeeded, false if failed
+ */
+static bool session_arm_timer(session_t *session, const int64_t deadline) {
+    // The next packet often falls into the same quantum, and the timer is left as it is
+    const int64_t slot = edelay_round_up(deadline, session->release_quantum_ns);
+    if (session->timer_deadline == slot || (session->timer_deadline < 0 && slot < 0))
+        return true;
+
+    // A zero it_value disarms the timer, a deadline in the past expires it right away
+    struct itimerspec timer;
+    bzero(&timer, sizeof(timer));
+    const int64_t expiry = slot - session->spin_ns;
+    if (slot >= 0)
+        timer.it_value = edelay_ns_to_timespec(expiry > 0 ? expiry : 1);
+    if (timerfd_settime(session->timer_fd, TFD_TIMER_ABSTIME, &timer, nullptr) == -1) {
+        perror("timerfd_settime");
+        return false;
+    }
+
+    session->timer_deadline = slot < 0 ? -1 : slot;
+    return true;
+}
+
+/**
+ * Check whether the epoll instance driving the session has events ready for the other sessions of its shard.
+ *
+ * @param [in] session a pointer to the session
+ * @returns true if there are events waiting, false if not
+ */
+static bool session_shard_busy(const session_t *session) {
+    struct pollfd ready = {
+        .fd = session->epoll_fd,
+        .events = POLLIN
+    };
+    return poll(&ready, 1, 0) > 0;
+}
+
+/**
+ * Rearm the release timer for the deadline itself rather than ahead of it, instead of spinning through the rest.
+ * The spin holds up the whole shard, so it gives way whenever the other sessions of the shard have work to do.
+ *
+ * @param [in] session a pointer to the session
+ * @returns true if succeeded, false if failed
+ */
+static bool session_sleep_until_deadline(session_t *session) {
+    struct itimerspec timer;
+    bzero(&timer, sizeof(timer));
+    timer.it_value = edelay_ns_to_timespec(session->timer_deadline);
+    if (timerfd_settime(session->timer_fd, TFD_TIMER_ABSTIME, &timer, nullptr) == -1) {
+        perror("timerfd_settime");
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Names the file a new session keeps its queue in. The monotonic clock tells the files of successive relays apart.
+ *
+ * @param [in] directory the state directory
+ * @returns The path, to be freed, or nullptr if failed
+ */
+static char *session_state_path(const char *directory) {
+    static _Atomic uint64_t serial = 0;
+    const uint64_t number = atomic_fetch_add_explicit(&serial, 1, memory_order_relaxed);
+
+    char *path;
+    if (asprintf(&path, "%s/edelay-%" PRId64 "-%" PRIu64 ".queue", directory, edelay_now(), number) == -1)
+        return nullptr;
+    return path;
+}
+
+/**
+ * Initialize the session and register its descriptors with epoll.
+ *
+ * @param [out] session a pointer to the session
+ * @param [in] epoll_fd the epoll instance that drives the session
+ * @param [in] client_fd the broadcaster's socket, owned by the session from now on, or -1 if it's gone already
+ * @param [in] state_path the file to keep the queue in, owned by the session from now on, or nullptr for none
+ * @param [in] config the session's configuration
+ * @returns true if succeeded, false if failed. The client socket is closed in either case on failure.
+ */
+static bool session_setup(session_t *session, const int epoll_fd, const int client_fd, char *state_path,
+                          const session_config_t *config) {
+    bzero(session, sizeof(*session));
+    session->delay_ns = config->delay_ns;
+    session->spin_ns = config->spin_ns;
+    session->release_quantum_ns = config->release_quantum_ns;
+    // Counted right away, session_destroy takes it back even if the initialization fails
+    session->stats = config->stats;
+    session_stats_add(&session->stats->sessions_started, 1);
+    session_stats_add(&session->stats->sessions_active, 1);
+    session->epoll_fd = epoll_fd;
+    session->client_fd = client_fd;
+    session->state_path = state_path;
+    session->timer_fd = -1;
+    session->timer_deadline = -1;
+    session->client_source = (session_source_t) {session, SESSION_SOURCE_CLIENT, -1};
+    session->timer_source = (session_source_t) {session, SESSION_SOURCE_TIMER, -1};
+
+    session->splice = config->splice;
+    if (session->splice) {
+        if (!pipe_queue_init(&session->pipe_queue, 0)) {
+            perror("pipe queue init failed");
+            goto fail;
+        }
+    } else {
+        // Kept in a file that outlives the relay, a queue in the file an earlier relay has left is picked up
+        queue_config_t queue_config = config->queue_config;
+        if (session->state_path != nullptr) {
+            queue_config.backing = QUEUE_BACKING_FILE;
+            queue_config.file_path = session->state_path;
+        }
+        if (!queue_init_config(&session->queue, &queue_config)) {
+            perror("queue init failed");
+            goto fail;
+        }
+        // The upstreams would get the middle of an RTMP stream without the handshake, connect and publish
+        if (client_fd == -1 && queue_file_tag(&session->queue) != SESSION_STATE_RAW) {
+            fprintf(stderr, "deleting %s: it's not known to be a raw stream, only those are resumed\n", state_path);
+            goto fail;
+        }
+        if (!rtmp_parser_init(&session->rtmp)) {
+            perror("rtmp parser init failed");
+            goto fail;
+        }
+        // Only the requests made from now on apply to the session
+        session->dump_requests = config->dump_requests;
+        if (session->dump_requests != nullptr)
+            session->dump_generation = atomic_load_explicit(session->dump_requests, memory_order_relaxed);
+    }
+
+    const int yes = 1;
+    if (client_fd != -1 && setsockopt(client_fd, SOL_SOCKET, SO_TIMESTAMPNS, &yes, sizeof(yes)) == -1)
+        perror("setsockopt timestampns");
+
+    session->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (session->timer_fd == -1) {
+        perror("timerfd_create");
+        goto fail;
+    }
+
+    session->upstream_count = config->upstream_count > 0 ? config->upstream_count : 1;
+    for (int i = 0; i < session->upstream_count; i++) {
+        session->upstreams[i].fd = -1;
+        session->upstreams[i].source = (session_source_t) {session, SESSION_SOURCE_UPSTREAM, i};
+    }
+
+    for (int i = 0; i < session->upstream_count; i++) {
+        session_upstream_t *upstream = &session->upstreams[i];
+        if (config->upstream_count > 0) {
+            upstream->fd = session_upstream_connect(config->upstreams[i]);
+            if (upstream->fd == -1)
+                goto fail;
+            upstream->owns_fd = true;
+            // Nothing can be written until the connection is established
+            upstream->blocked = true;
+        } else {
+            upstream->fd = STDOUT_FILENO;
+        }
+        session->upstreams_open++;
+
+        // Every upstream reads the one copy of the stream at its own pace
+        if (!session->splice
+            && !queue_cursor_attach(&session->queue, &upstream->cursor, config->max_upstream_lag)) {
+            perror("queue cursor attach failed");
+            goto fail;
+        }
+
+        // Replies come back from the start, the connection has to be established before anything is written
+        if (upstream->owns_fd) {
+            upstream->events = EPOLLIN | EPOLLOUT;
+            if (!session_epoll_add(session, upstream->fd, upstream->events, &upstream->source))
+                goto fail;
+        }
+    }
+
+    session->client_events = EPOLLIN | EPOLLRDHUP;
+    if ((client_fd != -1 && !session_epoll_add(session, client_fd, session->client_events, &session->client_source))
+        || !session_epoll_add(session, session->timer_fd, EPOLLIN, &session->timer_source))
+        goto fail;
+
+    return true;
+
+fail:
+    session_destroy(session);
+    return false;
+}
+
+bool session_init(session_t *session, const int epoll_fd, const int client_fd, const session_config_t *config) {
+    if (session == nullptr || config == nullptr || config->stats == nullptr) {
+        close(client_fd);
+        return false;
+    }
+
+    char *state_path = nullptr;
+    if (config->state_directory != nullptr && !config->splice) {
+        state_path = session_state_path(config->state_directory);
+        if (state_path == nullptr) {
+            perror("session state path");
+            close(client_fd);
+            return false;
+        }
+    }
+
+    return session_setup(session, epoll_fd, client_fd, state_path, config);
+}
+
+bool session_resume(session_t *session, const int epoll_fd, const char *state_path,
+                    const session_config_t *config) {
+    if (session == nullptr || state_path == nullptr || config == nullptr || config->stats == nullptr
+        || config->splice)
+        return false;
+
+    char *path = strdup(state_path);
+    if (path == nullptr) {
+        perror("session state path");
+        return false;
+    }
+    if (!session_setup(session, epoll_fd, -1, path, config))
+        return false;
+
+    queue_stats_t stats;
+    queue_get_stats(&session->queue, &stats);
+    fprintf(stderr, "resuming %" PRIu64 " packets in %" PRIu64 " queued bytes from %s\n",
+            stats.queued_items, stats.used_bytes, state_path);
+
+    // Released as soon as the upstreams are connected, or over right away if nothing was left
+    if (!session_arm_timer(session, 0)) {
+        session_destroy(session);
+        return false;
+    }
+    return true;
+}
+
+void session_destroy(session_t *session) {
+    if (session == nullptr)
+        return;
+
+    // Closing the descriptors removes them from epoll
+    if (session->client_fd != -1)
+        close(session->client_fd);
+    for (int i = 0; i < session->upstream_count; i++)
+        session_upstream_close(session, &session->upstreams[i]);
+    if (session->timer_fd != -1)
+        close(session->timer_fd);
+    session->client_fd = session->timer_fd = -1;
+    session->closed = true;
+    session_stats_add(&session->stats->sessions_active, (uint64_t) -1);
+
+    // The queue goes away, only its totals stay counted
+    const session_queue_report_t gone = {
+        .queue_resizes = session->reported.queue_resizes,
+        .dropped_items = session->reported.dropped_items,
+        .dropped_bytes = session->reported.dropped_bytes
+    };
+    session_stats_report(session->stats, &session->reported, &gone);
+
+    if (session->splice) {
+        pipe_queue_destroy(&session->pipe_queue);
+    } else {
+        queue_destroy(&session->queue);
+        rtmp_parser_destroy(&session->rtmp);
+    }
+
+    // The whole window has been released, or it's lost anyway
+    if (session->state_path != nullptr) {
+        unlink(session->state_path);
+        free(session->state_path);
+        session->state_path = nullptr;
+    }
+}
+
+/**
+ * Receive from the socket along with the time the data has arrived to the host.
+ *
+ * @param [in] fd the socket with SO_TIMESTAMPNS enabled
+ * @param [out] buffer the target buffer
+ * @param [in] size the target buffer's size in bytes
+ * @param [out] timestamp the arrival time in nanoseconds of CLOCK_MONOTONIC
+ * @returns The amount of received bytes, or -1 if failed
+ */
+static ssize_t session_recv_stamped(const int fd, char *buffer, const ssize_t size, int64_t *timestamp) {
+    struct iovec iov = {
+        .iov_base = buffer,
+        .iov_len = size
+    };
+    union {
+        char buffer[CMSG_SPACE(sizeof(struct timespec))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buffer,
+        .msg_controllen = sizeof(control.buffer)
+    };
+
+    const ssize_t received = recvmsg(fd, &msg, 0);
+    if (received <= 0)
+        return received;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            struct timespec ts;
+            memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+            *timestamp = edelay_realtime_to_monotonic(&ts);
+            return received;
+        }
+    }
+
+    // No kernel timestamp, fall back to the time recvmsg has returned
+    *timestamp = edelay_now();
+    return received;
+}
+
+/**
+ * Get the arrival time up to which the packets are due. With a release quantum only what has fallen due by the latest
+ * point of the grid goes out, the rest waits for the next one, whatever wakes the session up in between.
+ *
+ * @param [in] session a pointer to the session
+ * @param [in] now the current time in nanoseconds of CLOCK_MONOTONIC
+ * @returns The arrival time in nanoseconds of CLOCK_MONOTONIC
+ */
+static int64_t session_due_until(const session_t *session, const int64_t now) {
+    return edelay_round_down(now, session->release_quantum_ns) - session->delay_ns;
+}
+
+/**
+ * Release everything that is due from the pipes to the upstream, and arm the timer for the rest.
+ *
+ * @param [in] session a pointer to the session
+ * @returns true if the session goes on, false if it's over
+ */
+static bool session_release_spliced(session_t *session) {
+    session_upstream_t *upstream = &session->upstreams[0];
+    if (upstream->blocked)
+        return true;
+
+    const int64_t now = edelay_now();
+    const int64_t until = session_due_until(session, now);
+    const int64_t first_timestamp = pipe_queue_next_timestamp(&session->pipe_queue);
+    const ssize_t spliced = pipe_queue_splice_out(&session->pipe_queue, upstream->fd, until);
+    if (spliced == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("upstream splice");
+        return false;
+    }
+    if (spliced > 0) {
+        session_stats_add(&session->stats->released_writes, 1);
+        session_stats_add(&session->stats->released_bytes, spliced);
+        session_stats_lateness(session->stats, now, first_timestamp, session->delay_ns);
+        metrics_histogram_record(&session->stats->release_sizes, spliced);
+    }
+
+    const int64_t next_timestamp = pipe_queue_next_timestamp(&session->pipe_queue);
+    if (next_timestamp == -1 && session->client_fd == -1)
+        return false;
+
+    // Whatever is due but still queued is waiting for the upstream to take it
+    if (next_timestamp != -1 && next_timestamp <= until)
+        return session_arm_timer(session, -1) && session_set_upstream_blocked(session, upstream, true);
+
+    return session_arm_timer(session, next_timestamp == -1 ? -1 : next_timestamp + session->delay_ns);
+}
+
+/**
+ * Cut an upstream's stream once its release gets to a message boundary, going on from the latest key frame.
+ * Only audio and video messages are dropped. The stream is cut in O(1) by moving the upstream's cursor,
+ * whatever is in between is never looked into. Every upstream is cut on its own, at its own point of the stream.
+ *
+ * @param [in] session a pointer to the session
+ * @param [in] upstream the upstream being released to
+ * @returns How many bytes may be released before the stream is cut, 0 if the release has to wait for a key frame,
+ * or UINT64_MAX if no cut is pending
+ */
+static uint64_t session_dump(session_t *session, session_upstream_t *upstream) {
+    if (session->dump_requests != nullptr) {
+        const uint64_t generation = atomic_load_explicit(session->dump_requests, memory_order_relaxed);
+        if (generation != session->dump_generation) {
+            session->dump_generation = generation;
+            for (int i = 0; i < session->upstream_count; i++)
+                session->upstreams[i].dump_pending = true;
+        }
+    }
+    if (!upstream->dump_pending)
+        return UINT64_MAX;
+
+    if (session->rtmp.state == RTMP_STATE_INVALID) {
+        fprintf(stderr, "can't dump: not an RTMP stream\n");
+        upstream->dump_pending = false;
+        return UINT64_MAX;
+    }
+
+    // The message that is being released is finished first, it might even be all that is queued.
+    // The index goes back to the slowest upstream, this one may be further on.
+    const rtmp_boundary_t *boundary = rtmp_parser_next_boundary(&session->rtmp, upstream->released_offset);
+    if (boundary == nullptr)
+        return UINT64_MAX;
+    if (boundary->stream_offset > upstream->released_offset)
+        return boundary->stream_offset - upstream->released_offset;
+
+    // Nothing goes out until there is a key frame to go on from, unless the release has just been let through
+    // to the key frame because of the messages in front of it
+    const rtmp_boundary_t *keyframe = rtmp_parser_last_keyframe(&session->rtmp);
+    if (keyframe == nullptr || keyframe->stream_offset < upstream->released_offset
+        || (keyframe == boundary && keyframe->settled_sequence != session->rtmp.keyframe_sequence))
+        return 0;
+
+    // Only audio and video are dropped, the other messages in between have to go out first
+    const rtmp_boundary_t *settled = rtmp_parser_boundary(&session->rtmp, keyframe->settled_sequence);
+    if (settled != nullptr && settled->stream_offset > upstream->released_offset)
+        return settled->stream_offset - upstream->released_offset;
+
+    upstream->dump_pending = false;
+    if (!queue_cursor_skip_to(&session->queue, &upstream->cursor, &keyframe->mark, keyframe->offset)) {
+        fprintf(stderr, "can't dump upstream %d: the key frame is not queued anymore\n", upstream->source.upstream);
+        return UINT64_MAX;
+    }
+
+    fprintf(stderr, "dumped %" PRIu64 " bytes of upstream %d\n", keyframe->stream_offset - upstream->released_offset,
+            upstream->source.upstream);
+    // The boundaries behind the cut are pruned once every upstream is past them
+    upstream->released_offset = keyframe->stream_offset;
+    return UINT64_MAX;
+}
+
+/**
+ * Release every packet that is due to one of the upstreams.
+ *
+ * @param [in] session a pointer to the session
+ * @param [in] upstream the upstream
+ * @param [out] next_timestamp the timestamp of the first packet that isn't due yet, or -1 if the upstream
+ * isn't waiting for one
+ * @returns true if the upstream goes on, false if it's over
+ */
+static bool session_release_upstream(session_t *session, session_upstream_t *upstream, int64_t *next_timestamp) {
+    *next_timestamp = -1;
+    if (upstream->blocked)
+        return true;
+
+    struct iovec packets[SESSION_MAX_BATCH_PACKETS];
+    while (true) {
+        const uint64_t limit = session_dump(session, upstream);
+        // A broadcaster that is gone won't send a key frame anymore, the rest of the stream is dropped.
+        // Otherwise received key frames release it.
+        if (limit == 0)
+            return session->client_fd != -1;
+
+        // Gather everything that is due, so that a backlog goes out in one write
+        const int64_t now = edelay_now();
+        int64_t first_timestamp;
+        ssize_t count = queue_cursor_peek_spans(&session->queue, &upstream->cursor, session_due_until(session, now),
+                                                packets, SESSION_MAX_BATCH_PACKETS, &first_timestamp, next_timestamp);
+        if (count == -1) {
+            if (upstream->cursor.lapsed) {
+                fprintf(stderr, "upstream %d has fallen too far behind, cut off\n", upstream->source.upstream);
+                session_stats_add(&session->stats->upstreams_lapsed, 1);
+            } else {
+                fprintf(stderr, "queue peek fail\n");
+            }
+            return false;
+        }
+        if (count == 0)
+            break;
+
+        // Stop right at the cut
+        size_t total = 0;
+        for (ssize_t i = 0; i < count; i++) {
+            if (total + packets[i].iov_len >= limit) {
+                packets[i].iov_len = limit - total;
+                count = i + 1;
+            }
+            total += packets[i].iov_len;
+        }
+
+        ssize_t written = writev(upstream->fd, packets, (int) count);
+        if (written == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("upstream write");
+                queue_cursor_release(&session->queue, &upstream->cursor, 0);
+                return false;
+            }
+            written = 0;
+        }
+        queue_cursor_release(&session->queue, &upstream->cursor, written);
+        upstream->released_offset += written;
+        session_stats_add(&session->stats->released_writes, 1);
+        session_stats_add(&session->stats->released_bytes, written);
+        if (written > 0) {
+            session_stats_lateness(session->stats, now, first_timestamp, session->delay_ns);
+            metrics_histogram_record(&session->stats->release_sizes, written);
+        }
+
+        // The kernel holds as much as it's allowed to, go on once it has sent some of it
+        if ((size_t) written < total) {
+            *next_timestamp = -1;
+            return session_set_upstream_blocked(session, upstream, true);
+        }
+    }
+
+    // The broadcaster is gone and the rest of its stream has gone out
+    return *next_timestamp != -1 || session->client_fd != -1;
+}
+
+/**
+ * Release every packet that is due to the upstreams, and arm the timer for the next one.
+ *
+ * @param [in] session a pointer to the session
+ * @returns true if the session goes on, false if it's over
+ */
+static bool session_release_due(session_t *session) {
+    if (session->splice)
+        return session_release_spliced(session);
+
+    // Keeps only the hot ends of a long delay window in RAM, if the queue has a spill file
+    queue_spill(&session->queue, edelay_now() - session->delay_ns + SESSION_SPILL_READAHEAD_NS);
+
+    // An upstream that fails or falls behind is let go, the others don't wait for it
+    int64_t next_timestamp = -1;
+    uint64_t released_offset = UINT64_MAX;
+    for (int i = 0; i < session->upstream_count; i++) {
+        session_upstream_t *upstream = &session->upstreams[i];
+        if (upstream->fd == -1)
+            continue;
+
+        int64_t upstream_next;
+        if (!session_release_upstream(session, upstream, &upstream_next)) {
+            session_upstream_close(session, upstream);
+            continue;
+        }
+
+        if (upstream_next != -1 && (next_timestamp == -1 || upstream_next < next_timestamp))
+            next_timestamp = upstream_next;
+        if (upstream->released_offset < released_offset)
+            released_offset = upstream->released_offset;
+    }
+
+    if (session->upstreams_open == 0)
+        return false;
+
+    // The cuts are only ever made ahead of the slowest upstream
+    rtmp_parser_prune(&session->rtmp, released_offset);
+
+    return session_arm_timer(session, next_timestamp == -1 ? -1 : next_timestamp + session->delay_ns);
+}
+
+/**
+ * Release what is due, then bring the occupancy counters up to date with what is left.
+ *
+ * @param [in] session a pointer to the session
+ * @returns true if the session goes on, false if it's over
+ */
+static bool session_release(session_t *session) {
+    const bool result = session_release_due(session);
+
+    session_queue_report_t current;
+    if (session->splice) {
+        current = (session_queue_report_t) {
+            .queued_items = session->pipe_queue.entry_count,
+            .queued_bytes = session->pipe_queue.size,
+            .queue_capacity = session->pipe_queue.pipe_count * session->pipe_queue.pipe_size
+        };
+    } else {
+        queue_stats_t stats;
+        queue_get_stats(&session->queue, &stats);
+        current = (session_queue_report_t) {
+            .queued_items = stats.queued_items,
+            .queued_bytes = stats.used_bytes,
+            .queue_capacity = stats.capacity,
+            .queue_resizes = stats.resizes,
+            .dropped_items = stats.dropped_items,
+            .dropped_bytes = stats.dropped_bytes
+        };
+    }
+    session_stats_report(session->stats, &session->reported, &current);
+
+    return result;
+}
+
+/**
+ * Move what has arrived from the broadcaster into the pipes.
+ *
+ * @param [in] session a pointer to the session
+ * @returns true if the session goes on, false if it's over
+ */
+static bool session_receive_spliced(session_t *session) {
+    for (int i = 0; i < SESSION_MAX_RECEIVES; i++) {
+        // splice() doesn't pass the kernel timestamp on
+        const ssize_t received = pipe_queue_splice_in(&session->pipe_queue, session->client_fd,
+                                                      session->pipe_queue.pipe_size, edelay_now());
+        if (received <= 0) {
+            if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+                break;
+            if (received == -1)
+                perror("splice");
+
+            // Keep releasing what has been received so far
+            if (!session_client_close(session))
+                return false;
+            break;
+        }
+
+        session_stats_add(&session->stats->received_packets, 1);
+        session_stats_add(&session->stats->received_bytes, received);
+        metrics_histogram_record(&session->stats->receive_sizes, received);
+    }
+
+    return session_release(session);
+}
+
+/**
+ * Receive the packets that have arrived from the broadcaster straight into the queue.
+ *
+ * @param [in] session a pointer to the session
+ * @returns true if the session goes on, false if it's over
+ */
+static bool session_receive(session_t *session) {
+    if (session->splice)
+        return session_receive_spliced(session);
+
+    for (int i = 0; i < SESSION_MAX_RECEIVES; i++) {
+        char *packet = queue_reserve(&session->queue, SESSION_MAX_PACKET_SIZE);
+        if (packet == nullptr) {
+            fprintf(stderr, "queue reserve fail\n");
+            return false;
+        }
+
+        const queue_mark_t mark = queue_reserved_mark(&session->queue);
+        int64_t timestamp;
+        const ssize_t received = session_recv_stamped(session->client_fd, packet, SESSION_MAX_PACKET_SIZE,
+                                                      &timestamp);
+        if (received <= 0) {
+            (void) queue_commit(&session->queue, 0, 0);
+            if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+                break;
+            if (received == -1)
+                perror("recv");
+
+            // Keep releasing what has been received so far
+            if (!session_client_close(session))
+                return false;
+            break;
+        }
+
+        if (!queue_commit(&session->queue, received, timestamp)) {
+            fprintf(stderr, "queue commit fail\n");
+            return false;
+        }
+        // The packet is still hot in the cache, and only its chunk headers are looked into
+        rtmp_parser_feed(&session->rtmp, (const uint8_t *) packet, received, &mark);
+        // A restarted relay only resumes the streams that aren't RTMP at all
+        if (session->state_path != nullptr && session->rtmp.not_rtmp
+            && queue_file_tag(&session->queue) != SESSION_STATE_RAW)
+            (void) queue_set_file_tag(&session->queue, SESSION_STATE_RAW);
+        session_stats_add(&session->stats->received_packets, 1);
+        session_stats_add(&session->stats->received_bytes, received);
+        metrics_histogram_record(&session->stats->receive_sizes, received);
+    }
+
+    return session_release(session);
+}
+
+bool session_handle(const session_source_t *source, const uint32_t events) {
+    session_t *session = source->session;
+
+    switch (source->kind) {
+        case SESSION_SOURCE_CLIENT:
+            if (session->client_fd == -1)
+                return true;
+            if ((events & EPOLLOUT) && !session_reply_flush(session))
+                return false;
+            if ((events & ~EPOLLOUT) == 0)
+                return true;
+            return session_receive(session);
+        case SESSION_SOURCE_UPSTREAM: {
+            session_upstream_t *upstream = &session->upstreams[source->upstream];
+            if (upstream->fd == -1)
+                return true;
+            // Whatever the upstream has replied before hanging up still goes back
+            if ((events & EPOLLIN) && !session_upstream_reply(session, upstream))
+                return false;
+            if (upstream->fd == -1)
+                return true;
+            if (events & (EPOLLERR | EPOLLHUP)) {
+                int error = 0;
+                socklen_t length = sizeof(error);
+                getsockopt(upstream->fd, SOL_SOCKET, SO_ERROR, &error, &length);
+                fprintf(stderr, "upstream %d connection lost: %s\n", source->upstream, strerror(error));
+                // The stream goes on to the rest of them
+                session_upstream_close(session, upstream);
+                return session->upstreams_open > 0;
+            }
+            if ((events & EPOLLOUT) == 0)
+                return true;
+            return session_set_upstream_blocked(session, upstream, false) && session_release(session);
+        }
+        case SESSION_SOURCE_TIMER: {
+            uint64_t expirations;
+            if (read(session->timer_fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN) {
+                perror("timerfd read");
+                return false;
+            }
+            // Woken up early on purpose, the wakeup latency is taken before the deadline rather than after it
+            if (session->spin_ns > 0 && session->timer_deadline >= 0 && edelay_now() < session->timer_deadline) {
+                if (session_shard_busy(session))
+                    return session_sleep_until_deadline(session);
+                edelay_spin_until(session->timer_deadline);
+            }
+            session->timer_deadline = -1;
+            return session_release(session);
+        }
+    }
+
+    return true;
+}
@@ -0,0 +1,351 @@
+//
+// A single delayed stream: the broadcaster's connection, its queue and the connection to the destination server
+//
+
+#ifndef EMERGENCY_DELAY_SESSION_H
+#define EMERGENCY_DELAY_SESSION_H
+
+#include <netdb.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "edelay_time.h"
+#include "metrics.h"
+#include "pipe_queue.h"
+#include "queue.h"
+#include "rtmp.h"
+#include "c23_compat.h"
+
+#define SESSION_MAX_PACKET_SIZE 2048
+/**
+ * How many packets are gathered into a single write at most
+ */
+#define SESSION_MAX_BATCH_PACKETS 64
+/**
+ * How many packets are received in one go, so that a busy broadcaster doesn't starve the other sessions
+ */
+#define SESSION_MAX_RECEIVES 16
+/**
+ * How much unsent data the kernel may hold for the upstream, the rest stays in the queue where it can be cancelled
+ */
+#define SESSION_UPSTREAM_NOTSENT_LOWAT (16 * 1024)
+/**
+ * How far ahead of their release the spilled packets are read back from the disk
+ */
+#define SESSION_SPILL_READAHEAD_NS (2 * EDELAY_NS_PER_S)
+/**
+ * How many destination servers a session may fan its stream out to
+ */
+#define SESSION_MAX_UPSTREAMS 8
+/**
+ * The tag of a state file whose stream has turned out not to be RTMP. Only those windows are resumed, an RTMP
+ * server won't take the middle of a stream without the handshake, connect and publish it started with.
+ */
+#define SESSION_STATE_RAW 1
+
+typedef enum {
+    SESSION_SOURCE_CLIENT = 0,
+    SESSION_SOURCE_UPSTREAM = 1,
+    SESSION_SOURCE_TIMER = 2
+} session_source_kind_t;
+
+typedef struct session session_t;
+
+/**
+ * What an epoll event refers to, epoll_event.data.ptr points to one of these
+ */
+typedef struct {
+    session_t *session;
+    session_source_kind_t kind;
+    /**
+     * The upstream the event refers to, for SESSION_SOURCE_UPSTREAM
+     */
+    int upstream;
+} session_source_t;
+
+/**
+ * Counters of the sessions served by one thread. Only that thread writes them, any thread may read them.
+ */
+typedef struct {
+    _Atomic uint64_t sessions_started;
+    _Atomic uint64_t sessions_active;
+    _Atomic uint64_t received_packets;
+    _Atomic uint64_t received_bytes;
+    _Atomic uint64_t released_writes;
+    _Atomic uint64_t released_bytes;
+    /**
+     * The occupancy of the sessions' queues, the bytes include the records' headers
+     */
+    _Atomic uint64_t queued_items;
+    _Atomic uint64_t queued_bytes;
+    _Atomic uint64_t queue_capacity;
+    _Atomic uint64_t queue_resizes;
+    _Atomic uint64_t dropped_items;
+    _Atomic uint64_t dropped_bytes;
+    /**
+     * Upstreams cut off for falling too far behind the others of their session
+     */
+    _Atomic uint64_t upstreams_lapsed;
+    /**
+     * How late the first packet of each write went out: the write's time minus the packet's arrival and the delay,
+     * in nanoseconds
+     */
+    metrics_histogram_t release_lateness;
+    /**
+     * The sizes of the receives from the broadcasters and of the writes to the upstreams, in bytes
+     */
+    metrics_histogram_t receive_sizes;
+    metrics_histogram_t release_sizes;
+} session_stats_t;
+
+/**
+ * What a session has last added to the occupancy counters, so that only the changes are added the next time
+ */
+typedef struct {
+    uint64_t queued_items;
+    uint64_t queued_bytes;
+    uint64_t queue_capacity;
+    uint64_t queue_resizes;
+    uint64_t dropped_items;
+    uint64_t dropped_bytes;
+} session_queue_report_t;
+
+/**
+ * Add to a counter that only the current thread writes, without a locked instruction.
+ *
+ * @param [in] counter the counter
+ * @param [in] value the value to add
+ */
+static inline void session_stats_add(_Atomic uint64_t *counter, const uint64_t value) {
+    metrics_add(counter, value);
+}
+
+/**
+ * Bring the occupancy counters up to date with a session's queue. A gauge going down wraps the added value around.
+ *
+ * @param [in] stats the counters
+ * @param [in,out] reported what the session has added so far
+ * @param [in] current the state of the session's queue, all zeros but the totals once the session is over
+ */
+static inline void session_stats_report(session_stats_t *stats, session_queue_report_t *reported,
+                                        const session_queue_report_t *current) {
+    session_stats_add(&stats->queued_items, current->queued_items - reported->queued_items);
+    session_stats_add(&stats->queued_bytes, current->queued_bytes - reported->queued_bytes);
+    session_stats_add(&stats->queue_capacity, current->queue_capacity - reported->queue_capacity);
+    session_stats_add(&stats->queue_resizes, current->queue_resizes - reported->queue_resizes);
+    session_stats_add(&stats->dropped_items, current->dropped_items - reported->dropped_items);
+    session_stats_add(&stats->dropped_bytes, current->dropped_bytes - reported->dropped_bytes);
+    *reported = *current;
+}
+
+/**
+ * Record how late a write has gone out, from the arrival of its first packet.
+ *
+ * @param [in] stats the counters
+ * @param [in] now when the write went out
+ * @param [in] timestamp the arrival time of the first packet
+ * @param [in] delay_ns the delay
+ */
+static inline void session_stats_lateness(session_stats_t *stats, const int64_t now, const int64_t timestamp,
+                                          const int64_t delay_ns) {
+    const int64_t lateness = now - timestamp - delay_ns;
+    metrics_histogram_record(&stats->release_lateness, lateness > 0 ? (uint64_t) lateness : 0);
+}
+
+typedef struct {
+    /**
+     * How long the packets are held back, in nanoseconds
+     */
+    int64_t delay_ns;
+    /**
+     * The resolved destination servers the stream fans out to, it goes to stdout if there are none
+     */
+    const struct addrinfo *upstreams[SESSION_MAX_UPSTREAMS];
+    int upstream_count;
+    /**
+     * How far in bytes an upstream may fall behind the fastest one of its session before it's cut off,
+     * 0 for no limit
+     */
+    ssize_t max_upstream_lag;
+    /**
+     * How long before a deadline the release timer fires, the rest of the wait is spun away for an exact release.
+     * 0 to sleep until the deadline.
+     */
+    int64_t spin_ns;
+    /**
+     * The spacing of the grid the release deadlines are moved up to, in nanoseconds. The sessions of a thread wake
+     * up together once per quantum and release whatever has fallen due in one write each, at most a quantum late.
+     * 0 to release every packet at its own deadline.
+     */
+    int64_t release_quantum_ns;
+    queue_config_t queue_config;
+    /**
+     * Keep the stream in kernel pipes and move it with splice(), it never enters the user space.
+     * For pass-through streams that are never looked into.
+     */
+    bool splice;
+    /**
+     * Where the sessions count what they do, owned by the thread that serves them
+     */
+    session_stats_t *stats;
+    /**
+     * Bumped to have every session dump its queued stream up to the latest key frame, may be nullptr
+     */
+    const _Atomic uint64_t *dump_requests;
+    /**
+     * The directory every session keeps its queue in a file of, so that a restarted relay picks the delay window
+     * up with session_resume. nullptr to keep the queues in memory only.
+     */
+    const char *state_directory;
+} session_config_t;
+
+/**
+ * One of the destination servers of a session, reading the session's queue through a cursor of its own
+ */
+typedef struct {
+    /**
+     * The connection, -1 once the upstream is gone
+     */
+    int fd;
+    /**
+     * false if fd is stdout, which isn't closed along with the session
+     */
+    bool owns_fd;
+    /**
+     * Set while the upstream can't take any more data, its release goes on when it becomes writable
+     */
+    bool blocked;
+    /**
+     * The events the upstream is registered with epoll for
+     */
+    uint32_t events;
+    /**
+     * Where the upstream is in the session's queue
+     */
+    queue_cursor_t cursor;
+    /**
+     * How many bytes of the stream have left the queue for the upstream, either released or dumped
+     */
+    uint64_t released_offset;
+    /**
+     * Set from a dump request until the upstream's stream has been cut
+     */
+    bool dump_pending;
+    session_source_t source;
+} session_upstream_t;
+
+struct session {
+    queue_t queue;
+    /**
+     * Used instead of the queue if splice is set
+     */
+    pipe_queue_t pipe_queue;
+    bool splice;
+    int64_t delay_ns;
+    int64_t spin_ns;
+    int64_t release_quantum_ns;
+    session_stats_t *stats;
+
+    int epoll_fd;
+    /**
+     * The broadcaster's socket, -1 once it has disconnected and the rest of the stream is being released
+     */
+    int client_fd;
+    /**
+     * The events the broadcaster's socket is registered with epoll for
+     */
+    uint32_t client_events;
+    /**
+     * What the first upstream has replied and the broadcaster hasn't taken yet, from reply_start to reply_end.
+     * The replies aren't delayed, the handshake and the answers to the broadcaster's commands pass straight through.
+     */
+    char reply[SESSION_MAX_PACKET_SIZE];
+    size_t reply_start;
+    size_t reply_end;
+    /**
+     * Where the stream goes, only the first one with splice
+     */
+    session_upstream_t upstreams[SESSION_MAX_UPSTREAMS];
+    int upstream_count;
+    /**
+     * How many upstreams are still there, the session is over once none are
+     */
+    int upstreams_open;
+    /**
+     * Releases the first packet in the queue once it's due
+     */
+    int timer_fd;
+    /**
+     * The deadline timer_fd is armed for, or -1 if it's disarmed. The timer itself fires spin_ns earlier.
+     */
+    int64_t timer_deadline;
+
+    /**
+     * Indexes where the queued stream can be cut without breaking the downstream player
+     */
+    rtmp_parser_t rtmp;
+    /**
+     * What the session has last added to the occupancy counters
+     */
+    session_queue_report_t reported;
+    const _Atomic uint64_t *dump_requests;
+    /**
+     * The last dump request the session has seen
+     */
+    uint64_t dump_generation;
+    /**
+     * Set once the session is over, its events that are still pending must be ignored
+     */
+    bool closed;
+    /**
+     * The file the queue is kept in, removed once the session is over, or nullptr if there is none
+     */
+    char *state_path;
+
+    session_source_t client_source;
+    session_source_t timer_source;
+};
+
+/**
+ * Initialize the session for an accepted connection and register its descriptors with epoll.
+ *
+ * @param [out] session a pointer to the session
+ * @param [in] epoll_fd the epoll instance that drives the session
+ * @param [in] client_fd the broadcaster's socket, owned by the session from now on
+ * @param [in] config the session's configuration
+ * @returns true if succeeded, false if failed. The client socket is closed in either case on failure.
+ */
+NODISCARD bool session_init(session_t *session, int epoll_fd, int client_fd, const session_config_t *config);
+
+/**
+ * Pick up the delay window a session of an earlier relay has left in a file, and release the rest of it on time
+ * to fresh connections to the upstreams. The broadcaster is gone, so the session is over once the window is.
+ * Only the windows of raw streams are picked up, the file of an RTMP stream is removed.
+ *
+ * @param [out] session a pointer to the session
+ * @param [in] epoll_fd the epoll instance that drives the session
+ * @param [in] state_path the file the earlier session kept its queue in, removed once the session is over
+ * @param [in] config the session's configuration
+ * @returns true if succeeded, false if failed
+ */
+NODISCARD bool session_resume(session_t *session, int epoll_fd, const char *state_path,
+                              const session_config_t *config);
+
+/**
+ * Close the session's descriptors, free its queue and remove the queue's file.
+ *
+ * @param [in] session a pointer to the session
+ */
+void session_destroy(session_t *session);
+
+/**
+ * Handle the epoll event.
+ *
+ * @param [in] source the source the event refers to
+ * @param [in] events the epoll event mask
+ * @returns true if the session goes on, false if it's over and has to be destroyed
+ */
+NODISCARD bool session_handle(const session_source_t *source, uint32_t events);
+
+#endif //EMERGENCY_DELAY_SESSION_H
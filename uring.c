@@ -0,0 +1,754 @@
+//
+// io_uring I/O backend, built with -DEDELAY_IO_URING=ON
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdalign.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include "uring.h"
+#include "edelay_time.h"
+#include "c23_compat.h"
+
+/**
+ * What a completion is for, kept in the low bits of user_data next to the session pointer
+ */
+typedef enum {
+    URING_OP_ACCEPT = 0,
+    URING_OP_READ = 1,
+    URING_OP_WRITE = 2,
+    URING_OP_TIMEOUT = 3,
+    URING_OP_CONNECT = 4,
+    URING_OP_CANCEL = 5,
+    URING_OP_REPLY_READ = 6,
+    URING_OP_REPLY_WRITE = 7
+} uring_op_t;
+
+#define URING_OP_MASK 7ULL
+
+/**
+ * The submission and completion rings shared with the kernel
+ */
+typedef struct {
+    int fd;
+    unsigned sq_entries;
+    _Atomic unsigned *sq_head;
+    _Atomic unsigned *sq_tail;
+    unsigned sq_mask;
+    /**
+     * Our copy of the tail, published to the kernel on submission
+     */
+    unsigned sq_local_tail;
+    struct io_uring_sqe *sqes;
+    _Atomic unsigned *cq_head;
+    _Atomic unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *ring_memory;
+    size_t ring_size;
+    size_t sqes_size;
+} uring_t;
+
+typedef struct {
+    queue_t queue;
+    int64_t delay_ns;
+    session_stats_t *stats;
+
+    int client_fd;
+    int upstream_fd;
+    /**
+     * false if upstream_fd is stdout, which isn't closed along with the session
+     */
+    bool owns_upstream;
+    /**
+     * The slot of the queue buffer in the ring's registered buffers
+     */
+    int buffer_index;
+    bool connected;
+    /**
+     * Set once the broadcaster is gone, the session ends when the rest of the stream is released
+     */
+    bool client_done;
+    bool closing;
+    bool reading;
+    bool timeout_pending;
+    int writes_pending;
+    /**
+     * What the upstream has replied, passed back to the broadcaster without a delay, from reply_start to reply_end
+     */
+    char reply[SESSION_MAX_PACKET_SIZE];
+    size_t reply_start;
+    size_t reply_end;
+    /**
+     * Every submitted operation that hasn't completed yet, the session is freed once there are none
+     */
+    int in_flight;
+    /**
+     * The absolute deadline of the pending timeout, read by the kernel on submission
+     */
+    struct __kernel_timespec release_at;
+    /**
+     * What the session has last added to the occupancy counters
+     */
+    session_queue_report_t reported;
+} uring_session_t;
+
+typedef struct {
+    uring_t ring;
+    int socket_fd;
+    const session_config_t *config;
+    queue_config_t queue_config;
+    int free_buffers[URING_MAX_SESSIONS];
+    int free_buffer_count;
+} uring_server_t;
+
+static int uring_setup(const unsigned entries, struct io_uring_params *params) {
+    return (int) syscall(SYS_io_uring_setup, entries, params);
+}
+
+static int uring_register(const int fd, const unsigned opcode, const void *arg, const unsigned count) {
+    return (int) syscall(SYS_io_uring_register, fd, opcode, arg, count);
+}
+
+static void uring_destroy(uring_t *ring) {
+    if (ring->sqes != nullptr)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->ring_memory != nullptr)
+        munmap(ring->ring_memory, ring->ring_size);
+    if (ring->fd != -1)
+        close(ring->fd);
+}
+
+static bool uring_init(uring_t *ring, const unsigned entries) {
+    bzero(ring, sizeof(*ring));
+
+    struct io_uring_params params;
+    bzero(&params, sizeof(params));
+    // Completions may pile up while a burst is being submitted, the kernel keeps the overflow anyway
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    params.cq_entries = entries * 4;
+    ring->fd = uring_setup(entries, &params);
+    if (ring->fd == -1 && errno == EINVAL) {
+        // Single issuer and deferred task work are only an optimization
+        params.flags = IORING_SETUP_CQSIZE;
+        ring->fd = uring_setup(entries, &params);
+    }
+    if (ring->fd == -1)
+        return false;
+
+    if ((params.features & IORING_FEAT_SINGLE_MMAP) == 0 || (params.features & IORING_FEAT_NODROP) == 0) {
+        errno = ENOTSUP;
+        goto fail;
+    }
+
+    const size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    const size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->ring_memory = mmap(nullptr, ring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ring->fd, IORING_OFF_SQ_RING);
+    if (ring->ring_memory == MAP_FAILED) {
+        ring->ring_memory = nullptr;
+        goto fail;
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(nullptr, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = nullptr;
+        goto fail;
+    }
+
+    char *memory = ring->ring_memory;
+    ring->sq_entries = params.sq_entries;
+    ring->sq_head = (_Atomic unsigned *) (memory + params.sq_off.head);
+    ring->sq_tail = (_Atomic unsigned *) (memory + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *) (memory + params.sq_off.ring_mask);
+    ring->cq_head = (_Atomic unsigned *) (memory + params.cq_off.head);
+    ring->cq_tail = (_Atomic unsigned *) (memory + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *) (memory + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (memory + params.cq_off.cqes);
+    ring->sq_local_tail = atomic_load_explicit(ring->sq_tail, memory_order_relaxed);
+
+    // The submission entries are used in order, so the indirection array is the identity
+    unsigned *array = (unsigned *) (memory + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; i++)
+        array[i] = i;
+
+    return true;
+
+fail:
+    uring_destroy(ring);
+    return false;
+}
+
+/**
+ * Submit the queued entries and wait for completions.
+ *
+ * @param [in] ring the ring
+ * @param [in] wait the amount of completions to wait for
+ * @returns true if succeeded, false if failed
+ */
+static bool uring_submit(uring_t *ring, const unsigned wait) {
+    atomic_store_explicit(ring->sq_tail, ring->sq_local_tail, memory_order_release);
+    const unsigned to_submit = ring->sq_local_tail - atomic_load_explicit(ring->sq_head, memory_order_acquire);
+
+    while (syscall(SYS_io_uring_enter, ring->fd, to_submit, wait, IORING_ENTER_GETEVENTS, nullptr, 0) == -1) {
+        if (errno != EINTR)
+            return false;
+    }
+
+    return true;
+}
+
+/**
+ * Make sure the submission ring has room for the entries, submitting the queued ones if it doesn't.
+ * Linked entries must be queued together, a submission ends their chain.
+ *
+ * @param [in] ring the ring
+ * @param [in] count the amount of entries
+ */
+static void uring_make_room(uring_t *ring, const unsigned count) {
+    while (ring->sq_local_tail - atomic_load_explicit(ring->sq_head, memory_order_acquire) + count
+           > ring->sq_entries) {
+        if (!uring_submit(ring, 0)) {
+            perror("io_uring_enter");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/**
+ * Get an empty submission entry, submitting the queued ones if the ring is full.
+ *
+ * @param [in] ring the ring
+ * @returns A pointer to the zeroed entry
+ */
+static struct io_uring_sqe *uring_get_sqe(uring_t *ring) {
+    uring_make_room(ring, 1);
+
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sq_local_tail & ring->sq_mask];
+    bzero(sqe, sizeof(*sqe));
+    ring->sq_local_tail++;
+    return sqe;
+}
+
+static uint64_t uring_user_data(const uring_session_t *session, const uring_op_t op) {
+    return (uint64_t) (uintptr_t) session | op;
+}
+
+static bool uring_register_sparse_buffers(const uring_t *ring) {
+    struct io_uring_rsrc_register registration;
+    bzero(&registration, sizeof(registration));
+    registration.nr = URING_MAX_SESSIONS;
+    registration.flags = IORING_RSRC_REGISTER_SPARSE;
+    return uring_register(ring->fd, IORING_REGISTER_BUFFERS2, &registration, sizeof(registration)) == 0;
+}
+
+/**
+ * Put the buffer into the slot of the registered buffers, or empty the slot if the buffer is nullptr.
+ */
+static bool uring_update_buffer(const uring_t *ring, const int index, void *buffer, const size_t size) {
+    struct iovec iov = {
+        .iov_base = buffer,
+        .iov_len = size
+    };
+    struct io_uring_rsrc_update2 update;
+    bzero(&update, sizeof(update));
+    update.offset = index;
+    update.data = (uint64_t) (uintptr_t) &iov;
+    update.nr = 1;
+    return uring_register(ring->fd, IORING_REGISTER_BUFFERS_UPDATE, &update, sizeof(update)) == 1;
+}
+
+bool uring_is_supported(void) {
+    uring_t ring;
+    if (!uring_init(&ring, 2))
+        return false;
+
+    // Sparse registration came last of everything the backend uses
+    const bool supported = uring_register_sparse_buffers(&ring);
+    uring_destroy(&ring);
+    return supported;
+}
+
+static void uring_session_close(uring_server_t *server, uring_session_t *session);
+
+/**
+ * Free the closed session once the kernel is done with it.
+ */
+static void uring_session_try_free(uring_server_t *server, uring_session_t *session) {
+    if (!session->closing || session->in_flight > 0)
+        return;
+
+    if (session->buffer_index != -1) {
+        uring_update_buffer(&server->ring, session->buffer_index, nullptr, 0);
+        server->free_buffers[server->free_buffer_count++] = session->buffer_index;
+    }
+    if (session->client_fd != -1)
+        close(session->client_fd);
+    if (session->owns_upstream && session->upstream_fd != -1)
+        close(session->upstream_fd);
+    session_stats_add(&session->stats->sessions_active, (uint64_t) -1);
+
+    // The queue goes away, only its totals stay counted
+    const session_queue_report_t gone = {
+        .queue_resizes = session->reported.queue_resizes,
+        .dropped_items = session->reported.dropped_items,
+        .dropped_bytes = session->reported.dropped_bytes
+    };
+    session_stats_report(session->stats, &session->reported, &gone);
+
+    queue_destroy(&session->queue);
+    free(session);
+}
+
+static bool uring_is_registered(const uring_session_t *session, const char *buffer, const size_t size) {
+    const char *registered = session->queue.buffer;
+    return buffer >= registered && buffer + size <= registered + queue_size(&session->queue);
+}
+
+static void uring_prep_rw(struct io_uring_sqe *sqe, const uint8_t opcode, const int fd, const void *buffer,
+                          const size_t size, const uring_session_t *session) {
+    const bool fixed = uring_is_registered(session, buffer, size);
+    sqe->opcode = fixed ? opcode : opcode == IORING_OP_READ_FIXED ? IORING_OP_READ : IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) (uintptr_t) buffer;
+    sqe->len = size;
+    // Sockets have no position
+    sqe->off = (uint64_t) -1;
+    if (fixed)
+        sqe->buf_index = session->buffer_index;
+}
+
+/**
+ * Receive the next packet straight into the queue.
+ */
+static void uring_session_read(uring_server_t *server, uring_session_t *session) {
+    if (session->closing || session->client_done)
+        return;
+
+    // The reservation is held until the read completes, only the padding and the skip buffer aren't registered
+    char *packet = queue_reserve(&session->queue, SESSION_MAX_PACKET_SIZE);
+    if (packet == nullptr) {
+        fprintf(stderr, "queue reserve fail\n");
+        uring_session_close(server, session);
+        return;
+    }
+
+    struct io_uring_sqe *sqe = uring_get_sqe(&server->ring);
+    uring_prep_rw(sqe, IORING_OP_READ_FIXED, session->client_fd, packet, SESSION_MAX_PACKET_SIZE, session);
+    sqe->user_data = uring_user_data(session, URING_OP_READ);
+    session->reading = true;
+    session->in_flight++;
+}
+
+/**
+ * Read the upstream's next reply.
+ */
+static void uring_session_read_reply(uring_server_t *server, uring_session_t *session) {
+    if (session->closing)
+        return;
+
+    struct io_uring_sqe *sqe = uring_get_sqe(&server->ring);
+    uring_prep_rw(sqe, IORING_OP_READ_FIXED, session->upstream_fd, session->reply, sizeof(session->reply), session);
+    sqe->user_data = uring_user_data(session, URING_OP_REPLY_READ);
+    session->in_flight++;
+}
+
+/**
+ * Pass the rest of the reply on to the broadcaster, or read the next one once it's all gone or has nowhere to go.
+ */
+static void uring_session_write_reply(uring_server_t *server, uring_session_t *session) {
+    if (session->closing)
+        return;
+    if (session->client_done || session->reply_start == session->reply_end) {
+        uring_session_read_reply(server, session);
+        return;
+    }
+
+    struct io_uring_sqe *sqe = uring_get_sqe(&server->ring);
+    uring_prep_rw(sqe, IORING_OP_WRITE_FIXED, session->client_fd, session->reply + session->reply_start,
+                  session->reply_end - session->reply_start, session);
+    sqe->user_data = uring_user_data(session, URING_OP_REPLY_WRITE);
+    session->in_flight++;
+}
+
+/**
+ * Queue a write of the span from the queue to the upstream.
+ */
+static void uring_session_write(uring_server_t *server, uring_session_t *session, const struct iovec *span,
+                                const bool link) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&server->ring);
+    uring_prep_rw(sqe, IORING_OP_WRITE_FIXED, session->upstream_fd, span->iov_base, span->iov_len, session);
+    if (link)
+        sqe->flags |= IOSQE_IO_LINK;
+    sqe->user_data = uring_user_data(session, URING_OP_WRITE);
+    session->writes_pending++;
+    session->in_flight++;
+}
+
+/**
+ * Submit the writes of everything that is due, or a write of the first packet linked to a timeout at its deadline.
+ */
+static void uring_session_release(uring_server_t *server, uring_session_t *session) {
+    // Whatever has completed since the last time is reflected in the occupancy
+    queue_stats_t stats;
+    queue_get_stats(&session->queue, &stats);
+    const session_queue_report_t current = {
+        .queued_items = stats.queued_items,
+        .queued_bytes = stats.used_bytes,
+        .queue_capacity = stats.capacity,
+        .queue_resizes = stats.resizes,
+        .dropped_items = stats.dropped_items,
+        .dropped_bytes = stats.dropped_bytes
+    };
+    session_stats_report(session->stats, &session->reported, &current);
+
+    if (session->closing || !session->connected || session->writes_pending > 0 || session->timeout_pending)
+        return;
+
+    struct iovec spans[SESSION_MAX_BATCH_PACKETS];
+    int64_t next_timestamp;
+    // Like the deadlines, the cutoff sits on the grid, so what falls due between two points waits for the next one
+    const int64_t until = edelay_round_down(edelay_now(), server->config->release_quantum_ns) - session->delay_ns;
+    const ssize_t count = queue_peek_spans(&session->queue, until, spans, SESSION_MAX_BATCH_PACKETS, nullptr,
+                                           &next_timestamp);
+    if (count == -1) {
+        fprintf(stderr, "queue peek fail\n");
+        uring_session_close(server, session);
+        return;
+    }
+
+    if (count > 0) {
+        // The writes go out in order, a short one cancels those linked after it
+        uring_make_room(&server->ring, count);
+        for (ssize_t i = 0; i < count; i++)
+            uring_session_write(server, session, &spans[i], i + 1 < count);
+        // Nothing moves the queue buffer, so the spans stay valid after the peek is over
+        queue_release(&session->queue, 0);
+        return;
+    }
+
+    if (next_timestamp == -1) {
+        if (session->client_done && !session->reading)
+            uring_session_close(server, session);
+        return;
+    }
+
+    // Let the kernel send the first packet at its deadline, without waking us up in between
+    struct iovec span;
+    ssize_t size;
+    span.iov_base = (void *) queue_peek_span(&session->queue, &size, nullptr);
+    if (span.iov_base == nullptr)
+        return;
+    span.iov_len = size;
+
+    uring_make_room(&server->ring, 2);
+    const int64_t deadline = edelay_round_up(next_timestamp + session->delay_ns, server->config->release_quantum_ns);
+    session->release_at.tv_sec = deadline / EDELAY_NS_PER_S;
+    session->release_at.tv_nsec = deadline % EDELAY_NS_PER_S;
+    struct io_uring_sqe *sqe = uring_get_sqe(&server->ring);
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t) (uintptr_t) &session->release_at;
+    sqe->len = 1;
+    // An expired timeout doesn't fail the linked write
+    sqe->timeout_flags = IORING_TIMEOUT_ABS | IORING_TIMEOUT_ETIME_SUCCESS;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = uring_user_data(session, URING_OP_TIMEOUT);
+    session->timeout_pending = true;
+    session->in_flight++;
+
+    uring_session_write(server, session, &span, false);
+    queue_release(&session->queue, 0);
+}
+
+/**
+ * Cancel everything the session has in flight, it's freed once the cancellations complete.
+ * There is always at least one, the one for the client socket, so the session outlives the call.
+ */
+static void uring_session_close(uring_server_t *server, uring_session_t *session) {
+    if (session->closing)
+        return;
+    session->closing = true;
+
+    const int fds[] = {session->client_fd, session->owns_upstream ? session->upstream_fd : -1};
+    for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+        if (fds[i] == -1)
+            continue;
+        struct io_uring_sqe *sqe = uring_get_sqe(&server->ring);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = fds[i];
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+        sqe->user_data = uring_user_data(session, URING_OP_CANCEL);
+        session->in_flight++;
+    }
+
+    if (session->timeout_pending) {
+        // Removing the timeout cancels the write linked to it
+        struct io_uring_sqe *sqe = uring_get_sqe(&server->ring);
+        sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = uring_user_data(session, URING_OP_TIMEOUT);
+        sqe->user_data = uring_user_data(session, URING_OP_CANCEL);
+        session->in_flight++;
+    }
+}
+
+/**
+ * Start connecting to the upstream server.
+ *
+ * @returns true if succeeded, false if failed
+ */
+static bool uring_session_connect(uring_server_t *server, uring_session_t *session,
+                                  const struct addrinfo *upstream) {
+    session->upstream_fd = socket(upstream->ai_family, upstream->ai_socktype | SOCK_CLOEXEC,
+                                  upstream->ai_protocol);
+    if (session->upstream_fd == -1) {
+        perror("upstream socket");
+        return false;
+    }
+    session->owns_upstream = true;
+
+    const int yes = 1;
+    if (setsockopt(session->upstream_fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)) == -1)
+        perror("setsockopt upstream tcp nodelay");
+
+    // Without the bound the effective delay grows by whatever the kernel has buffered
+    const int lowat = SESSION_UPSTREAM_NOTSENT_LOWAT;
+    if (setsockopt(session->upstream_fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat)) == -1)
+        perror("setsockopt upstream notsent lowat");
+
+    struct io_uring_sqe *sqe = uring_get_sqe(&server->ring);
+    sqe->opcode = IORING_OP_CONNECT;
+    sqe->fd = session->upstream_fd;
+    sqe->addr = (uint64_t) (uintptr_t) upstream->ai_addr;
+    sqe->off = upstream->ai_addrlen;
+    sqe->user_data = uring_user_data(session, URING_OP_CONNECT);
+    session->in_flight++;
+    return true;
+}
+
+static void uring_session_start(uring_server_t *server, const int client_fd) {
+    if (server->free_buffer_count == 0) {
+        fprintf(stderr, "too many sessions\n");
+        close(client_fd);
+        return;
+    }
+
+    uring_session_t *session = aligned_alloc(alignof(uring_session_t), sizeof(uring_session_t));
+    if (session == nullptr) {
+        perror("session alloc");
+        close(client_fd);
+        return;
+    }
+
+    bzero(session, sizeof(*session));
+    session->delay_ns = server->config->delay_ns;
+    session->stats = server->config->stats;
+    session->client_fd = client_fd;
+    session->upstream_fd = -1;
+    session->buffer_index = -1;
+    session_stats_add(&session->stats->sessions_started, 1);
+    session_stats_add(&session->stats->sessions_active, 1);
+
+    if (!queue_init_config(&session->queue, &server->queue_config)) {
+        perror("queue init failed");
+        goto fail;
+    }
+
+    const int buffer_index = server->free_buffers[--server->free_buffer_count];
+    if (!uring_update_buffer(&server->ring, buffer_index, session->queue.buffer, queue_size(&session->queue))) {
+        perror("io_uring buffer registration");
+        server->free_buffers[server->free_buffer_count++] = buffer_index;
+        goto fail;
+    }
+    session->buffer_index = buffer_index;
+
+    // Only the epoll sessions fan out, the first upstream is the only one here
+    if (server->config->upstream_count > 0) {
+        if (!uring_session_connect(server, session, server->config->upstreams[0]))
+            goto fail;
+    } else {
+        session->upstream_fd = STDOUT_FILENO;
+        session->connected = true;
+    }
+
+    uring_session_read(server, session);
+    return;
+
+fail:
+    session->closing = true;
+    uring_session_try_free(server, session);
+}
+
+static void uring_submit_accept(uring_server_t *server) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&server->ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = server->socket_fd;
+    // One submission keeps accepting until it fails
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = uring_user_data(nullptr, URING_OP_ACCEPT);
+}
+
+static void uring_complete(uring_server_t *server, const struct io_uring_cqe *cqe) {
+    const uring_op_t op = cqe->user_data & URING_OP_MASK;
+    uring_session_t *session = (uring_session_t *) (uintptr_t) (cqe->user_data & ~URING_OP_MASK);
+
+    if (op == URING_OP_ACCEPT) {
+        if (cqe->res >= 0)
+            uring_session_start(server, cqe->res);
+        else
+            fprintf(stderr, "accept: %s\n", strerror(-cqe->res));
+        if ((cqe->flags & IORING_CQE_F_MORE) == 0)
+            uring_submit_accept(server);
+        return;
+    }
+
+    session->in_flight--;
+    switch (op) {
+        case URING_OP_READ:
+            session->reading = false;
+            if (cqe->res > 0) {
+                (void) queue_commit(&session->queue, cqe->res, edelay_now());
+                session_stats_add(&session->stats->received_packets, 1);
+                session_stats_add(&session->stats->received_bytes, cqe->res);
+                metrics_histogram_record(&session->stats->receive_sizes, cqe->res);
+                uring_session_read(server, session);
+            } else {
+                (void) queue_commit(&session->queue, 0, 0);
+                if (cqe->res < 0 && cqe->res != -ECANCELED)
+                    fprintf(stderr, "recv: %s\n", strerror(-cqe->res));
+                // Keep releasing what has been received so far
+                session->client_done = true;
+            }
+            uring_session_release(server, session);
+            break;
+        case URING_OP_WRITE:
+            session->writes_pending--;
+            if (cqe->res > 0) {
+                ssize_t size;
+                int64_t timestamp;
+                if (queue_peek_span(&session->queue, &size, &timestamp) != nullptr) {
+                    // The write has just gone out, it's as late as the packet it started with
+                    session_stats_lateness(session->stats, edelay_now(), timestamp, session->delay_ns);
+                    queue_release(&session->queue, cqe->res);
+                }
+                session_stats_add(&session->stats->released_writes, 1);
+                session_stats_add(&session->stats->released_bytes, cqe->res);
+                metrics_histogram_record(&session->stats->release_sizes, cqe->res);
+            } else if (cqe->res < 0 && cqe->res != -ECANCELED) {
+                fprintf(stderr, "upstream write: %s\n", strerror(-cqe->res));
+                uring_session_close(server, session);
+            }
+            uring_session_release(server, session);
+            break;
+        case URING_OP_TIMEOUT:
+            session->timeout_pending = false;
+            uring_session_release(server, session);
+            break;
+        case URING_OP_CONNECT:
+            if (cqe->res < 0) {
+                fprintf(stderr, "upstream connection lost: %s\n", strerror(-cqe->res));
+                uring_session_close(server, session);
+                break;
+            }
+            session->connected = true;
+            uring_session_read_reply(server, session);
+            uring_session_release(server, session);
+            break;
+        case URING_OP_REPLY_READ:
+            if (cqe->res <= 0) {
+                if (cqe->res != -ECANCELED)
+                    fprintf(stderr, "upstream connection lost: %s\n",
+                            cqe->res == 0 ? "closed by the server" : strerror(-cqe->res));
+                uring_session_close(server, session);
+                break;
+            }
+            session->reply_start = 0;
+            session->reply_end = cqe->res;
+            uring_session_write_reply(server, session);
+            break;
+        case URING_OP_REPLY_WRITE:
+            if (cqe->res > 0) {
+                session->reply_start += cqe->res;
+            } else {
+                // The broadcaster is going away, its side of the session finds out when it's read from
+                if (cqe->res < 0 && cqe->res != -ECANCELED)
+                    fprintf(stderr, "reply send: %s\n", strerror(-cqe->res));
+                session->reply_start = session->reply_end;
+            }
+            uring_session_write_reply(server, session);
+            break;
+        case URING_OP_CANCEL:
+        case URING_OP_ACCEPT:
+            break;
+    }
+
+    uring_session_try_free(server, session);
+}
+
+void uring_serve(const int socket_fd, const session_config_t *config) {
+    uring_server_t *server = calloc(1, sizeof(uring_server_t));
+    if (server == nullptr || !uring_init(&server->ring, URING_ENTRIES)) {
+        perror("io_uring setup");
+        exit(EXIT_FAILURE);
+    }
+    if (!uring_register_sparse_buffers(&server->ring)) {
+        perror("io_uring buffer registration");
+        exit(EXIT_FAILURE);
+    }
+
+    server->socket_fd = socket_fd;
+    server->config = config;
+    for (int i = URING_MAX_SESSIONS - 1; i >= 0; i--)
+        server->free_buffers[server->free_buffer_count++] = i;
+
+    // The registered buffer can't move, so the queue never grows and drops what doesn't fit instead
+    server->queue_config = config->queue_config;
+    server->queue_config.initial_capacity = URING_QUEUE_CAPACITY;
+    server->queue_config.max_capacity = URING_QUEUE_CAPACITY;
+    server->queue_config.overflow_behavior = QUEUE_OVERFLOW_SKIP;
+    server->queue_config.backing = QUEUE_BACKING_HEAP;
+    server->queue_config.shrink_target = 0;
+
+    // The ring waits for the sockets itself, a non-blocking one would only make it fail with EAGAIN
+    const int flags = fcntl(socket_fd, F_GETFL);
+    if (flags == -1 || fcntl(socket_fd, F_SETFL, flags & ~O_NONBLOCK) == -1) {
+        perror("fcntl listener");
+        exit(EXIT_FAILURE);
+    }
+
+    uring_submit_accept(server);
+
+    while (true) {
+        if (!uring_submit(&server->ring, 1)) {
+            perror("io_uring_enter");
+            exit(EXIT_FAILURE);
+        }
+
+        unsigned head = atomic_load_explicit(server->ring.cq_head, memory_order_relaxed);
+        const unsigned tail = atomic_load_explicit(server->ring.cq_tail, memory_order_acquire);
+        for (; head != tail; head++) {
+            // Completing may submit and even wait for the ring, so the entry is copied out first
+            const struct io_uring_cqe cqe = server->ring.cqes[head & server->ring.cq_mask];
+            atomic_store_explicit(server->ring.cq_head, head + 1, memory_order_release);
+            uring_complete(server, &cqe);
+        }
+    }
+}
@@ -0,0 +1,40 @@
+//
+// io_uring I/O backend, built with -DEDELAY_IO_URING=ON
+//
+
+#ifndef EMERGENCY_DELAY_URING_H
+#define EMERGENCY_DELAY_URING_H
+
+#include <stdbool.h>
+
+#include "session.h"
+#include "c23_compat.h"
+
+/**
+ * The queue capacity of an io_uring session. The queue buffer is registered with the ring, so it can't grow:
+ * whatever doesn't fit is dropped.
+ */
+#define URING_QUEUE_CAPACITY (8 * 1024 * 1024)
+/**
+ * How many sessions a ring serves at most, one registered buffer each
+ */
+#define URING_MAX_SESSIONS 1024
+#define URING_ENTRIES 1024
+
+/**
+ * Check whether the kernel supports everything the backend needs.
+ *
+ * @returns true if it does, false if it doesn't
+ */
+bool uring_is_supported(void);
+
+/**
+ * Serve the sessions with a single io_uring until something goes terribly wrong.
+ * Every receive and release is submitted to the ring, both target the queue buffer registered with it.
+ *
+ * @param [in] socket_fd the listening socket
+ * @param [in] config the sessions' configuration
+ */
+void uring_serve(int socket_fd, const session_config_t *config);
+
+#endif //EMERGENCY_DELAY_URING_H